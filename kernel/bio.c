@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,70 +22,271 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "rusage.h"
+#include "proc.h"
 
-struct {
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+static void bput(struct buf*);
+
+#define BPP (PGSIZE / BSIZE)   // buffers per page of data
+#if PGSIZE % BSIZE != 0
+#error "BSIZE must divide PGSIZE"
+#endif
+#define NGROUP (NBUF / BPP)
+
+// The cached blocks are in a hash table keyed by (dev, blockno),
+// each chain with its own lock, so that lookups of different
+// blocks don't contend. Recycling a buffer for a block that
+// isn't cached needs the evict lock, which is the only time a
+// bucket lock is taken while holding another; the victim is
+// the free buffer released longest ago, by the time CSR.
+//
+// The cache grows by a page of data, a group of BPP buffers,
+// at a time: bget() adds a group instead of recycling while
+// there are unused groups and kalloc() has pages to spare.
+// When memory runs out, kalloc() calls breclaim() to give
+// back the page of a group none of whose buffers is in use.
+// The cache never shrinks below NBUFMIN buffers.
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock evict;
+  struct buf buf[NBUF];
+  uchar *page[NGROUP];   // data of group g's buffers, or 0
+  int ngroup;            // groups in use
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Put group g, with data page, into use. Its buffers hold no
+// block yet and have never been used, so they are recycled
+// first. Caller must hold the evict lock.
+static void
+bgrow(int g, uchar *page)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(0, 0)];
+  struct buf *b;
+
+  bcache.page[g] = page;
+  bcache.ngroup++;
+  acquire(&bk->lock);
+  for(int i = 0; i < BPP; i++){
+    b = &bcache.buf[g*BPP + i];
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    b->data = page + i*BSIZE;
+    b->next = bk->head;
+    bk->head = b;
+  }
+  release(&bk->lock);
+}
+
+// Return the index of a group not in use, or -1.
+// Caller must hold the evict lock.
+static int
+bunused(void)
+{
+  for(int g = 0; g < NGROUP; g++)
+    if(bcache.page[g] == 0)
+      return g;
+  return -1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  uchar *page;
+
+  initlock(&bcache.evict, "bcache.evict");
+  for(int i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache");
+  for(int i = 0; i < NBUF; i++)
+    initsleeplock(&bcache.buf[i].lock, "buffer");
 
-  initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(int g = 0; g*BPP < NBUFMIN; g++){
+    if((page = kalloc()) == 0)
+      panic("binit");
+    bgrow(g, page);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Give the data page of an unused group of buffers back to
+// kalloc(), if the cache is bigger than NBUFMIN buffers.
+// Called by kalloc() when it runs out of pages; all the
+// buckets are locked, so no one can find a buffer meanwhile.
+// Returns the number of pages freed.
+int
+breclaim(void)
+{
+  uchar *page = 0;
+  struct buf *b, **bp;
+  int g, i;
+
+  acquire(&bcache.evict);
+  if((bcache.ngroup - 1) * BPP < NBUFMIN){
+    release(&bcache.evict);
+    return 0;
+  }
+  for(i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i].lock);
+  for(g = NGROUP-1; g >= 0 && page == 0; g--){
+    if(bcache.page[g] == 0)
+      continue;
+    for(i = 0; i < BPP && bcache.buf[g*BPP + i].refcnt == 0; i++)
+      ;
+    if(i < BPP)
+      continue;
+    for(i = 0; i < BPP; i++){
+      b = &bcache.buf[g*BPP + i];
+      bp = &bcache.bucket[BHASH(b->dev, b->blockno)].head;
+      while(*bp != b)
+        bp = &(*bp)->next;
+      *bp = b->next;
+      b->data = 0;
+    }
+    page = bcache.page[g];
+    bcache.page[g] = 0;
+    bcache.ngroup--;
+  }
+  for(i = 0; i < NBUCKET; i++)
+    release(&bcache.bucket[i].lock);
+  release(&bcache.evict);
+
+  if(page == 0)
+    return 0;
+  kfree(page);
+  return 1;
+}
+
+// Find the cached buffer for block blockno of dev in bucket bk,
+// which the caller has locked, and take a reference to it.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return a referenced but unlocked buffer.
+static struct buf*
+bgetref(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct bucket *vbk = 0;
+  struct buf *b, *victim = 0, **bp;
+  uchar *page = 0;
+  int g;
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return b;
+
+  // Not cached. Get a page to grow the cache with, if it can.
+  // Only one CPU at a time recycles, so check that no other did
+  // so for this block meanwhile, then look in every bucket for
+  // the least recently used unused buffer, keeping the bucket
+  // of the best one so far locked.
+  if(bcache.ngroup < NGROUP)
+    page = ktryalloc();
+  acquire(&bcache.evict);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.evict);
+    if(page)
+      kfree(page);
+    return b;
+  }
+  if(page && (g = bunused()) >= 0){
+    bgrow(g, page);
+    page = 0;
+  }
+
+  for(struct bucket *c = bcache.bucket; c < &bcache.bucket[NBUCKET]; c++){
+    int better = 0;
+    acquire(&c->lock);
+    for(b = c->head; b; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        better = 1;
+      }
+    }
+    if(better){
+      if(vbk)
+        release(&vbk->lock);
+      vbk = c;
+    } else {
+      release(&c->lock);
     }
   }
-  panic("bget: no buffers");
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  // move it to bk's chain; no one else can add to bk meanwhile.
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  if(vbk != bk){
+    for(bp = &vbk->head; *bp != victim; bp = &(*bp)->next)
+      ;
+    *bp = victim->next;
+    release(&vbk->lock);
+    acquire(&bk->lock);
+    victim->next = bk->head;
+    bk->head = victim;
+  }
+  release(&bk->lock);
+  release(&bcache.evict);
+  if(page)
+    kfree(page);
+  return victim;
+}
+
+// Return the locked buffer for block blockno of dev, without
+// reading it; its data is only valid if valid is set. For
+// callers that overwrite the whole block.
+struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b = bgetref(dev, blockno);
+
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Charge the current process, if any, for reading or writing
+// n blocks.
+void
+iocount(int n, int write)
+{
+  struct proc *p = myproc();
+
+  if(p == 0)
+    return;
+  if(write)
+    p->ru.oublock += n;
+  else
+    p->ru.inblock += n;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,23 +297,65 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
+    iocount(1, 0);
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Start reading the n blocks blockno[0..n-1] of dev into the
+// cache, all together, without waiting for the reads. Skips
+// blocks already cached, and those whose buffer is in use,
+// which likely means it's being read already.
+void
+breadahead(uint dev, uint *blockno, int n)
+{
+  struct buf *b, *rb[READAHEAD+1];
+  int nr = 0;
+
+  for(int i = 0; i < n && nr < NELEM(rb); i++){
+    b = bgetref(dev, blockno[i]);
+    if(!b->valid && tryacquiresleep(&b->lock)){
+      if(!b->valid){
+        // the buffer stays locked and referenced until bdone().
+        disownsleep(&b->lock);
+        b->async = 1;
+        rb[nr++] = b;
+        continue;
+      }
+      releasesleep(&b->lock);
+    }
+    bput(b);
+  }
+  if(nr > 0){
+    iocount(nr, 0);
+    virtio_disk_start(rb, nr, 0);
+  }
+}
+
+// Called by virtio_disk_intr() when a read started by
+// breadahead() has finished.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasedisowned(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
+  iocount(1, 1);
   virtio_disk_rw(b, 1);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it was last used, for bget's choice of victim.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +363,38 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
+
+// Drop a reference to b.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = r_time();
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
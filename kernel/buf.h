@@ -1,12 +1,14 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // bdone() it when the disk is done, for read-ahead
+  int vq;      // disk queue it was last submitted to
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  uint64 lastuse;   // time CSR when refcnt last dropped to 0
+  struct buf *next; // hash chain
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
@@ -2,20 +2,30 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
+struct kcache;
 struct pipe;
+struct pollfd;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
+struct vmstat;
 
 // bio.c
 void            binit(void);
+struct buf*     bget(uint, uint);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             breclaim(void);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
+void            iocount(int, int);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +34,7 @@ void            consputc(int);
 
 // exec.c
 int             kexec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,11 +44,23 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewrite1(struct file*, int, uint64, int n);
+int             filereadv(struct file*, struct iovec*, int);
+int             filewritev(struct file*, struct iovec*, int);
+int             filesplice(struct file*, struct file*, int);
+int             filepread(struct file*, uint64, int n, uint off);
+int             filepwrite(struct file*, uint64, int n, uint off);
+int             fileseek(struct file*, int, int);
+int             fileallocate(struct file*, int, int);
+int             kpoll(struct pollfd*, struct file**, int, int);
+void            pollwakeup(void);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            direrase(struct inode*, char*, uint);
+void            dirunindex(struct inode*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
@@ -45,47 +68,102 @@ void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readblocks(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 void            ireclaim(int);
+void            iorphan(struct inode*);
+int             iprealloc(struct inode*, uint, uint);
 
 // kalloc.c
 void*           kalloc(void);
+void*           ktryalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kincref(void *);
+int             krefcount(void *);
+void*           kallocmega(void);
+void            kfreemega(void *);
+void            ksplit(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
 
+// mmap.c
+uint64          kmmap(struct file*, int, int, int, int);
+int             kmunmap(uint64, int);
+uint64          mmapbase(struct proc*);
+uint64          mmapget(struct vma*, uint64);
+void            mmapput(struct vma*, uint64, uint64);
+int             vmafork(struct proc*, struct proc*);
+void            munmapall(struct proc*);
+
+// pcache.c
+void            pcinit(void);
+uint64          pcget(struct inode*, uint);
+uint64          pcgetpriv(struct inode*, uint);
+void            pcwrite(struct inode*, uint, void*, uint);
+void            pcdrop(struct inode*);
+int             pcreclaim(void);
+
+// prof.c
+extern uint64   profinterval;
+void            profinit(void);
+void            profsample(void);
+int             profile(int);
+int             profread(uint64, int);
+
+// slab.c
+void            kcinit(struct kcache*, char*, uint, int, void (*)(void*));
+void*           kcalloc(struct kcache*);
+void            kcfree(struct kcache*, void*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
+int             pipesplice(struct pipe*, struct file*, int);
+int             pipepoll(struct pipe*);
 
 // printf.c
 int             printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
+void            printfstart(void);
+void            printdrain(void);
 
 // proc.c
 int             cpuid(void);
 void            kexit(int);
 int             kfork(void);
+int             kspawn(char*, char**, int*, int);
+int             kclone(uint64, uint64, uint64);
+int             kjoin(int, uint64);
+int             fdgrow(struct proc*);
+void            vmlock(struct proc*);
+void            vmunlock(struct proc*);
+int             kpageout(int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kkill(int);
+int             ksetpriority(int, int);
+int             ksetaffinity(int, uint64);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -96,7 +174,11 @@ void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             kwait(uint64);
+int             kgetrusage(int, uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
+int             kfutexwait(uint64, int);
+int             kfutexwake(uint64, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -112,12 +194,19 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             lockstatcopy(uint64, int);
+void            lockstatreset(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+int             tryacquiresleep(struct sleeplock*);
+void            disownsleep(struct sleeplock*);
+void            releasedisowned(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -128,6 +217,14 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+int             swapavail(void);
+int             swapalloc(void);
+void            swapdup(int);
+void            swapput(int);
+void            swaprw(int, uint64, int);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -135,10 +232,14 @@ void            argaddr(int, uint64 *);
 int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
+int             sysstatcopy(uint64, int, int);
 
 // trap.c
 extern uint     ticks;
+extern uint     tickwake;
 void            trapinit(void);
+void            timerset(int);
+void            tickupdate(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            prepare_return(void);
@@ -148,6 +249,8 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartwrite(char [], int);
 void            uartputc_sync(int);
+void            uartflush(void);
+int             uartqueue(char*, int);
 int             uartgetc(void);
 
 // vm.c
@@ -159,6 +262,8 @@ pagetable_t     uvmcreate(void);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+void            uvmflush(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -169,17 +274,35 @@ int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
 uint64          vmfault(pagetable_t, uint64, int);
+void            vmaput(struct vma*, int);
+int             vmaread(struct vma*, uint64, uint64);
+uint64          usersatp(struct proc*);
+void            tlbsync(struct proc*);
+void            uvmsync(pagetable_t);
+uint64          uvmfault(uint64, int);
+void            uvmprefault(uint64, int, int);
+int             uvmpageout(struct proc*, int);
+extern struct vmstat vmstat;
+
+// ucopy.S
+int             ucopy(char*, char*, uint64);
+int             ucopystr(char*, char*, uint64);
 
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
+int             irqroute(int, int);
+int             irqstatcopy(uint64, int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_intr(int);
+uint64          virtio_disk_size(uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,11 +3,13 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 // map ELF permissions to PTE permission bits.
 int flags2perm(int flags)
@@ -25,15 +27,36 @@ int flags2perm(int flags)
 //
 int
 kexec(char *path, char **argv)
+{
+  // the other threads would lose their memory.
+  if(myproc()->group->nthread > 1)
+    return -1;
+  return execproc(myproc(), path, argv);
+}
+
+//
+// replace the user image of process p, which is either the
+// current process or a new one being built by kspawn(), with
+// the program at path. returns argc, or -1 on error.
+//
+// program segments are not read into memory here. each
+// loadable segment is recorded as a vma backed by the
+// executable's inode, and vmfault() reads its pages from
+// the file the first time they are touched.
+//
+int
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+
+  memset(vma, 0, sizeof(vma));
 
   begin_op();
 
@@ -55,7 +78,7 @@ kexec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each program segment comes from.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -67,18 +90,29 @@ kexec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    // leave room for the stack below the mmap regions.
+    if(ph.vaddr + ph.memsz > MMAPTOP - (USERSTACK+1)*PGSIZE)
+      goto bad;
+    // the segment's file data must all be there, since
+    // it is only read later, at page-fault time.
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nvma >= NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = ph.vaddr + ph.memsz;
+    vma[nvma].perm = PTE_R | flags2perm(ph.flags);
+    vma[nvma].ip = idup(ip);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    nvma++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
@@ -127,13 +161,22 @@ kexec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image, holding the vm lock so that
+  // kpageout() doesn't page out of the old one meanwhile.
+  vmlock(p);
+  munmapall(p);
+  begin_op();
+  vmaput(p->vma, NVMA);
+  end_op();
+  memmove(p->vma, vma, sizeof(vma));
+  p->asidgen = 0;  // the old ASID's TLB entries are for oldpagetable
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  vmunlock(p);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -141,33 +184,13 @@ kexec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
+    vmaput(vma, NVMA);
     iunlockput(ip);
     end_op();
+  } else {
+    begin_op();
+    vmaput(vma, NVMA);
+    end_op();
   }
   return -1;
 }
-
-// Load an ELF program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -11,18 +11,37 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "stat.h"
+#include "fcntl.h"
+#include "rusage.h"
 #include "proc.h"
+#include "poll.h"
+#include "uio.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+// Open files come from an object cache, up to NFILE of them.
+// ftable.lock protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kcache cache;
 } ftable;
 
+// poll() callers wait here for any change that might make one
+// of their files ready. Each pollwakeup() bumps seq.
+struct {
+  struct spinlock lock;
+  uint seq;
+  int nwait;   // processes in poll()
+} pollq;
+
+static int filepoll(struct file*);
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kcinit(&ftable.cache, "file", sizeof(struct file), NFILE, 0);
+  initlock(&pollq.lock, "pollq");
 }
 
 // Allocate a file structure.
@@ -31,16 +50,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if((f = kcalloc(&ftable.cache)) != 0){
+    f->type = FD_NONE;
+    f->ref = 1;
   }
-  release(&ftable.lock);
-  return 0;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,14 +83,14 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kcfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_opn(IPUTBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -91,9 +105,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -111,12 +125,21 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // the copy out to addr happens with locks held.
+  uvmprefault(addr, n, 0);
+
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
     r = devsw[f->major].read(1, addr, n);
+  } else if(f->type == FD_INODE && f->ref == 1 && myproc()->group->nthread == 1){
+    // no one else can use f, and so its offset, meanwhile.
+    ilockshared(f->ip);
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+      f->off += r;
+    iunlockshared(f->ip);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
@@ -129,48 +152,147 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Read from file f into the niov buffers of iov, in order, as
+// one read() would: from an inode under one lock, and from a
+// pipe or device, stopping at a buffer that isn't filled, or
+// before one that would have to wait.
+// The buffers are at user virtual addresses.
+int
+filereadv(struct file *f, struct iovec *iov, int niov)
+{
+  int tot = 0, r = 0;
+
+  if(f->readable == 0)
+    return -1;
+
+  if(f->type != FD_INODE){
+    for(int i = 0; i < niov; i++){
+      if(i > 0 && (filepoll(f) & POLLIN) == 0)
+        break;
+      if((r = fileread(f, (uint64)iov[i].iov_base, iov[i].iov_len)) > 0)
+        tot += r;
+      if(r != iov[i].iov_len)
+        break;
+    }
+    return tot == 0 && r < 0 ? -1 : tot;
+  }
+
+  // the copy out happens with the lock held.
+  for(int i = 0; i < niov; i++)
+    uvmprefault((uint64)iov[i].iov_base, iov[i].iov_len, 0);
+  ilock(f->ip);
+  for(int i = 0; i < niov; i++){
+    if((r = readi(f->ip, 1, (uint64)iov[i].iov_base, f->off, iov[i].iov_len)) > 0){
+      f->off += r;
+      tot += r;
+    }
+    if(r != iov[i].iov_len)
+      break;
+  }
+  iunlock(f->ip);
+  return tot == 0 && r < 0 ? -1 : tot;
+}
+
+// Write the niov buffers of iov, in order, to inode file f at
+// *off, advancing *off, which f->off may be. If user is set,
+// the buffers are at user virtual addresses; otherwise, at
+// kernel addresses. As many bytes as fit go in each
+// transaction, whichever buffers they come from.
+static int
+fileiwritev(struct file *f, int user, struct iovec *iov, int niov, uint *off)
+{
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, up to three indirect blocks and their
+  // allocation blocks, data allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  int max = ((MAXOPBLOCKS-1-6-2) / 2) * BSIZE;
+  int i = 0, done = 0, n, n1, len, r = 0;
+
+  while(i < niov){
+    if(done == iov[i].iov_len){
+      i++;
+      done = 0;
+      continue;
+    }
+
+    // the rest of the buffers, up to max bytes.
+    n = 0;
+    for(int j = i; j < niov && n < max; j++)
+      n += iov[j].iov_len - (j == i ? done : 0);
+    if(n > max)
+      n = max;
+
+    // data and allocation blocks, plus the off-alignment
+    // slop, i-node, and indirect blocks.
+    begin_opn(2 * ((n + BSIZE - 1) / BSIZE) + 9);
+    ilock(f->ip);
+    for(n1 = 0; n1 < n; n1 += r){
+      len = iov[i].iov_len - done;
+      if(len > n - n1)
+        len = n - n1;
+      if((r = writei(f->ip, user, (uint64)iov[i].iov_base + done, *off, len)) > 0)
+        *off += r;
+      if(r != len)
+        break;
+      if((done += r) == iov[i].iov_len){
+        i++;
+        done = 0;
+      }
+    }
+    iunlock(f->ip);
+    end_op();
+
+    if(n1 != n){
+      // error from writei
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Write n bytes from addr to inode file f at *off, advancing
+// *off, which f->off may be. If user is set, addr is a user
+// virtual address; otherwise, a kernel address.
+static int
+fileiwrite(struct file *f, int user, uint64 addr, int n, uint *off)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return fileiwritev(f, user, &iov, 1, off) < 0 ? -1 : n;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  return filewrite1(f, 1, addr, n);
+}
+
+// Write to file f from addr, a user virtual address if user
+// is set, or else a kernel address.
+int
+filewrite1(struct file *f, int user, uint64 addr, int n)
+{
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
+  if(user)
+    uvmprefault(addr, n, 1);
+
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = fileiwrite(f, user, addr, n, &f->off);
   } else {
     panic("filewrite");
   }
@@ -178,3 +300,273 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write the niov buffers of iov, at user virtual addresses,
+// to file f, in order, as one write() would. To an inode, the
+// buffers share transactions.
+// Returns the number of bytes written, or -1.
+int
+filewritev(struct file *f, struct iovec *iov, int niov)
+{
+  int tot = 0, r = 0;
+
+  if(f->writable == 0)
+    return -1;
+
+  if(f->type == FD_INODE){
+    for(int i = 0; i < niov; i++){
+      uvmprefault((uint64)iov[i].iov_base, iov[i].iov_len, 1);
+      tot += iov[i].iov_len;
+    }
+    return fileiwritev(f, 1, iov, niov, &f->off) < 0 ? -1 : tot;
+  }
+
+  for(int i = 0; i < niov; i++){
+    if((r = filewrite1(f, 1, (uint64)iov[i].iov_base, iov[i].iov_len)) > 0)
+      tot += r;
+    if(r != iov[i].iov_len)
+      break;
+  }
+  return tot == 0 && r < 0 ? -1 : tot;
+}
+
+// Move up to n bytes from file in to file out, the way read()
+// and write() would, but without copying them through user
+// memory: from the page cache or the pipe ring, straight to
+// out. in must be a pipe or a plain file.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  struct inode *ip = in->ip;
+  int tot = 0, m, r = 0;
+  uint64 pa;
+  uint off;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_PIPE)
+    return pipesplice(in->pipe, out, n);
+  if(in->type != FD_INODE)
+    return -1;
+
+  while(tot < n){
+    // take the next piece of in, within a page, and its page.
+    ilock(ip);
+    off = in->off;
+    if(ip->type != T_FILE || off >= ip->size){
+      r = ip->type == T_FILE ? 0 : -1;
+      iunlock(ip);
+      break;
+    }
+    m = PGSIZE - off % PGSIZE;
+    if(m > n - tot)
+      m = n - tot;
+    if(m > ip->size - off)
+      m = ip->size - off;
+    if((pa = pcget(ip, off - off % PGSIZE)) == 0){
+      iunlock(ip);
+      r = -1;
+      break;
+    }
+    in->off += m;
+    iunlock(ip);
+
+    r = filewrite1(out, 0, pa + off % PGSIZE, m);
+    kfree((void*)pa);
+    if(r != m){
+      // give back what out didn't take.
+      ilock(ip);
+      in->off -= m - (r > 0 ? r : 0);
+      iunlock(ip);
+      if(r > 0)
+        tot += r;
+      break;
+    }
+    tot += m;
+  }
+  return tot == 0 && r < 0 ? -1 : tot;
+}
+
+// Read n bytes at offset off of file f, which must be an
+// inode, without using or changing f's offset.
+// addr is a user virtual address.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+
+  uvmprefault(addr, n, 0);
+  ilockshared(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlockshared(f->ip);
+  return r;
+}
+
+// Write n bytes at offset off of file f, which must be an
+// inode, without using or changing f's offset.
+// addr is a user virtual address.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+
+  uvmprefault(addr, n, 1);
+  return fileiwrite(f, 1, addr, n, &off);
+}
+
+// Allocate disk blocks for bytes [off, off+len) of file f,
+// which must be an inode, without changing its size, so that
+// writes there later needn't allocate. Allocates NINDIRECT
+// blocks per transaction, since blocks allocated this way
+// aren't logged; only the bitmap and indirect blocks are.
+// Returns 0, or -1 if out of disk space or on error.
+int
+fileallocate(struct file *f, int off, int len)
+{
+  uint bn, end, n;
+  int r = 0;
+
+  if(f->writable == 0 || f->type != FD_INODE || off < 0 || len <= 0)
+    return -1;
+  if((uint64)off + len > (uint64)MAXFILE*BSIZE)
+    return -1;
+
+  end = ((uint64)off + len + BSIZE - 1) / BSIZE;
+  for(bn = off / BSIZE; bn < end && r == 0; bn += n){
+    n = end - bn < NINDIRECT ? end - bn : NINDIRECT;
+    // the bitmap blocks, up to three indirect blocks, and the i-node.
+    begin_opn(IPUTBLOCKS + 3);
+    ilock(f->ip);
+    r = iprealloc(f->ip, bn, n);
+    iunlock(f->ip);
+    end_op();
+  }
+  return r;
+}
+
+// Set the offset of file f, which must be an inode, to off
+// plus the start, the current offset, or the end of the file,
+// as whence is SEEK_SET, SEEK_CUR or SEEK_END.
+// Returns the new offset, or -1.
+int
+fileseek(struct file *f, int off, int whence)
+{
+  int base;
+
+  if(f->type != FD_INODE)
+    return -1;
+
+  ilock(f->ip);
+  if(whence == SEEK_SET)
+    base = 0;
+  else if(whence == SEEK_CUR)
+    base = f->off;
+  else if(whence == SEEK_END)
+    base = f->ip->size;
+  else
+    base = -1;
+  if(base < 0 || base + off < 0){
+    iunlock(f->ip);
+    return -1;
+  }
+  f->off = base + off;
+  iunlock(f->ip);
+  return f->off;
+}
+
+// Wake up poll() callers, after a change that may have made a
+// file ready. Cheap when no one is polling: a caller of poll()
+// counts itself in nwait before it looks at its files, and the
+// change is made under the lock that the file's poll hook
+// takes, so either the poller sees the change or we see it.
+void
+pollwakeup(void)
+{
+  if(pollq.nwait == 0)
+    return;
+  acquire(&pollq.lock);
+  pollq.seq++;
+  wakeup(&pollq.seq);
+  release(&pollq.lock);
+}
+
+// Return which of poll()'s events file f is ready for.
+static int
+filepoll(struct file *f)
+{
+  int ev;
+
+  if(f->type == FD_PIPE){
+    ev = pipepoll(f->pipe);
+  } else if(f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV &&
+            devsw[f->major].poll){
+    ev = devsw[f->major].poll();
+  } else {
+    ev = POLLIN | POLLOUT;  // inodes, and devices without a hook, never block
+  }
+  if(!f->readable)
+    ev &= ~(POLLIN | POLLHUP);
+  if(!f->writable)
+    ev &= ~(POLLOUT | POLLERR);
+  return ev;
+}
+
+// Wait until one of the n files f[i] is ready for the events
+// in fds[i], or for timeout ticks if timeout isn't negative,
+// and fill in each fds[i].revents. f[i] is 0 if fds[i].fd
+// isn't open. Returns the number of fds with events, or -1 if
+// killed.
+int
+kpoll(struct pollfd *fds, struct file **f, int n, int timeout)
+{
+  struct proc *p = myproc();
+  uint seq, ticks0;
+  int ready;
+
+  acquire(&tickslock);
+  tickupdate();
+  ticks0 = ticks;
+  release(&tickslock);
+
+  acquire(&pollq.lock);
+  pollq.nwait++;
+  for(;;){
+    seq = pollq.seq;
+    release(&pollq.lock);
+
+    ready = 0;
+    for(int i = 0; i < n; i++){
+      fds[i].revents = 0;
+      if(f[i])
+        fds[i].revents = filepoll(f[i]) & (fds[i].events | POLLHUP | POLLERR);
+      else if(fds[i].fd >= 0)
+        fds[i].revents = POLLNVAL;
+      if(fds[i].revents)
+        ready++;
+    }
+    if(ready == 0 && killed(p))
+      ready = -1;
+    if(ready == 0 && timeout > 0){
+      acquire(&tickslock);
+      tickupdate();
+      if(ticks - ticks0 >= timeout)
+        timeout = 0;
+      else if(ticks0 + timeout < tickwake)
+        tickwake = ticks0 + timeout;  // tickupdate() will pollwakeup()
+      release(&tickslock);
+    }
+
+    acquire(&pollq.lock);
+    if(ready != 0 || timeout == 0)
+      break;
+    while(pollq.seq == seq && !killed(p))
+      sleep(&pollq.seq, &pollq.lock);
+  }
+  pollq.nwait--;
+  release(&pollq.lock);
+  return ready;
+}
@@ -18,6 +18,8 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash chain, or free list
+  struct inode *lnext, *lprev; // unreferenced list, if ref is 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,13 +28,25 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  struct spinlock ralock; // protects the read-ahead state, for shared holders
+  uint ranext;        // block a sequential read would read next
+  uint raend;         // first block not read ahead yet
+  uint rawin;         // blocks to read ahead
+  uint lastalloc;     // block last allocated to it, for balloc()
+  int dindexed;       // is the directory's index complete?
+  struct dent *dents; // its entries in the directory index
+  uint dfree;         // if indexed, no entry before this one is free
+  int orphan;         // its slot in the super block's orphans, plus 1, or 0
+  struct cpage *pages; // its pages in the page cache; see pcache.c
 };
 
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(void);  // poll() events it's ready for; if 0, always ready
 };
 
 extern struct devsw devsw[];
@@ -15,9 +15,11 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
+#include "slab.h"
 #include "buf.h"
 #include "file.h"
 
@@ -37,6 +39,13 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+static void dindexinit(void);
+static void dcinit(void);
+static void iunorphan(struct inode*);
+static void dcdrop(struct inode*, char*);
+static void dcpurge(struct inode*);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +53,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
   ireclaim(dev);
 }
 
@@ -53,34 +63,105 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bget(dev, bno);  // no need to read what's overwritten
   memset(bp->data, 0, BSIZE);
+  bp->valid = 1;
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// A summary of the free bitmap lets balloc() skip bitmap
+// blocks without free blocks, and the parts of a bitmap block
+// before its first free block, without reading them. Its
+// entries for a bitmap block are protected by the lock of
+// that block's buffer.
+
+#define NBMAP (FSSIZE/BPB + 1)
+
+// an unlink writes the directory, both i-nodes and the super
+// block, and then may free the file.
+#if IPUTBLOCKS + 3 > MAXOPBLOCKS
+#error "FSSIZE too big for an unlink to fit in MAXOPBLOCKS"
+#endif
+
+static struct {
+  int nfree[NBMAP];   // free blocks in each bitmap block
+  int hint[NBMAP];    // no earlier bit of it is free
+  int cur;            // bitmap block allocated from last
+} bsum;
+
+// Return the first free bit at or after from in bitmap
+// block k, whose buffer is bp, or -1.
+static int
+bfirstfree(struct buf *bp, int k, int from)
+{
+  for(int bi = from; bi < BPB && k*BPB + bi < sb.size; bi++){
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      bi += 7;  // a whole byte in use
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Count each bitmap block's free blocks.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+
+  if(sb.size > FSSIZE)
+    panic("bsuminit: file system too big");
+  for(int k = 0; k*BPB < sb.size; k++){
+    bp = bread(dev, sb.bmapstart + k);
+    bsum.nfree[k] = 0;
+    bsum.hint[k] = BPB;
+    for(int bi = bfirstfree(bp, k, 0); bi >= 0; bi = bfirstfree(bp, k, bi + 1)){
+      if(bsum.nfree[k]++ == 0)
+        bsum.hint[k] = bi;
+    }
+    brelse(bp);
+  }
+}
+
+// Allocate a disk block, preferably goal, or else the first
+// free one after goal in its bitmap block, so that a file's
+// blocks follow one another. Otherwise take the first free
+// block of a bitmap block with free blocks, starting with the
+// one allocated from last. goal 0 means no preference.
+// Zeroes the block if zero is set.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int zero)
 {
-  int b, bi, m;
+  int i, k, bi, from, n = (sb.size + BPB - 1) / BPB;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal >= sb.size)
+    goal = 0;
+  for(i = goal ? -1 : 0; i < n; i++){
+    k = i < 0 ? goal / BPB : (bsum.cur + i) % n;
+    if(bsum.nfree[k] == 0)
+      continue;
+    bp = bread(dev, sb.bmapstart + k);
+    from = i < 0 ? goal % BPB : bsum.hint[k];
+    if(from < bsum.hint[k])
+      from = bsum.hint[k];
+    if((bi = bfirstfree(bp, k, from)) >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      bsum.nfree[k]--;
+      if(from == bsum.hint[k])
+        bsum.hint[k] = bi + 1;
+      bsum.cur = k;
+      brelse(bp);
+      if(zero)
+        bzero(dev, k*BPB + bi);
+      return k*BPB + bi;
     }
     brelse(bp);
   }
@@ -102,6 +183,9 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  bsum.nfree[b / BPB]++;
+  if(bi < bsum.hint[b / BPB])
+    bsum.hint[b / BPB] = bi;
   brelse(bp);
 }
 
@@ -130,18 +214,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero may be recycled for another
+//   inode, least recently used first.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid if it frees
+//   the inode. An entry stays valid after its ref falls
+//   to zero, so that a later iget() and ilock() of the
+//   same inode needn't read it again.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -166,28 +252,73 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// The entries are in a hash table keyed by (dev, inum). Those
+// whose ref is zero are also on a list, most recently used
+// first, which iget() recycles from the end of. The table
+// starts empty and takes new entries from an object cache,
+// up to NINODE of them, before iget() recycles any; entries
+// are never given back.
+
+#define NIHASH 127
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct inode lru;     // head of the list of unreferenced entries
+  struct kcache cache;  // entries that have never held an inode
 } itable;
 
+// Set up a new entry's locks, for the cache.
+static void
+ictor(void *o)
+{
+  struct inode *ip = o;
+
+  initsleeplock(&ip->lock, "inode");
+  initlock(&ip->ralock, "readahead");
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  kcinit(&itable.cache, "inode", sizeof(struct inode), NINODE, ictor);
+  dindexinit();
+  dcinit();
+}
+
+// Take ip off the list of unreferenced entries.
+// Caller must hold itable.lock.
+static void
+iunlru(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+}
+
+// Put ip, whose ref has fallen to zero, on the list of
+// unreferenced entries: at the front if it's valid, so that
+// it's kept longest, or else at the back.
+// Caller must hold itable.lock.
+static void
+ilru(struct inode *ip)
+{
+  struct inode *at = ip->valid ? &itable.lru : itable.lru.lprev;
+
+  ip->lnext = at->lnext;
+  ip->lprev = at;
+  at->lnext->lprev = ip;
+  at->lnext = ip;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -247,31 +378,39 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        iunlru(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Use a new entry, or else recycle the least recently used.
+  if((ip = kcalloc(&itable.cache)) == 0){
+    if((ip = itable.lru.lprev) == &itable.lru)
+      panic("iget: no inodes");
+    iunlru(ip);
+    for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    if(ip->dindexed)
+      dirunindex(ip);
+    if(ip->pages)
+      pcdrop(ip);
+  }
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->next = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -310,6 +449,9 @@ ilock(struct inode *ip)
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->ranext = ip->raend = ip->rawin = 0;
+    ip->lastalloc = 0;
+    ip->orphan = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -327,9 +469,39 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared with other readers, to
+// examine it or read its content but not change it.
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquiresleepshared(&ip->lock);
+    if(ip->valid)
+      return;
+    // reading it in changes ip, so do that exclusively.
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+// Unlock an inode locked with ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, though it keeps the inode until it is.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -348,17 +520,24 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    if(ip->orphan)
+      iunorphan(ip);
     ip->valid = 0;
+    if(ip->dindexed)
+      dirunindex(ip);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    ilru(ip);
   release(&itable.lock);
 }
 
@@ -370,26 +549,113 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+// Orphans.
+//
+// An inode whose last link is removed while it is still open
+// is an orphan: it is freed by the last iput(), but if the
+// system crashes first, it would stay allocated. So the
+// unlink lists it in the super block, in the same transaction,
+// and freeing it takes it off; at boot, ireclaim() frees the
+// inodes still listed. If the list is full, the super block
+// records that instead, and ireclaim() searches every inode.
+// The kernel's copy of the super block, sb, doesn't track
+// the list; the super block's buffer is the only copy.
+
+// List ip, locked and with no links left, as an orphan if
+// anyone other than the caller holds a reference to it.
+// Must be called inside a transaction.
+void
+iorphan(struct inode *ip)
+{
+  struct buf *bp;
+  struct superblock *s;
+  int ref, i;
+
+  acquire(&itable.lock);
+  ref = ip->ref;
+  release(&itable.lock);
+  if(ref == 1 || ip->orphan)
+    return;  // the caller's iput() will free it
+
+  bp = bread(ip->dev, 1);
+  s = (struct superblock*)bp->data;
+  for(i = 0; i < NORPHAN && s->orphan[i]; i++)
+    ;
+  if(i < NORPHAN){
+    s->orphan[i] = ip->inum;
+    ip->orphan = i + 1;
+  } else {
+    s->orphanfull = 1;
+  }
+  log_write(bp);
+  brelse(bp);
+}
+
+// Take ip, locked and being freed, off the orphan list.
+static void
+iunorphan(struct inode *ip)
+{
+  struct buf *bp;
+
+  bp = bread(ip->dev, 1);
+  ((struct superblock*)bp->data)->orphan[ip->orphan - 1] = 0;
+  log_write(bp);
+  brelse(bp);
+  ip->orphan = 0;
+}
+
+// Free orphan inum of dev, in its own transaction.
+static void
+ifreeorphan(int dev, int inum, int slot)
+{
+  struct inode *ip;
+
+  printf("ireclaim: orphaned inode %d\n", inum);
+  ip = iget(dev, inum);
+  begin_opn(IPUTBLOCKS);
+  ilock(ip);
+  ip->orphan = slot;
+  if(ip->nlink != 0 && slot)
+    iunorphan(ip);  // not an orphan after all
+  iunlock(ip);
+  iput(ip);
+  end_op();
+}
+
+// Free the orphans a crash left on dev.
 void
 ireclaim(int dev)
 {
+  struct superblock s;
+  struct buf *bp;
+
+  bp = bread(dev, 1);
+  memmove(&s, bp->data, sizeof(s));
+  brelse(bp);
+
+  for(int i = 0; i < NORPHAN; i++)
+    if(s.orphan[i])
+      ifreeorphan(dev, s.orphan[i], i + 1);
+  if(!s.orphanfull)
+    return;
+
   for (int inum = 1; inum < sb.ninodes; inum++) {
-    struct inode *ip = 0;
-    struct buf *bp = bread(dev, IBLOCK(inum, sb));
+    int orphan = 0;
+    bp = bread(dev, IBLOCK(inum, sb));
     struct dinode *dip = (struct dinode *)bp->data + inum % IPB;
-    if (dip->type != 0 && dip->nlink == 0) {  // is an orphaned inode
-      printf("ireclaim: orphaned inode %d\n", inum);
-      ip = iget(dev, inum);
-    }
+    if (dip->type != 0 && dip->nlink == 0)  // is an orphaned inode
+      orphan = 1;
     brelse(bp);
-    if (ip) {
-      begin_op();
-      ilock(ip);
-      iunlock(ip);
-      iput(ip);
-      end_op();
-    }
+    if (orphan)
+      ifreeorphan(dev, inum, 0);
   }
+
+  begin_op();
+  bp = bread(dev, 1);
+  ((struct superblock*)bp->data)->orphanfull = 0;
+  log_write(bp);
+  brelse(bp);
+  end_op();
 }
 
 // Inode content
@@ -397,60 +663,144 @@ ireclaim(int dev)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT blocks
+// after those are listed in the blocks listed in the
+// double-indirect block ip->addrs[NDIRECT+1].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Return the block address in entry i of ip->addrs[],
+// allocating a block if it's empty, zeroed if zero is set.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapaddr(struct inode *ip, int i, int zero)
+{
+  uint addr;
+
+  if((addr = ip->addrs[i]) == 0){
+    addr = balloc(ip->dev, ip->lastalloc ? ip->lastalloc + 1 : 0, zero);
+    if(addr == 0)
+      return 0;
+    ip->addrs[i] = addr;
+    ip->lastalloc = addr;
+  }
+  return addr;
+}
+
+// Return the block address in entry i of indirect block
+// addr of ip, allocating a block if it's empty, zeroed if
+// zero is set.
+// returns 0 if out of disk space.
+static uint
+bmapind(struct inode *ip, uint addr, uint i, int zero)
 {
-  uint addr, *a;
+  uint *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    addr = balloc(ip->dev, ip->lastalloc ? ip->lastalloc + 1 : 0, zero);
+    if(addr){
+      a[i] = addr;
+      log_write(bp);
+      ip->lastalloc = addr;
     }
-    return addr;
   }
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap1 allocates one, zeroed if
+// zero is set; indirect blocks are always zeroed.
+// returns 0 if out of disk space.
+static uint
+bmap1(struct inode *ip, uint bn, int zero)
+{
+  uint addr;
+
+  if(bn < NDIRECT)
+    return bmapaddr(ip, bn, zero);
   bn -= NDIRECT;
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
-    }
-    brelse(bp);
-    return addr;
+    if((addr = bmapaddr(ip, NDIRECT, 1)) == 0)
+      return 0;
+    return bmapind(ip, addr, bn, zero);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the double-indirect block, and then the indirect
+    // block it lists, allocating each if necessary.
+    if((addr = bmapaddr(ip, NDIRECT+1, 1)) == 0)
+      return 0;
+    if((addr = bmapind(ip, addr, bn / NINDIRECT, 1)) == 0)
+      return 0;
+    return bmapind(ip, addr, bn % NINDIRECT, zero);
   }
 
   panic("bmap: out of range");
 }
 
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bmap1(ip, bn, 1);
+}
+
+// Allocate the missing blocks among the n blocks of ip starting
+// with block bn, in a run where the disk has room, without
+// changing ip's size. They aren't zeroed: writei() only ever
+// allocates blocks past the end of the file, so a block past
+// the end is read only once a write has filled it up to there.
+// At most NINDIRECT blocks, so that the indirect blocks
+// involved fit in a transaction with the bitmap blocks.
+// Caller must hold ip->lock, inside a transaction.
+// Returns 0, or -1 if out of disk space.
+int
+iprealloc(struct inode *ip, uint bn, uint n)
+{
+  if(n > NINDIRECT || bn + n > MAXFILE)
+    panic("iprealloc");
+  for(uint b = bn; b < bn + n; b++){
+    if(bmap1(ip, b, 0) == 0){
+      iupdate(ip);
+      return -1;
+    }
+  }
+  iupdate(ip);
+  return 0;
+}
+
+// Free indirect block addr of ip, and the blocks it lists,
+// down depth more levels of indirect blocks.
+static void
+itruncind(struct inode *ip, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(int j = 0; j < NINDIRECT; j++){
+    if(a[j] && depth > 0)
+      itruncind(ip, a[j], depth - 1);
+    else if(a[j])
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  pcdrop(ip);
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -460,23 +810,21 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip, ip->addrs[NDIRECT], 0);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip, ip->addrs[NDIRECT+1], 1);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
   iupdate(ip);
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared.
 void
 stati(struct inode *ip, struct stat *st)
 {
@@ -487,22 +835,98 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
-// Caller must hold ip->lock.
+// Start reading ahead of block bn of ip, which readi() is
+// about to read, if ip is being read sequentially. The number
+// of blocks read ahead starts small and doubles each time
+// another read is needed, up to READAHEAD, and drops back to
+// none on a seek. Caller must hold ip->lock, perhaps shared;
+// ip->ralock protects the window.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint nb = (ip->size + BSIZE - 1) / BSIZE;
+  uint b, end, addr[READAHEAD+1];
+  int n = 0;
+
+  acquire(&ip->ralock);
+  if(bn + 1 == ip->ranext){
+    release(&ip->ralock);
+    return;  // still the same block
+  }
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->raend = ip->rawin = 0;
+    release(&ip->ralock);
+    return;
+  }
+  ip->ranext = bn + 1;
+  if(ip->raend > bn + ip->rawin / 2){
+    release(&ip->ralock);
+    return;
+  }
+  ip->rawin = ip->rawin ? min(2 * ip->rawin, READAHEAD) : 4;
+  b = ip->raend > bn ? ip->raend : bn;
+  end = min(nb, bn + ip->rawin + 1);
+  if(end > b)
+    ip->raend = end;
+  release(&ip->ralock);
+
+  // bmap() may read indirect blocks, so not with ralock held.
+  for(; b < end; b++){
+    if((addr[n] = bmap(ip, b)) == 0)
+      break;
+    n++;
+  }
+  breadahead(ip->dev, addr, n);
+}
+
+// Read data from inode, through the page cache if it's a file.
+// Caller must hold ip->lock, perhaps shared.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  uint64 pa;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->type != T_FILE)
+    return readblocks(ip, user_dst, dst, off, n);
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pa = pcget(ip, off - off%PGSIZE)) == 0){
+      // out of memory: read the blocks directly.
+      if((r = readblocks(ip, user_dst, dst, off, m)) != m)
+        return r < 0 ? -1 : tot + r;
+      continue;
+    }
+    r = either_copyout(user_dst, dst, (char*)pa + off%PGSIZE, m);
+    kfree((void*)pa);
+    if(r == -1)
+      return -1;
+  }
+  return tot;
+}
+
+// Read n bytes of ip's data at off from its blocks, which
+// must be within the file.
+// Caller must hold ip->lock, perhaps shared.
+// If user_dst==1, then dst is a user virtual address;
+// otherwise, dst is a kernel address.
+int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  struct buf *bp;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    readahead(ip, off/BSIZE);
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
@@ -533,7 +957,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > (uint64)MAXFILE*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
@@ -546,6 +970,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    if(ip->type == T_FILE)
+      pcwrite(ip, off, bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -569,6 +995,145 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory index.
+//
+// The first dirlookup() in a directory indexes all its entries
+// by name in a hash table, so that later lookups, including
+// dirlink()'s check that a name is new, don't read the
+// directory. The index lasts as long as the inode's entry in
+// the inode table, and dirlink() and direrase(), which are the
+// only writers of directory entries, keep it up to date. If
+// there's no memory for an entry, the directory goes back to
+// being scanned. A directory's entries in the index are
+// protected by its inode's lock; dindex.lock protects the hash
+// chains and the free list.
+
+struct dent {
+  struct dent *next;      // hash chain, or free list
+  struct dent *dnext;     // the directory's other entries
+  struct inode *dp;
+  uint off;               // offset of the entry in dp
+  uint inum;
+  char name[DIRSIZ];
+};
+
+#define NDHASH 1021
+
+static struct {
+  struct spinlock lock;
+  struct dent *hash[NDHASH];
+  struct dent *free;
+} dindex;
+
+static void
+dindexinit(void)
+{
+  initlock(&dindex.lock, "dindex");
+}
+
+static uint
+dhash(struct inode *dp, char *name)
+{
+  uint h = (uint64)dp / sizeof(*dp);
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return h % NDHASH;
+}
+
+// Add the entry (name, inum) at off of directory dp to the
+// index. Returns 0, or -1 if out of memory.
+static int
+dentadd(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dent *d;
+  char *pg = 0;
+
+  acquire(&dindex.lock);
+  if(dindex.free == 0){
+    release(&dindex.lock);
+    if((pg = ktryalloc()) == 0)
+      return -1;
+    acquire(&dindex.lock);
+    for(d = (struct dent*)pg; d + 1 <= (struct dent*)(pg + PGSIZE); d++){
+      d->next = dindex.free;
+      dindex.free = d;
+    }
+  }
+  d = dindex.free;
+  dindex.free = d->next;
+  d->dp = dp;
+  d->off = off;
+  d->inum = inum;
+  strncpy(d->name, name, DIRSIZ);
+  d->next = dindex.hash[dhash(dp, name)];
+  dindex.hash[dhash(dp, name)] = d;
+  release(&dindex.lock);
+
+  d->dnext = dp->dents;
+  dp->dents = d;
+  return 0;
+}
+
+// Find name in directory dp's index.
+// Caller must hold dindex.lock.
+static struct dent**
+dentfind(struct inode *dp, char *name)
+{
+  struct dent **dd;
+
+  for(dd = &dindex.hash[dhash(dp, name)]; *dd; dd = &(*dd)->next)
+    if((*dd)->dp == dp && namecmp(name, (*dd)->name) == 0)
+      break;
+  return dd;
+}
+
+// Drop ip's directory index, if it has one, when it stops
+// being that directory or leaves the inode table.
+void
+dirunindex(struct inode *ip)
+{
+  struct dent *d, **dd;
+
+  acquire(&dindex.lock);
+  while((d = ip->dents) != 0){
+    ip->dents = d->dnext;
+    dd = dentfind(ip, d->name);
+    *dd = d->next;
+    d->next = dindex.free;
+    dindex.free = d;
+  }
+  release(&dindex.lock);
+  ip->dindexed = 0;
+}
+
+// Index all the entries of directory dp, and find its first
+// free entry. Caller must hold dp->lock.
+// Returns 0, or -1 if out of memory.
+static int
+dirindex(struct inode *dp)
+{
+  uint off;
+  struct dirent de;
+
+  dp->dfree = dp->size;
+  for(off = 0; off < dp->size; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirindex read");
+    if(de.inum == 0){
+      if(off < dp->dfree)
+        dp->dfree = off;
+      continue;
+    }
+    if(dentadd(dp, de.name, de.inum, off) < 0){
+      dirunindex(dp);
+      return -1;
+    }
+  }
+  dp->dindexed = 1;
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -576,10 +1141,26 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dent *d;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dp->dindexed || dirindex(dp) == 0){
+    acquire(&dindex.lock);
+    d = *dentfind(dp, name);
+    if(d){
+      off = d->off;
+      inum = d->inum;
+    }
+    release(&dindex.lock);
+    if(d == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -602,7 +1183,7 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off;
   struct dirent de;
   struct inode *ip;
 
@@ -612,8 +1193,9 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  // Look for an empty dirent, after the first free one
+  // if the directory is indexed.
+  for(off = dp->dindexed ? dp->dfree : 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
@@ -622,14 +1204,174 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  dcdrop(dp, name);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
 
+  if(dp->dindexed){
+    dp->dfree = off + sizeof(de);
+    if(dentadd(dp, name, inum, off) < 0)
+      dirunindex(dp);
+  }
   return 0;
 }
 
+// Clear the entry for name, at offset off, in directory dp.
+void
+direrase(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+  struct dent *d, **dd;
+
+  memset(&de, 0, sizeof(de));
+  dcdrop(dp, name);
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("unlink: writei");
+
+  if(dp->dindexed){
+    acquire(&dindex.lock);
+    dd = dentfind(dp, name);
+    d = *dd;
+    *dd = d->next;
+    d->next = dindex.free;
+    dindex.free = d;
+    release(&dindex.lock);
+    for(dd = &dp->dents; *dd != d; dd = &(*dd)->dnext)
+      ;
+    *dd = d->dnext;
+    if(off < dp->dfree)
+      dp->dfree = off;
+  }
+}
+
 // Paths
 
+// Name cache.
+//
+// namex() remembers what each name it looked up in a directory
+// led to, the inode number, or 0 if the name wasn't there, so
+// that it can skip locking and searching the directory the
+// next time. Entries are keyed by the directory's inode
+// number, and are only made for directories, while holding
+// their lock; dirlink() and direrase() drop a directory's
+// entry for a name they change, and freeing a directory drops
+// all of its entries. dcache.lock protects the table, which is
+// set-associative with least recently used replacement.
+
+#define NDCSET  64
+#define DCWAYS  4
+
+struct dcent {
+  uint dev;
+  uint dinum;           // directory, or 0 if the entry is unused
+  uint inum;            // 0 if name isn't in the directory
+  char name[DIRSIZ];
+  uint lastuse;
+};
+
+static struct {
+  struct spinlock lock;
+  struct dcent ent[NDCSET][DCWAYS];
+  uint clock;
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dcent*
+dcset(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return dcache.ent[h % NDCSET];
+}
+
+// Find the entry for name in directory dp in set s,
+// or 0. Caller must hold dcache.lock.
+static struct dcent*
+dcfind(struct dcent *s, struct inode *dp, char *name)
+{
+  for(int i = 0; i < DCWAYS; i++)
+    if(s[i].dinum == dp->inum && s[i].dev == dp->dev && namecmp(s[i].name, name) == 0)
+      return &s[i];
+  return 0;
+}
+
+// Look up name in directory dp in the name cache. Returns
+// 1 if it's cached, setting *ipp to a reference to the
+// inode it names, or to 0 if it isn't in dp; returns 0 if
+// it isn't cached.
+static int
+dcget(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dcent *e;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dcset(dp->dev, dp->inum, name), dp, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  e->lastuse = ++dcache.clock;
+  // get the reference before an unlink can drop the entry,
+  // or the inode could be freed and reused meanwhile.
+  *ipp = e->inum ? iget(dp->dev, e->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in directory dp, locked by the caller,
+// is inode inum, or isn't there if inum is 0.
+static void
+dcput(struct inode *dp, char *name, uint inum)
+{
+  struct dcent *s, *e;
+
+  acquire(&dcache.lock);
+  s = dcset(dp->dev, dp->inum, name);
+  if((e = dcfind(s, dp, name)) == 0){
+    e = &s[0];
+    for(int i = 1; i < DCWAYS; i++)
+      if(s[i].dinum == 0 || (e->dinum && s[i].lastuse < e->lastuse))
+        e = &s[i];
+  }
+  e->dev = dp->dev;
+  e->dinum = dp->inum;
+  e->inum = inum;
+  strncpy(e->name, name, DIRSIZ);
+  e->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget name in directory dp, whose entry for it the
+// caller is changing.
+static void
+dcdrop(struct inode *dp, char *name)
+{
+  struct dcent *e;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dcset(dp->dev, dp->inum, name), dp, name)) != 0)
+    e->dinum = 0;
+  release(&dcache.lock);
+}
+
+// Forget every name in directory ip, which is being freed.
+static void
+dcpurge(struct inode *ip)
+{
+  acquire(&dcache.lock);
+  for(int i = 0; i < NDCSET; i++)
+    for(int j = 0; j < DCWAYS; j++)
+      if(dcache.ent[i][j].dinum == ip->inum && dcache.ent[i][j].dev == ip->dev)
+        dcache.ent[i][j].dinum = 0;
+  release(&dcache.lock);
+}
+
 // Copy the next path element from path into name.
 // Return a pointer to the element following the copied one.
 // The returned path has no leading slashes,
@@ -678,25 +1420,48 @@ namex(char *path, int nameiparent, char *name)
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    acquire(&myproc()->group->glock);
+    ip = idup(myproc()->group->cwd);
+    release(&myproc()->group->glock);
+  }
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    if(!(nameiparent && *path == '\0') && dcget(ip, name, &next)){
+      // only directories have entries, so ip is one.
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
+    // look up with ip shared, unless the lookup will index it.
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
+    if(ip->dindexed){
+      next = dirlookup(ip, name, 0);
+      dcput(ip, name, next ? next->inum : 0);
+      iunlockshared(ip);
+    } else {
+      iunlockshared(ip);
+      ilock(ip);
+      next = ip->type == T_DIR ? dirlookup(ip, name, 0) : 0;
+      if(ip->type == T_DIR)
+        dcput(ip, name, next ? next->inum : 0);
+      iunlock(ip);
     }
-    iunlockput(ip);
+    iput(ip);
+    if(next == 0)
+      return 0;
     ip = next;
   }
   if(nameiparent){
@@ -0,0 +1,7 @@
+// A device interrupt's routing and counts, returned by irqstat().
+struct irqstat {
+  int irq;
+  int hart;             // the hart its interrupts go to
+  char name[8];
+  uint64 count[NCPU];   // interrupts each hart has taken
+};
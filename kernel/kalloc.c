@@ -1,6 +1,27 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU has its own free list, protected by its own lock,
+// so that CPUs allocating and freeing in parallel don't contend.
+// kfree() puts a page on the freeing CPU's list. When a CPU's
+// list is empty, kalloc() steals a batch of pages from another CPU.
+//
+// Each physical page also has a reference count, so that
+// copy-on-write fork can share a page between page tables.
+// kalloc() sets the count to one, kincref() adds a reference,
+// and kfree() only puts the page on a free list when the
+// last reference is dropped.
+//
+// Memory starts out as 2-megabyte aligned runs of pages on
+// a separate list, so that kallocmega() can hand them out
+// for megapage mappings. When a CPU can neither find nor
+// steal a 4096-byte page, kalloc() breaks up one of the runs.
+// Pages are never merged back into runs.
+//
+// If there is still no page, kalloc() asks the buffer cache and
+// then the page cache to give some back; ktryalloc(), which the
+// buffer cache grows with, doesn't.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +30,8 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KSTEAL 32  // pages to move per steal
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,48 +41,212 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;             // number of pages on freelist
+};
+
+struct kmem kmem[NCPU];
+
+struct kmem kmega;         // free 2-megabyte runs
+
+// per-page reference counts, indexed by PA2REF(pa).
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+static int kref[PA2REF(PHYSTOP)];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kmega.lock, "kmega");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Put the never-allocated pages in [pa_start, pa_end) on the
+// free lists: 2-megabyte aligned runs on kmega's, and the pages
+// around them on this CPU's, where other CPUs can steal them.
+// Links them up first and then takes each lock once, without the
+// junk fill of kfree(); their reference counts stay zero, as for
+// any free page.
 void
 freerange(void *pa_start, void *pa_end)
 {
+  struct run *r, *pages = 0, *lastpage = 0, *runs = 0, *lastrun = 0;
+  int npages = 0, nruns = 0;
+  struct kmem *km;
   char *p;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  while(p + PGSIZE <= (char*)pa_end){
+    r = (struct run*)p;
+    if((uint64)p % MEGAPGSIZE == 0 && p + MEGAPGSIZE <= (char*)pa_end){
+      r->next = runs;
+      runs = r;
+      if(lastrun == 0)
+        lastrun = r;
+      nruns++;
+      p += MEGAPGSIZE;
+    } else {
+      r->next = pages;
+      pages = r;
+      if(lastpage == 0)
+        lastpage = r;
+      npages++;
+      p += PGSIZE;
+    }
+  }
+
+  if(runs){
+    acquire(&kmega.lock);
+    lastrun->next = kmega.freelist;
+    kmega.freelist = runs;
+    kmega.nfree += nruns;
+    release(&kmega.lock);
+  }
+  if(pages){
+    push_off();
+    km = &kmem[cpuid()];
+    acquire(&km->lock);
+    lastpage->next = km->freelist;
+    km->freelist = pages;
+    km->nfree += npages;
+    release(&km->lock);
+    pop_off();
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(). The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  release(&km->lock);
+  pop_off();
+}
+
+// Move up to KSTEAL pages from another CPU's free list
+// onto the list of CPU id. Holds only one kmem lock at a
+// time, so two CPUs stealing from each other can't deadlock.
+// Returns the number of pages moved.
+static int
+ksteal(int id)
+{
+  struct run *first, *last;
+  int n;
+
+  for(int i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+
+    acquire(&victim->lock);
+    first = last = victim->freelist;
+    n = 0;
+    if(first){
+      n = 1;
+      while(n < KSTEAL && n < (victim->nfree + 1) / 2 && last->next){
+        last = last->next;
+        n++;
+      }
+      victim->freelist = last->next;
+      victim->nfree -= n;
+    }
+    release(&victim->lock);
+
+    if(n > 0){
+      acquire(&kmem[id].lock);
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = first;
+      kmem[id].nfree += n;
+      release(&kmem[id].lock);
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Break a 2-megabyte run into 4096-byte pages on the
+// free list of CPU id. Returns the number of pages added.
+static int
+kbreak(int id)
+{
+  struct run *r;
+  char *pa;
+
+  acquire(&kmega.lock);
+  r = kmega.freelist;
+  if(r){
+    kmega.freelist = r->next;
+    kmega.nfree--;
+  }
+  release(&kmega.lock);
+  if(r == 0)
+    return 0;
+
+  acquire(&kmem[id].lock);
+  for(pa = (char*)r; pa < (char*)r + MEGAPGSIZE; pa += PGSIZE){
+    ((struct run*)pa)->next = kmem[id].freelist;
+    kmem[id].freelist = (struct run*)pa;
+  }
+  kmem[id].nfree += MEGAPGSIZE / PGSIZE;
+  release(&kmem[id].lock);
+  return MEGAPGSIZE / PGSIZE;
+}
+
+// Allocate one 4096-byte page of physical memory, taking
+// pages back from the buffer cache if reclaim is set.
+static void *
+kalloc1(int reclaim)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  for(;;){
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+    if(r){
+      kmem[id].freelist = r->next;
+      kmem[id].nfree--;
+    }
+    release(&kmem[id].lock);
+    if(r || (ksteal(id) == 0 && kbreak(id) == 0 &&
+             (!reclaim || (breclaim() == 0 && pcreclaim() == 0))))
+      break;
+  }
+  pop_off();
+
+  if(r){
+    kref[PA2REF(r)] = 1;
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +254,92 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  return kalloc1(1);
+}
+
+// Like kalloc(), but fails rather than shrink the buffer cache.
+void *
+ktryalloc(void)
+{
+  return kalloc1(0);
+}
+
+// Add a reference to an allocated page, e.g. when
+// fork shares it between two page tables.
+void
+kincref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kincref");
+  if(__sync_fetch_and_add(&kref[PA2REF(pa)], 1) < 1)
+    panic("kincref: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcount(void *pa)
+{
+  return kref[PA2REF(pa)];
+}
+
+// Allocate 2 megabytes of physical memory, aligned to
+// 2 megabytes, for a megapage mapping. The run has a single
+// reference count, held by its first page.
+// Returns 0 if no free run is left.
+void *
+kallocmega(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  acquire(&kmega.lock);
+  r = kmega.freelist;
+  if(r){
+    kmega.freelist = r->next;
+    kmega.nfree--;
+  }
+  release(&kmega.lock);
 
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    kref[PA2REF(r)] = 1;
   return (void*)r;
 }
+
+// Drop a reference to a run returned by kallocmega(),
+// putting it back on the list of runs if it was the last.
+void
+kfreemega(void *pa)
+{
+  struct run *r;
+  int ref;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (char*)pa < end || (uint64)pa + MEGAPGSIZE > PHYSTOP)
+    panic("kfreemega");
+
+  ref = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfreemega: ref");
+  if(ref > 0)
+    return;
+
+  r = (struct run*)pa;
+  acquire(&kmega.lock);
+  r->next = kmega.freelist;
+  kmega.freelist = r;
+  kmega.nfree++;
+  release(&kmega.lock);
+}
+
+// Turn a run returned by kallocmega() into 512 separately
+// allocated pages, each with the run's reference count,
+// so that they can be kfree()d one at a time.
+void
+ksplit(void *pa)
+{
+  int ref = kref[PA2REF(pa)];
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || ref < 1)
+    panic("ksplit");
+  for(uint64 i = 1; i < MEGAPGSIZE / PGSIZE; i++)
+    kref[PA2REF(pa) + i] = ref;
+}
@@ -0,0 +1,8 @@
+// Contention counters of the spinlocks with one name,
+// returned by lockstat().
+struct lockstat {
+  char name[16];
+  uint64 nacquire;   // acquisitions
+  uint64 ncontend;   // acquisitions that found the lock held
+  uint64 spin;       // timer cycles spent waiting for the lock
+};
@@ -4,6 +4,8 @@
 #include "param.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rusage.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -20,20 +22,44 @@
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// begin_op() reserves log space for the most blocks any
+// system call writes, MAXOPBLOCKS; one that knows it writes
+// fewer calls begin_opn() with its own budget instead. Each
+// new block the operation logs uses up one of its reservation.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
+// The on-disk log is two areas, each of the format:
 //   header block, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+//
+// Commits are pipelined across the two areas. A commit first
+// copies the transaction's blocks into log buffers, which is
+// the only time new FS system calls must wait; they then fill
+// the next transaction, for the other area, while this one is
+// written to its area and installed. Headers carry sequence
+// numbers, and commits write their headers and install in
+// sequence order, so recovery replays the areas oldest first.
+//
+// A header also has a checksum of its transaction, so a commit
+// writes the header and the blocks together, and recovery skips
+// an area whose writes didn't all finish. Headers aren't cleared
+// after installing: replaying the two newest transactions again,
+// in order, is harmless.
+//
+// If the previous transaction is still being written when the
+// last outstanding end_op() finishes, the commit is left to
+// the end of the previous one, so that the system calls that
+// end meanwhile join the same transaction.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;        // order of commits
+  uint64 sum;      // logsum() of the transaction
   int block[LOGBLOCKS];
 };
 
@@ -42,11 +68,21 @@ struct log {
   int start;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int reserved;    // blocks reserved by FS sys calls and not used yet.
   int dev;
-  struct logheader lh;
+  int cur;         // area the open transaction will use.
+  int busy[2];     // does area hold a transaction not yet installed?
+  uint seq;        // seq of the next commit.
+  uint committed;  // seq of the last transaction on disk.
+  uint installed;  // seq of the last transaction installed.
+  struct logheader lh;  // the open transaction.
+  struct buf home[2][LOGBLOCKS];  // for install_trans() of each area
 };
 struct log log;
 
+// first block (the header) of log area a.
+#define LOGAREA(a) (log.start + (a)*(LOGBLOCKS+1))
+
 static void recover_from_log(void);
 static void commit();
 
@@ -55,6 +91,8 @@ initlog(int dev, struct superblock *sb)
 {
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < 2*(LOGBLOCKS+1))
+    panic("initlog: log too small");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
@@ -62,88 +100,175 @@ initlog(int dev, struct superblock *sb)
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Checksum of transaction lh, whose log blocks are lb[],
+// covering every field of the header but sum itself.
+// FNV-1a, a 64-bit word at a time.
+static uint64
+logsum(struct logheader *lh, struct buf **lb)
+{
+  uint64 h = 0xcbf29ce484222325ULL;
+  int i, j;
+
+#define FNV(x) (h = (h ^ (uint64)(x)) * 0x100000001b3ULL)
+  FNV(lh->n);
+  FNV(lh->seq);
+  for (i = 0; i < lh->n; i++)
+    FNV(lh->block[i]);
+  for (i = 0; i < lh->n; i++)
+    for (j = 0; j < BSIZE / sizeof(uint64); j++)
+      FNV(((uint64*)lb[i]->data)[j]);
+#undef FNV
+  return h;
+}
+
+// Copy the transaction of header lh in log area a on disk to
+// its home locations, when recovering, if it is intact.
 static void
-install_trans(int recovering)
+recover_trans(int a, struct logheader *lh)
 {
-  int tail;
+  struct buf *lb[LOGBLOCKS];
+  int tail, ok;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    if(recovering) {
-      printf("recovering tail %d dst %d\n", tail, log.lh.block[tail]);
+  for (tail = 0; tail < lh->n; tail++)
+    lb[tail] = bread(log.dev, LOGAREA(a)+tail+1); // read log block
+  ok = lh->n > 0 && logsum(lh, lb) == lh->sum;
+  for (tail = 0; tail < lh->n; tail++) {
+    if (ok) {
+      printf("recovering tail %d dst %d\n", tail, lh->block[tail]);
+      struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
+      memmove(dbuf->data, lb[tail]->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(dbuf);
     }
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
+    brelse(lb[tail]);
+  }
+}
+
+// Write the blocks of transaction lh of log area a, copied
+// to the log buffers lb[], to their home locations, and unpin
+// them. The writes go from the copies, since the cached blocks
+// may have newer contents by now, through the stand-in bufs
+// of log.home[a], as one batch sorted by block number.
+static void
+install_trans(int a, struct logheader *lh, struct buf **lb)
+{
+  struct buf *b, *hb[LOGBLOCKS];
+  int tail, i;
+
+  for (tail = 0; tail < lh->n; tail++) {
+    b = &log.home[a][tail];
+    b->dev = log.dev;
+    b->blockno = lh->block[tail];
+    b->data = lb[tail]->data;
+    for (i = tail; i > 0 && hb[i-1]->blockno > b->blockno; i--)
+      hb[i] = hb[i-1];
+    hb[i] = b;
+  }
+  iocount(lh->n, 1);
+  virtio_disk_start(hb, lh->n, 1);  // write dst to disk
+  for (tail = 0; tail < lh->n; tail++) {
+    virtio_disk_wait(hb[tail]);
+    struct buf *dbuf = bread(log.dev, lh->block[tail]);
+    bunpin(dbuf);
     brelse(dbuf);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the header of log area a from disk into lh
 static void
-read_head(void)
+read_head(int a, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf = bread(log.dev, LOGAREA(a));
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  if (lh->n < 0 || lh->n > LOGBLOCKS)
+    lh->n = 0;  // garbage: nothing to recover
+  lh->seq = hb->seq;
+  lh->sum = hb->sum;
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy in-memory log header lh into buf, the block of
+// the header on disk.
 static void
-write_head(void)
+fill_head(struct buf *buf, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  memset(buf->data, 0, BSIZE);
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  hb->sum = lh->sum;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  buf->valid = 1;
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logheader lh[2];
+  int first;
+
+  read_head(0, &lh[0]);
+  read_head(1, &lh[1]);
+  first = lh[1].seq < lh[0].seq;
+  recover_trans(first, &lh[first]); // if committed, copy from log to disk
+  recover_trans(!first, &lh[!first]);
+
+  log.seq = (first ? lh[0].seq : lh[1].seq) + 1;
+  log.committed = log.installed = log.seq - 1;
+  for(int a = 0; a < 2; a++){
+    // clear the log, so the next boot needn't replay it.
+    struct buf *buf = bget(log.dev, LOGAREA(a));
+    lh[a].n = 0;
+    lh[a].sum = 0;
+    fill_head(buf, &lh[a]);
+    bwrite(buf);
+    brelse(buf);
+  }
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that
+// writes at most n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > LOGBLOCKS)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGBLOCKS){
+    } else if(log.lh.n + log.reserved + n > LOGBLOCKS){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless the previous commit hasn't finished yet.
 void
 end_op(void)
 {
@@ -151,56 +276,118 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
   if(log.committing)
     panic("log.committing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    // group this transaction with later ones if the previous
+    // commit is still going and there's room; it commits it.
+    if(log.lh.n > 0 &&
+       !(log.busy[!log.cur] && log.lh.n + MAXOPBLOCKS <= LOGBLOCKS)){
+      do_commit = 1;
+      log.committing = 1;
+    }
   }
+  // begin_op() may be waiting for log space,
+  // and the end of this op has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  while(do_commit){
     commit();
+
+    // commit the transaction of end_op()s that left it to us.
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    do_commit = log.outstanding == 0 && log.lh.n > 0 && !log.committing;
+    if(do_commit)
+      log.committing = 1;
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks of transaction lh from cache into
+// buffers lb[] for the log blocks of area a.
 static void
-write_log(void)
+copy_log(int a, struct logheader *lh, struct buf **lb)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < lh->n; tail++) {
+    lb[tail] = bget(log.dev, LOGAREA(a)+tail+1); // log block
+    struct buf *from = bread(log.dev, lh->block[tail]); // cache block
+    memmove(lb[tail]->data, from->data, BSIZE);
+    lb[tail]->valid = 1;
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write transaction lh to log area a on disk: its header,
+// with its checksum, into buffer lb[0], and then that and the
+// log blocks in lb[1..], as one batch. Waits for all of them.
+// This is the true point at which the transaction commits.
+static void
+write_log(int a, struct logheader *lh, struct buf **lb)
+{
+  lh->sum = logsum(lh, lb+1);
+  lb[0] = bget(log.dev, LOGAREA(a));
+  fill_head(lb[0], lh);
+  iocount(lh->n+1, 1);
+  virtio_disk_start(lb, lh->n+1, 1);  // write the log
+  for (int tail = 0; tail <= lh->n; tail++)
+    virtio_disk_wait(lb[tail]);
+}
+
+// Commit the open transaction. Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
-  }
+  struct logheader lh;
+  struct buf *lb[LOGBLOCKS+1];  // header, then log blocks
+  int a;
+
+  acquire(&log.lock);
+  a = log.cur;
+  while(log.busy[a])  // wait for the transaction before last
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  // take the transaction, and let new system calls start.
+  lh = log.lh;
+  copy_log(a, &lh, lb+1); // Copy modified blocks from cache to log
+  acquire(&log.lock);
+  lh.seq = log.seq++;
+  log.lh.n = 0;
+  log.busy[a] = 1;
+  log.cur = !a;
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  acquire(&log.lock);
+  while(log.committed != lh.seq - 1)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+  write_log(a, &lh, lb);  // Write header and blocks -- the real commit
+
+  acquire(&log.lock);
+  log.committed = lh.seq;
+  wakeup(&log);
+  while(log.installed != lh.seq - 1)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+  install_trans(a, &lh, lb+1); // Now install writes to home locations
+  for (int tail = 0; tail <= lh.n; tail++)
+    brelse(lb[tail]);
+
+  acquire(&log.lock);
+  log.installed = lh.seq;
+  log.busy[a] = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -231,6 +418,10 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+    if (myproc()->logres > 0) {  // it was reserved
+      myproc()->logres--;
+      log.reserved--;
+    }
   }
   release(&log.lock);
 }
@@ -21,14 +21,19 @@ main()
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    profinit();      // profiler sample rings
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    pcinit();        // page cache
     virtio_disk_init(); // emulated hard disk
+    swapinit();      // swap space, on the second disk
     userinit();      // first user process
+    printfstart();   // buffer printf output from now on
     __sync_synchronize();
     started = 1;
   } else {
@@ -7,7 +7,7 @@
 // 02000000 -- CLINT
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
-// 10001000 -- virtio disk 
+// 10001000 -- virtio disks, a page each
 // 80000000 -- qemu's boot ROM loads the kernel here,
 //             then jumps here.
 // unused RAM after 80000000.
@@ -21,9 +21,12 @@
 #define UART0 0x10000000L
 #define UART0_IRQ 10
 
-// virtio mmio interface
+// virtio mmio interface: qemu has eight slots, a page apart,
+// each with its own interrupt.
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define VIRTIO(i) (VIRTIO0 + (i)*0x1000L)
+#define VIRTIO_IRQ(i) (VIRTIO0_IRQ + (i))
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -54,6 +57,17 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap regions, growing down from MMAPTOP
+//   VDSO (p->vdso, read-only; see vdso.h)
+//   trapframes of threads made by clone(), one page each
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define VDSO (TRAPFRAME - NTHREAD*PGSIZE)
+#define MMAPTOP VDSO
+
+// each hart's kernel page table also shows the user memory of
+// the process it is running in the top half of the address
+// space, at UWIN + va, so that copyin() and copyout() can
+// reach it with plain loads and stores.
+#define UWIN (0L - MAXVA)
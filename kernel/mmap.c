@@ -0,0 +1,325 @@
+//
+// mmap() and munmap(): regions of user memory backed by
+// a file, or by zeroed memory, between the heap and the
+// trapframe. Their pages are filled in lazily by vmfault().
+//
+// Pages of a private mapping belong to the process, and
+// fork() shares them copy-on-write. Pages of a shared mapping
+// are the same physical pages in every process: fork() shares
+// those of anonymous memory, and those of a file are its pages
+// in the page cache. Modified pages of shared file mappings
+// are written back to the file when they are unmapped.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return a referenced physical page to map at va of
+// MAP_SHARED region v: a new zeroed page for anonymous memory,
+// or the file's page in the page cache, which every mapping of
+// the file shares. May sleep.
+// Returns 0 if out of memory or on a read error.
+uint64
+mmapget(struct vma *v, uint64 va)
+{
+  char *mem;
+  uint64 pa;
+  int locked;
+
+  if(v->ip == 0){
+    if((mem = kalloc()) != 0)
+      memset(mem, 0, PGSIZE);
+    return (uint64)mem;
+  }
+
+  // the fault may come from copyin() or copyout() in a write()
+  // or read() of this very file, with the lock already held.
+  locked = holdingsleep(&v->ip->lock);
+  if(!locked)
+    ilockshared(v->ip);
+  pa = pcget(v->ip, v->off + (va - v->start));
+  if(!locked)
+    iunlockshared(v->ip);
+  return pa;
+}
+
+// Drop a mapping's reference to page pa at va of region v.
+// The page cache keeps its own reference to a file's page.
+void
+mmapput(struct vma *v, uint64 va, uint64 pa)
+{
+  kfree((void*)pa);
+}
+
+// Write the page pa, mapped at va of shared file region v,
+// back to the file. Doesn't extend the file.
+static void
+mmapwrite(struct vma *v, uint64 va, uint64 pa)
+{
+  uint pos = va - v->start;
+  uint n;
+
+  if(pos >= v->filesz)
+    return;
+  n = v->filesz - pos;
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  // the page's blocks may not all exist any more: the file can
+  // have been truncated and regrown, perhaps with holes, since
+  // it was mapped. so reserve what filewrite() would for a page:
+  // data and allocation blocks, slop, i-node and indirect blocks.
+  begin_opn(2 * (PGSIZE / BSIZE) + 9);
+  ilock(v->ip);
+  writei(v->ip, 0, pa, v->off + pos, n);
+  iunlock(v->ip);
+  end_op();
+}
+
+// Find an unused vma of process p.
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip == 0 && v->end == 0)
+      return v;
+  return 0;
+}
+
+// Move the start of region v up by n bytes.
+static void
+vmatrim(struct vma *v, uint64 n)
+{
+  v->start += n;
+  v->off += n;
+  v->filesz = v->filesz > n ? v->filesz - n : 0;
+}
+
+// Drop the n pages of region v at va[i], whose PTEs have been
+// cleared, once no other thread's TLB entries can reach them.
+static void
+vmaputpages(struct proc *p, struct vma *v, uint64 *va, uint64 *pa, int n)
+{
+  uvmflush(p->pagetable, -1);
+  uvmsync(p->pagetable);
+  for(int i = 0; i < n; i++)
+    mmapput(v, va[i], pa[i]);
+}
+
+// Unmap the pages in [a, b) of mmap region v of process p,
+// writing modified pages of shared file mappings back, and
+// shrink, split, or drop v to match. a and b are page-aligned.
+// p is a thread group leader, and the caller holds its vm lock.
+// May sleep; must not be called inside a transaction.
+// Returns 0, or -1 if v must be split and there is no free vma.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 a, uint64 b)
+{
+  struct vma *w = 0;
+  uint64 va, gone[16], pa[16];
+  int n = 0;
+  pte_t *pte;
+
+  if(a > v->start && b < v->end && (w = vmaalloc(p)) == 0)
+    return -1;
+
+  for(va = a; va < b; va += PGSIZE){
+    if((pte = walk(p->pagetable, va, 0)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // a paged-out page of a private mapping.
+      swapput(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
+    if((*pte & PTE_V) == 0)
+      continue;
+    if((v->flags & MAP_SHARED) && v->ip && (*pte & PTE_D))
+      mmapwrite(v, va, PTE2PA(*pte));
+    gone[n] = va;
+    pa[n++] = PTE2PA(*pte);
+    *pte = 0;
+    if(n == NELEM(gone)){
+      vmaputpages(p, v, gone, pa, n);
+      n = 0;
+    }
+  }
+  vmaputpages(p, v, gone, pa, n);
+
+  if(w){
+    // a hole in the middle: the part above it gets w.
+    *w = *v;
+    if(w->ip)
+      idup(w->ip);
+    vmatrim(w, b - v->start);
+    v->end = a;
+  } else if(a <= v->start && b >= v->end){
+    begin_opn(IPUTBLOCKS);
+    vmaput(v, 1);
+    end_op();
+  } else if(a <= v->start){
+    vmatrim(v, b - v->start);
+  } else {
+    v->end = a;
+  }
+  return 0;
+}
+
+// The lowest address of p's mmap regions, below which the
+// heap must stay.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = MMAPTOP;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->flags && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Map len bytes of file f starting at offset off, or anonymous
+// memory if flags has MAP_ANONYMOUS, below p's lowest mmap
+// region. Returns the address, or -1.
+uint64
+kmmap(struct file *f, int len, int prot, int flags, int off)
+{
+  struct proc *p = myproc()->group;
+  struct vma *v;
+  uint64 start, sz;
+  int perm = PTE_R;
+
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+  } else {
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  sz = PGROUNDUP((uint64)len);
+  vmlock(myproc());
+  start = mmapbase(p);
+  if(start - PGROUNDUP(p->sz) < sz || (v = vmaalloc(p)) == 0){
+    vmunlock(myproc());
+    return -1;
+  }
+  start -= sz;
+
+  v->start = start;
+  v->end = start + sz;
+  v->perm = perm;
+  v->flags = flags & (MAP_SHARED|MAP_PRIVATE|MAP_ANONYMOUS);
+  if(f){
+    v->ip = idup(f->ip);
+    v->off = off;
+    ilock(f->ip);
+    v->filesz = 0;
+    if(f->ip->size > off)
+      v->filesz = f->ip->size - off < sz ? f->ip->size - off : sz;
+    iunlock(f->ip);
+  }
+  vmunlock(myproc());
+  return start;
+}
+
+// Unmap [addr, addr+len) from the current process's
+// mmap regions. Returns 0, or -1 on error.
+int
+kmunmap(uint64 addr, int len)
+{
+  struct proc *p = myproc()->group;
+  struct vma *v;
+  uint64 a, b, end;
+
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  end = addr + PGROUNDUP((uint64)len);
+  if(end < addr)
+    return -1;
+
+  vmlock(myproc());
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags == 0)
+      continue;
+    a = addr > v->start ? addr : v->start;
+    b = end < v->end ? end : v->end;
+    if(a < b && vmaunmap(p, v, a, b) < 0){
+      vmunlock(myproc());
+      return -1;
+    }
+  }
+  vmunlock(myproc());
+  return 0;
+}
+
+// Unmap all of p's mmap regions, when it exits or execs,
+// and so has no other threads.
+void
+munmapall(struct proc *p)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->flags)
+      vmaunmap(p, v, v->start, v->end);
+}
+
+// Give the new child np of p copies of p's vmas, and map the
+// pages of p's mmap regions into np: copy-on-write for private
+// regions, shared as they are for shared ones. Pages of shared
+// anonymous regions that p hasn't touched yet are allocated
+// first, since they would otherwise diverge.
+// Doesn't sleep. Returns 0, or -1 if out of memory, in which
+// case nothing has been mapped into np.
+int
+vmafork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *w;
+  uint64 va;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags == 0)
+      continue;
+    if((v->flags & MAP_SHARED) && v->ip == 0){
+      for(va = v->start; va < v->end; va += PGSIZE)
+        if(!ismapped(p->pagetable, va) && vmfault(p->pagetable, va, 0) == 0)
+          goto bad;
+    }
+    if(uvmshare(p->pagetable, np->pagetable, v->start, v->end,
+                (v->flags & MAP_SHARED) == 0) < 0)
+      goto bad;
+  }
+
+  for(int i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      idup(p->vma[i].ip);
+  }
+  return 0;
+
+ bad:
+  for(w = p->vma; w < v; w++)
+    if(w->flags)
+      uvmunmap(np->pagetable, w->start, (w->end - w->start) / PGSIZE, 1);
+  return -1;
+}
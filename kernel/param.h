@@ -1,15 +1,39 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define ALLCPUS      ((1L << NCPU) - 1)  // affinity mask of every CPU
+#define NOFILE       16  // open files per process, before its table grows
+#define NOFILEMAX   512  // maximum open files per process (a page of pointers)
+#define NFILE      4096  // maximum open files per system
+#define NINODE     2048  // maximum number of in-memory i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define NDISK         4  // virtio disks, as devices ROOTDEV, ROOTDEV+1, ...
+#define NVQ           4  // most request queues to use on each disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in each on-disk log area
+#define NBUF         4096  // maximum size of disk block cache
+#define NBUFMIN      (LOGBLOCKS*6)  // size the disk block cache never shrinks below
+#ifndef FSSIZE
+#define FSSIZE       2000  // size of file system in blocks; make FSSIZE=n to change
+#endif
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define NVMA         16    // program segments and mmap regions per process
+#define NPCACHE     4096   // most pages of file data in the page cache
+#define FAULTAROUND  8     // extra pages mapped by a sequential page fault
+#define SWAPDEV      (ROOTDEV+1)  // disk that user pages are paged out to, if present
+#define NSWAP        16384 // most pages of swap space used on it
+#define SWAPBATCH    16    // pages to page out when memory runs out
+#define READAHEAD    32    // most blocks a sequential read reads ahead
+#define PIPEPAGES    2     // pages of each pipe's buffer
+#define TIMESLICE    1000000  // timer cycles per tick and time slice (about 0.1s)
+#define NPRIO        3     // scheduling priority levels
+#define BOOSTTICKS   10    // ticks between raising all processes to their best level
+#define NTHREAD      16    // threads per process, itself included
 
+#define NLOCKSTAT    64    // lock names with contention counters
+#define NSYSCALL     64    // system call numbers, for counters and trace masks
+#define NPROFRING    512   // profiler samples each CPU keeps until profread()
+#define UARTHART     0     // hart the console's interrupts go to, once it starts
+#define DISKHART     1     // hart the disk's interrupts go to, once it starts
@@ -0,0 +1,240 @@
+//
+// Page cache: whole pages of the data of files, for readi()
+// to copy from and for MAP_SHARED mappings of files to map.
+//
+// A cached page holds the file's data at a page-aligned offset,
+// with zeroes past the end of the file. writei() still writes
+// file data through the buffer cache and the log, so that it
+// is crash-safe, and also into the cached page, if there is
+// one; so a cached page is never newer than the disk except by
+// stores through a shared mapping, which are written back when
+// the mapping goes away. Metadata, including directories, is
+// only in the buffer cache.
+//
+// Pages are keyed by the address of their inode's entry in the
+// inode table, so an inode's pages are dropped when it is
+// truncated, and when its entry is recycled for another inode.
+// The cache holds a reference to each of its pages; mappings of
+// a page hold their own. When the cache runs out of entries,
+// or kalloc() out of memory, pages no one else references are
+// given back.
+//
+// Private file mappings, including program text, map cached
+// pages read-only, so that every process running a program
+// shares its pages. Such pages must not change under them: a
+// write to one takes it out of the cache instead, leaving the
+// old contents to the mappings.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+struct cpage {
+  struct inode *ip;     // 0 if free
+  uint off;             // file offset of the page
+  uint64 pa;
+  struct cpage *next;   // hash chain, or free list
+  struct cpage *inext;  // ip's other pages
+  int priv;             // mapped by a private mapping
+};
+
+#define NPCHASH 509
+#define PCHASH(ip, off) (((uint64)(ip) / sizeof(struct inode) + (off) / PGSIZE) % NPCHASH)
+
+struct {
+  struct spinlock lock;
+  struct cpage page[NPCACHE];
+  struct cpage *hash[NPCHASH];
+  struct cpage *free;
+  int hand;             // where the search for a page to give back starts
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  for(int i = 0; i < NPCACHE; i++){
+    pcache.page[i].next = pcache.free;
+    pcache.free = &pcache.page[i];
+  }
+}
+
+// Find the cached page at offset off of ip.
+// Caller must hold pcache.lock.
+static struct cpage*
+pclookup(struct inode *ip, uint off)
+{
+  struct cpage *c;
+
+  for(c = pcache.hash[PCHASH(ip, off)]; c; c = c->next)
+    if(c->ip == ip && c->off == off)
+      return c;
+  return 0;
+}
+
+// Take c out of the cache, dropping the cache's reference to
+// its page. Caller must hold pcache.lock.
+static void
+pcremove(struct cpage *c)
+{
+  struct cpage **cp;
+
+  for(cp = &pcache.hash[PCHASH(c->ip, c->off)]; *cp != c; cp = &(*cp)->next)
+    ;
+  *cp = c->next;
+  for(cp = &c->ip->pages; *cp != c; cp = &(*cp)->inext)
+    ;
+  *cp = c->inext;
+  kfree((void*)c->pa);
+  c->ip = 0;
+  c->next = pcache.free;
+  pcache.free = c;
+}
+
+// Give back up to n pages that only the cache references.
+// Caller must hold pcache.lock.
+// Returns the number given back.
+static int
+pcevict(int n)
+{
+  struct cpage *c;
+  int freed = 0;
+
+  for(int i = 0; i < NPCACHE && freed < n; i++){
+    c = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    if(c->ip && krefcount((void*)c->pa) == 1){
+      pcremove(c);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+// Return a referenced page holding the data of ip at
+// page-aligned offset off, reading it in if it isn't cached,
+// and remembering that a private mapping uses it if priv is set.
+// The page may go uncached if the cache is full of pages in
+// use. Caller must hold ip->lock, perhaps shared.
+// Returns 0 if out of memory or on a read error.
+static uint64
+pcget1(struct inode *ip, uint off, int priv)
+{
+  struct cpage *c;
+  char *mem;
+  uint n;
+
+  acquire(&pcache.lock);
+  if((c = pclookup(ip, off)) != 0){
+    kincref((void*)c->pa);
+    c->priv |= priv;
+    release(&pcache.lock);
+    return c->pa;
+  }
+  release(&pcache.lock);
+
+  // read the page without the lock, since that can sleep;
+  // another holder of ip's lock may read it meanwhile.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  n = ip->size > off ? ip->size - off : 0;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(readblocks(ip, 0, (uint64)mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+
+  acquire(&pcache.lock);
+  if((c = pclookup(ip, off)) != 0){
+    kincref((void*)c->pa);
+    c->priv |= priv;
+    release(&pcache.lock);
+    kfree(mem);
+    return c->pa;
+  }
+  if(pcache.free == 0)
+    pcevict(1);
+  if((c = pcache.free) != 0){
+    pcache.free = c->next;
+    c->ip = ip;
+    c->off = off;
+    c->pa = (uint64)mem;
+    c->priv = priv;
+    c->next = pcache.hash[PCHASH(ip, off)];
+    pcache.hash[PCHASH(ip, off)] = c;
+    c->inext = ip->pages;
+    ip->pages = c;
+    kincref(mem);  // the cache's reference
+  }
+  release(&pcache.lock);
+  return (uint64)mem;
+}
+
+uint64
+pcget(struct inode *ip, uint off)
+{
+  return pcget1(ip, off, 0);
+}
+
+// Like pcget(), for a private mapping to map read-only.
+uint64
+pcgetpriv(struct inode *ip, uint off)
+{
+  return pcget1(ip, off, 1);
+}
+
+// Copy the n bytes at src, which writei() has just written at
+// offset off of ip, into ip's cached page, if there is one,
+// or drop the page if private mappings may be using it.
+// The bytes must be within one page.
+// Caller must hold ip->lock.
+void
+pcwrite(struct inode *ip, uint off, void *src, uint n)
+{
+  struct cpage *c;
+
+  if(ip->pages == 0)
+    return;
+  acquire(&pcache.lock);
+  if((c = pclookup(ip, off - off % PGSIZE)) != 0){
+    if(c->priv)
+      pcremove(c);
+    else
+      memmove((char*)c->pa + off % PGSIZE, src, n);
+  }
+  release(&pcache.lock);
+}
+
+// Drop all of ip's cached pages, when it's truncated or its
+// inode table entry is recycled. Mappings of the pages keep
+// them, but they no longer belong to the file.
+void
+pcdrop(struct inode *ip)
+{
+  acquire(&pcache.lock);
+  while(ip->pages)
+    pcremove(ip->pages);
+  release(&pcache.lock);
+}
+
+// Give back cached pages that no one else is using.
+// Called by kalloc() when it runs out of pages.
+// Returns the number of pages freed.
+int
+pcreclaim(void)
+{
+  int n;
+
+  acquire(&pcache.lock);
+  n = pcevict(32);
+  release(&pcache.lock);
+  return n;
+}
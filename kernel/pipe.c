@@ -3,22 +3,55 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// The data is a ring of PIPEPAGES pages. A writer copies
+// straight from user memory into the free part of the ring, and
+// a reader straight out of the full part, a contiguous run at a
+// time, without holding pi->lock, since copyin() and copyout()
+// may sleep to fault in a user page. Only the writer moves
+// nwrite and only the reader moves nread, so neither touches the
+// part of the ring the other is copying; writing and reading
+// keep other writers and readers out meanwhile.
+#define PIPESIZE (PIPEPAGES*PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data[PIPEPAGES];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int writing;    // a writer is copying into the ring
+  int reading;    // a reader is copying out of the ring
 };
 
+// struct pipes come from an object cache, many to a page,
+// and their rings from kalloc().
+struct kcache pipecache;
+
+void
+pipeinit(void)
+{
+  kcinit(&pipecache, "pipe", sizeof(struct pipe), 0, 0);
+}
+
+// Free pi and its ring.
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < PIPEPAGES; i++)
+    if(pi->data[i])
+      kfree(pi->data[i]);
+  kcfree(&pipecache, pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,8 +61,12 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kcalloc(&pipecache)) == 0)
     goto bad;
+  memset(pi, 0, sizeof(*pi));
+  for(int i = 0; i < PIPEPAGES; i++)
+    if((pi->data[i] = kalloc()) == 0)
+      goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -47,7 +84,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,65 +103,178 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwakeup();
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// Return the address of byte pos of pi's ring, and set *m
+// to at most max bytes of the ring from there that are on
+// the same page.
+static char*
+pipeat(struct pipe *pi, uint pos, int max, int *m)
+{
+  *m = PGSIZE - pos % PGSIZE;
+  if(*m > max)
+    *m = max;
+  return pi->data[pos / PGSIZE % PIPEPAGES] + pos % PGSIZE;
+}
+
+// Write n bytes at addr into pi. If user is set, addr is a
+// user virtual address; otherwise, a kernel address.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m, r;
+  char *dst;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  while(i < n){
-    if(pi->readopen == 0 || killed(pr)){
+  while(pi->writing){
+    if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
+    sleep(&pi->writing, &pi->lock);
+  }
+  pi->writing = 1;
+  while(i < n){
+    if(pi->readopen == 0 || killed(pr)){
+      i = -1;
+      break;
+    }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      continue;
     }
+    m = pi->nread + PIPESIZE - pi->nwrite;
+    dst = pipeat(pi, pi->nwrite, n - i < m ? n - i : m, &m);
+    release(&pi->lock);
+    r = either_copyin(dst, user, addr + i, m);
+    acquire(&pi->lock);
+    if(r == -1)
+      break;
+    pi->nwrite += m;
+    i += m;
+    wakeup(&pi->nread);
+    pollwakeup();
   }
-  wakeup(&pi->nread);
+  pi->writing = 0;
+  wakeup(&pi->writing);
   release(&pi->lock);
 
   return i;
 }
 
-int
-piperead(struct pipe *pi, uint64 addr, int n)
+// Wait for pi to have data, or no writers, and then start
+// reading it. Returns 0, or -1 if killed meanwhile, in which
+// case pi->lock is released.
+// Caller must hold pi->lock.
+static int
+pipebeginread(struct pipe *pi)
 {
-  int i;
-  struct proc *pr = myproc();
-  char ch;
-
-  acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
+  while(pi->reading || (pi->nread == pi->nwrite && pi->writeopen)){  //DOC: pipe-empty
+    if(killed(myproc())){
       release(&pi->lock);
       return -1;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    sleep(pi->reading ? (void*)&pi->reading : (void*)&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  pi->reading = 1;
+  return 0;
+}
+
+// Stop reading pi and release pi->lock. Returns i, the
+// bytes read.
+static int
+pipeendread(struct pipe *pi, int i)
+{
+  pi->reading = 0;
+  wakeup(&pi->reading);
+  release(&pi->lock);
+  return i;
+}
+
+// Read up to n bytes from pi into addr. If user is set, addr
+// is a user virtual address; otherwise, a kernel address.
+int
+piperead(struct pipe *pi, int user, uint64 addr, int n)
+{
+  int i = 0, m, r;
+  char *src;
+
+  acquire(&pi->lock);
+  if(pipebeginread(pi) < 0)
+    return -1;
+  while(i < n && pi->nread != pi->nwrite){  //DOC: piperead-copy
+    m = pi->nwrite - pi->nread;
+    src = pipeat(pi, pi->nread, n - i < m ? n - i : m, &m);
+    release(&pi->lock);
+    r = either_copyout(user, addr + i, src, m);
+    acquire(&pi->lock);
+    if(r == -1)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    pi->nread += m;
+    i += m;
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    pollwakeup();
+  }
+  return pipeendread(pi, i);
+}
+
+// Move up to n bytes from pi to file f, writing them straight
+// from the ring, as splice() does. Returns the number moved,
+// or -1 if none could be.
+int
+pipesplice(struct pipe *pi, struct file *f, int n)
+{
+  int i = 0, m, r = 0;
+  char *src;
+
+  if(f->type == FD_PIPE && f->pipe == pi)
+    return -1;  // would wait on itself
+  acquire(&pi->lock);
+  if(pipebeginread(pi) < 0)
+    return -1;
+  while(i < n && pi->nread != pi->nwrite){
+    m = pi->nwrite - pi->nread;
+    src = pipeat(pi, pi->nread, n - i < m ? n - i : m, &m);
+    release(&pi->lock);
+    r = filewrite1(f, 0, (uint64)src, m);
+    acquire(&pi->lock);
+    if(r > 0){
+      pi->nread += r;
+      i += r;
+      wakeup(&pi->nwrite);
+      pollwakeup();
+    }
+    if(r != m)
       break;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  return pipeendread(pi, i == 0 && r < 0 ? -1 : i);
+}
+
+// Return which of poll()'s events pi is ready for: POLLIN if
+// a read() wouldn't block, POLLOUT if a write() wouldn't, and
+// POLLHUP or POLLERR if the writers or readers are gone.
+int
+pipepoll(struct pipe *pi)
+{
+  int ev = 0;
+
+  acquire(&pi->lock);
+  if(pi->nread != pi->nwrite || pi->writeopen == 0)
+    ev |= POLLIN;
+  if(pi->writeopen == 0)
+    ev |= POLLHUP;
+  if(pi->nwrite != pi->nread + PIPESIZE || pi->readopen == 0)
+    ev |= POLLOUT;
+  if(pi->readopen == 0)
+    ev |= POLLERR;
   release(&pi->lock);
-  return i;
+  return ev;
 }
@@ -2,28 +2,111 @@
 #include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+#include "irq.h"
 #include "defs.h"
 
 //
 // the riscv Platform Level Interrupt Controller (PLIC).
 //
+// Each device interrupt is enabled on just one hart, so that
+// its handler's locks and data stay in that hart's cache and
+// the harts don't all race to claim it. It starts on hart 0,
+// and moves to its default hart (see param.h) when that one
+// starts; irqroute() moves it elsewhere. The PLIC ignores the
+// completion of an interrupt that is no longer enabled for the
+// hart completing it, so an interrupt being served only moves
+// once it is complete.
+//
+
+struct irq {
+  int irq;
+  char *name;
+  int defhart;       // hart to route it to once that has started
+  int hart;          // hart it's enabled on
+  int busy;          // claimed and not yet completed
+  uint64 count[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  uint64 started;    // harts that have called plicinithart()
+  struct irq irq[1+NDISK];  // the console's, then each disk's
+} plic = {
+  .irq = {
+    { UART0_IRQ, "uart", UARTHART },
+  },
+};
+
+// irqstat() names, for up to qemu's eight virtio disks.
+static char *disknames[] = {
+  "disk", "disk1", "disk2", "disk3", "disk4", "disk5", "disk6", "disk7",
+};
+
+static struct irq*
+irqlookup(int irq)
+{
+  for(struct irq *q = plic.irq; q < &plic.irq[NELEM(plic.irq)]; q++)
+    if(q->irq == irq)
+      return q;
+  return 0;
+}
+
+// The hart q should be on: the one it was routed to, if that
+// has started. Caller must hold plic.lock.
+static int
+irqtarget(struct irq *q)
+{
+  return (plic.started & (1L << q->defhart)) ? q->defhart : q->hart;
+}
+
+// Enable q on hart instead of where it is now.
+// Caller must hold plic.lock.
+static void
+irqmove(struct irq *q, int hart)
+{
+  *(uint32*)PLIC_SENABLE(q->hart) &= ~(1 << q->irq);
+  *(uint32*)PLIC_SENABLE(hart) |= 1 << q->irq;
+  q->hart = hart;
+}
 
 void
 plicinit(void)
 {
-  // set desired IRQ priorities non-zero (otherwise disabled).
-  *(uint32*)(PLIC + UART0_IRQ*4) = 1;
-  *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
+  initlock(&plic.lock, "plic");
+  // each disk's interrupts go to the next hart along.
+  for(int i = 0; i < NDISK; i++){
+    plic.irq[1+i].irq = VIRTIO_IRQ(i);
+    plic.irq[1+i].name = disknames[i];
+    plic.irq[1+i].defhart = (DISKHART + i) % NCPU;
+  }
+  for(struct irq *q = plic.irq; q < &plic.irq[NELEM(plic.irq)]; q++){
+    // set desired IRQ priorities non-zero (otherwise disabled).
+    *(uint32*)(PLIC + q->irq*4) = 1;
+    q->hart = 0;
+  }
 }
 
 void
 plicinithart(void)
 {
   int hart = cpuid();
-  
+  uint32 enable = 0;
+
+  acquire(&plic.lock);
+  plic.started |= 1L << hart;
+  for(struct irq *q = plic.irq; q < &plic.irq[NELEM(plic.irq)]; q++){
+    if(q->defhart == hart && hart != 0 && !q->busy)
+      irqmove(q, hart);
+    if(q->hart == hart)
+      enable |= 1 << q->irq;
+  }
   // set enable bits for this hart's S-mode
-  // for the uart and virtio disk.
-  *(uint32*)PLIC_SENABLE(hart) = (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
+  // for the devices routed to it.
+  *(uint32*)PLIC_SENABLE(hart) = enable;
+  release(&plic.lock);
 
   // set this hart's S-mode priority threshold to 0.
   *(uint32*)PLIC_SPRIORITY(hart) = 0;
@@ -34,14 +117,78 @@ int
 plic_claim(void)
 {
   int hart = cpuid();
-  int irq = *(uint32*)PLIC_SCLAIM(hart);
+  struct irq *q;
+  int irq;
+
+  // under the lock, so that irqroute() can't move it
+  // between the claim and noting that it's busy.
+  acquire(&plic.lock);
+  irq = *(uint32*)PLIC_SCLAIM(hart);
+  if((q = irqlookup(irq)) != 0){
+    q->busy = 1;
+    q->count[hart]++;
+  }
+  release(&plic.lock);
   return irq;
 }
 
-// tell the PLIC we've served this IRQ.
+// tell the PLIC we've served this IRQ, and move it if
+// irqroute() asked to meanwhile.
 void
 plic_complete(int irq)
 {
   int hart = cpuid();
+  struct irq *q;
+
+  acquire(&plic.lock);
   *(uint32*)PLIC_SCLAIM(hart) = irq;
+  if((q = irqlookup(irq)) != 0){
+    q->busy = 0;
+    if(irqtarget(q) != q->hart)
+      irqmove(q, irqtarget(q));
+  }
+  release(&plic.lock);
+}
+
+// Send device interrupt irq to hart from now on.
+// Returns 0, or -1 if there's no such irq or hart.
+int
+irqroute(int irq, int hart)
+{
+  struct irq *q;
+
+  acquire(&plic.lock);
+  if((q = irqlookup(irq)) == 0 || hart < 0 || hart >= NCPU ||
+     (plic.started & (1L << hart)) == 0){
+    release(&plic.lock);
+    return -1;
+  }
+  q->defhart = hart;
+  if(!q->busy)
+    irqmove(q, hart);
+  release(&plic.lock);
+  return 0;
+}
+
+// Copy the routing and counts of up to n device interrupts
+// to user address addr as struct irqstats.
+// Returns the number copied, or -1.
+int
+irqstatcopy(uint64 addr, int n)
+{
+  struct irqstat st;
+  int i;
+
+  for(i = 0; i < n && i < NELEM(plic.irq); i++){
+    memset(&st, 0, sizeof(st));
+    acquire(&plic.lock);
+    st.irq = plic.irq[i].irq;
+    st.hart = irqtarget(&plic.irq[i]);
+    safestrcpy(st.name, plic.irq[i].name, sizeof(st.name));
+    memmove(st.count, plic.irq[i].count, sizeof(st.count));
+    release(&plic.lock);
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return i;
 }
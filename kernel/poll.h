@@ -0,0 +1,12 @@
+// poll() descriptors and events
+struct pollfd {
+  int fd;         // file descriptor, or negative to skip
+  short events;   // events to wait for
+  short revents;  // events that happened
+};
+
+#define POLLIN    0x001  // there is data to read
+#define POLLOUT   0x004  // writing won't block
+#define POLLERR   0x008  // the other end of a pipe is closed to readers
+#define POLLHUP   0x010  // the other end of a pipe is closed to writers
+#define POLLNVAL  0x020  // fd isn't open
@@ -13,18 +13,114 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
+#include "rusage.h"
 #include "proc.h"
 
 volatile int panicking = 0; // printing a panic message
 volatile int panicked = 0; // spinning forever at end of a panic
 
-// lock to avoid interleaving concurrent printf's.
+// Each CPU's printf()s append to a ring of its own, with
+// interrupts off but without taking a lock or waiting for the
+// UART. A message is published to the ring when printf()
+// returns, and printdrain() moves published messages on to
+// the UART's transmit ring, as there is room; the UART
+// interrupt calls it again as that ring drains. While booting,
+// when a CPU's ring fills, and once the kernel panics, output
+// is written synchronously instead; panic() first writes out
+// whatever the rings and the UART's ring still hold.
+#define PRBUFSZ 2048
+
+struct prbuf {
+  char buf[PRBUFSZ];
+  uint64 next;   // end of the message being written; only its CPU uses it
+  uint64 w;      // end of the published messages; only its CPU sets it
+  uint64 r;      // end of what's been drained, under pr.lock
+};
+
 static struct {
-  struct spinlock lock;
+  struct spinlock lock;   // for draining, and synchronous printf's
+  struct prbuf buf[NCPU];
+  int cur;                // ring to drain first: its message is part drained
+  int async;              // set once booted
 } pr;
 
 static char digits[] = "0123456789abcdef";
 
+// Write the published messages in the rings straight to the
+// UART, in order, waiting for it. While panicking, without
+// pr.lock, since a CPU that holds it may never let it go.
+static void
+printsync(void)
+{
+  struct prbuf *pb;
+
+  if(!panicking)
+    acquire(&pr.lock);
+  for(int i = 0; i < NCPU; i++){
+    pb = &pr.buf[(pr.cur + i) % NCPU];
+    __sync_synchronize();
+    while(pb->r != pb->w)
+      uartputc_sync(pb->buf[pb->r++ % PRBUFSZ]);
+  }
+  if(!panicking)
+    release(&pr.lock);
+}
+
+// Move as many published messages from the rings to the
+// UART's transmit ring as there is room for.
+void
+printdrain(void)
+{
+  struct prbuf *pb;
+  uint64 w;
+  int n, m;
+
+  if(!pr.async)
+    return;
+  acquire(&pr.lock);
+  for(int i = 0; i < NCPU; i++){
+    pb = &pr.buf[(pr.cur + i) % NCPU];
+    w = pb->w;
+    __sync_synchronize();  // read w before the bytes it publishes
+    while(pb->r != w){
+      n = w - pb->r;
+      if(n > PRBUFSZ - pb->r % PRBUFSZ)
+        n = PRBUFSZ - pb->r % PRBUFSZ;
+      m = uartqueue(&pb->buf[pb->r % PRBUFSZ], n);
+      pb->r += m;
+      if(m < n){
+        // the UART's ring is full; finish this message first,
+        // so that messages don't interleave.
+        pr.cur = (pr.cur + i) % NCPU;
+        release(&pr.lock);
+        return;
+      }
+    }
+  }
+  release(&pr.lock);
+}
+
+// Add c to the message this CPU is printing.
+// Called with interrupts off.
+static void
+prputc(int c)
+{
+  struct prbuf *pb;
+
+  if(!pr.async || panicking){
+    consputc(c);
+    return;
+  }
+  pb = &pr.buf[cpuid()];
+  if(pb->next - pb->r == PRBUFSZ){
+    // full: publish what there is, and write it all out now.
+    __sync_synchronize();
+    pb->w = pb->next;
+    printsync();
+  }
+  pb->buf[pb->next++ % PRBUFSZ] = c;
+}
+
 static void
 printint(long long xx, int base, int sign)
 {
@@ -46,17 +142,17 @@ printint(long long xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    prputc(buf[i]);
 }
 
 static void
 printptr(uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  prputc('0');
+  prputc('x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    prputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the console.
@@ -66,14 +162,18 @@ printf(char *fmt, ...)
   va_list ap;
   int i, cx, c0, c1, c2;
   char *s;
+  int async = pr.async && !panicking;
+  struct prbuf *pb;
 
-  if(panicking == 0)
+  if(async)
+    push_off();  // stay on this CPU, and its ring
+  else if(panicking == 0)
     acquire(&pr.lock);
 
   va_start(ap, fmt);
   for(i = 0; (cx = fmt[i] & 0xff) != 0; i++){
     if(cx != '%'){
-      consputc(cx);
+      prputc(cx);
       continue;
     }
     i++;
@@ -108,27 +208,34 @@ printf(char *fmt, ...)
     } else if(c0 == 'p'){
       printptr(va_arg(ap, uint64));
     } else if(c0 == 'c'){
-      consputc(va_arg(ap, uint));
+      prputc(va_arg(ap, uint));
     } else if(c0 == 's'){
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        prputc(*s);
     } else if(c0 == '%'){
-      consputc('%');
+      prputc('%');
     } else if(c0 == 0){
       break;
     } else {
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c0);
+      prputc('%');
+      prputc(c0);
     }
 
   }
   va_end(ap);
 
-  if(panicking == 0)
+  if(async){
+    pb = &pr.buf[cpuid()];
+    __sync_synchronize();  // the bytes before w
+    pb->w = pb->next;
+    pop_off();
+    printdrain();
+  } else if(panicking == 0){
     release(&pr.lock);
+  }
 
   return 0;
 }
@@ -137,6 +244,10 @@ void
 panic(char *s)
 {
   panicking = 1;
+  // first what's already on its way to the UART, then the
+  // rings' messages that came after it.
+  uartflush();
+  printsync();
   printf("panic: ");
   printf("%s\n", s);
   panicked = 1; // freeze uart output from other CPUs
@@ -149,3 +260,11 @@ printfinit(void)
 {
   initlock(&pr.lock, "pr");
 }
+
+// Switch printf() to the per-CPU rings, once the UART can
+// interrupt to drain them.
+void
+printfstart(void)
+{
+  pr.async = 1;
+}
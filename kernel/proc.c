@@ -3,12 +3,77 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
+#include "vdso.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are allocated as they are needed, a page
+// each, along with a kernel stack, up to NPROC of them. They
+// are never freed: freeproc() puts an unused one on a free
+// list for the next allocproc(), and every one stays on the
+// allproc list, newest first, so that code scanning the list
+// without a lock never sees one go away.
+struct proc *allproc;
+static struct proc *freeprocs;
+static int nproc;                // number allocated
+struct spinlock proc_lock;       // protects freeprocs, nproc and adding to allproc
+
+extern pagetable_t kernel_pagetable;
+
+static uint64 cpustarted;        // CPUs that have entered scheduler()
+
+// Each CPU has a queue of RUNNABLE processes, so that the
+// schedulers needn't scan allproc and take every p->lock
+// to find one. A process joins the queue of the CPU it last
+// ran on, where its cache is likely still warm, unless its
+// affinity mask no longer allows that CPU. A CPU whose queue
+// is empty steals from the others the processes whose masks
+// allow it. A p->lock may be held while taking a queue's lock,
+// but not the other way round.
+//
+// The queues are multi-level feedback queues: a CPU runs the
+// processes of level 0 first, round robin, then those of
+// level 1, and so on. A process that has run for a whole
+// TIMESLICE at its level drops a level, so processes that
+// block often stay above CPU-bound ones, and every BOOSTTICKS
+// all processes go back up as far as setpriority() allows,
+// so that those on low levels don't starve.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                    // number of processes queued
+  uint boosted;             // ticks at the last boost
+};
+
+struct runq runq[NCPU];
+
+// Sleeping processes are kept on wait queues hashed by their
+// channel, so that wakeup() only looks at the processes that
+// might be sleeping on it. A process is on a queue exactly
+// while it is SLEEPING, and both its p->lock and the queue's
+// lock are held to add or remove it. A queue's lock must be
+// acquired before any p->lock.
+#define NSLEEPQ 61
+#define SQHASH(chan) (((uint64)(chan) / sizeof(uint64)) % NSLEEPQ)
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+};
+
+struct sleepq sleepq[NSLEEPQ];
+
+// futex_wait() checks the word and sleeps holding one of these,
+// hashed by the word's physical address, and futex_wake()
+// wakes up holding it, so that no wakeup is lost in between.
+#define NFUTEX 31
+#define FUTEXHASH(pa) (((pa) / sizeof(int)) % NFUTEX)
+
+struct spinlock futexlock[NFUTEX];
 
 struct proc *initproc;
 
@@ -17,45 +82,83 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static void adopt(struct proc *p, struct proc *c);
+static void account(struct proc *p);
+static void ruadd(struct rusage *a, struct rusage *b);
 
 extern char trampoline[]; // trampoline.S
 
-// helps ensure that wakeups of wait()ing
-// parents are not lost. helps obey the
-// memory model when using p->parent.
-// must be acquired before any p->lock.
-struct spinlock wait_lock;
-
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// Each process's kernel stack is mapped high in memory,
+// followed by an invalid guard page, when its struct proc
+// is allocated. Allocate the page-table pages for all the
+// stacks now, which every hart's copy of the kernel page
+// table then shares, so that mapping a stack later can't fail.
 void
 proc_mapstacks(pagetable_t kpgtbl)
+{
+  for(int i = 0; i < NPROC; i++)
+    if(walk(kpgtbl, KSTACK(i), 1) == 0)
+      panic("proc_mapstacks");
+}
+
+// Return an unused struct proc from the free list, or else
+// allocate a new one and its kernel stack. Returns 0 if there
+// are NPROC already or out of memory.
+static struct proc*
+newproc(void)
 {
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  char *stack;
+
+  acquire(&proc_lock);
+  if((p = freeprocs) != 0){
+    freeprocs = p->freenext;
+    release(&proc_lock);
+    return p;
+  }
+  if(nproc == NPROC || (p = kalloc()) == 0){
+    release(&proc_lock);
+    return 0;
+  }
+  if((stack = kalloc()) == 0){
+    kfree(p);
+    release(&proc_lock);
+    return 0;
   }
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  initlock(&p->glock, "group");
+  initlock(&p->childlock, "children");
+  p->state = UNUSED;
+  p->kstack = KSTACK(nproc);
+  if(mappages(kernel_pagetable, p->kstack, PGSIZE, (uint64)stack, PTE_R | PTE_W) != 0)
+    panic("newproc");
+  sfence_vma();
+  nproc++;
+
+  // make p's initialization visible before p itself.
+  p->allnext = allproc;
+  __sync_synchronize();
+  allproc = p;
+  release(&proc_lock);
+  return p;
 }
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
+  if(sizeof(struct proc) > PGSIZE)
+    panic("procinit: struct proc");
   initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&proc_lock, "proc_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
 }
 
 // Must be called with interrupts disabled,
@@ -102,7 +205,7 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Get an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
@@ -111,22 +214,31 @@ allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  if((p = newproc()) == 0)
+    return 0;
+  acquire(&p->lock);
 
-found:
   p->pid = allocpid();
   p->state = USED;
-
-  // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  p->cpu = cpuid();
+  p->prio = p->maxprio = 0;
+  p->runtime = 0;
+  p->affinity = ALLCPUS;
+  p->tracemask = 0;
+  memset(p->ncall, 0, sizeof(p->ncall));
+  memset(p->systime, 0, sizeof(p->systime));
+  memset(&p->ru, 0, sizeof(p->ru));
+  memset(&p->tru, 0, sizeof(p->tru));
+  memset(&p->cru, 0, sizeof(p->cru));
+  p->group = p;
+  p->trapva = TRAPFRAME;
+  p->nthread = 1;
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+
+  // Allocate a trapframe page, and a vdso page.
+  if((p->trapframe = (struct trapframe *)kalloc()) == 0 ||
+     (p->vdso = (struct vdso *)kalloc()) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -151,24 +263,47 @@ found:
 
 // free a proc structure and the data hanging from it,
 // including user pages.
-// p->lock must be held.
+// p->lock must be held, and for a thread, its group's glock.
 static void
 freeproc(struct proc *p)
 {
+  if(p->group != p && p->group != 0){
+    // a thread: the page table is the group's, and only the
+    // trapframe is its own.
+    uvmunmap(p->pagetable, p->trapva, 1, 0);
+  } else if(p->pagetable){
+    proc_freepagetable(p->pagetable, p->sz);
+  }
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+  if(p->vdso)
+    kfree((void*)p->vdso);
+  p->vdso = 0;
+  if(p->ofile != p->ofile0)
+    kfree(p->ofile);
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
   p->pagetable = 0;
+  p->group = 0;
   p->sz = 0;
+  p->faultnext = 0;
+  p->vmdead = 0;
+  p->pageoutva = 0;
+  p->asidgen = 0;
   p->pid = 0;
   p->parent = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&proc_lock);
+  p->freenext = freeprocs;
+  freeprocs = p;
+  release(&proc_lock);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -202,6 +337,18 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the vdso page where user code can read it.
+  memset(p->vdso, 0, PGSIZE);
+  p->vdso->timeslice = TIMESLICE;
+  p->vdso->pid = p->pid;
+  if(mappages(pagetable, VDSO, PGSIZE,
+              (uint64)(p->vdso), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -212,6 +359,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, VDSO, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -226,7 +374,7 @@ userinit(void)
   
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -238,40 +386,232 @@ growproc(int n)
 {
   uint64 sz;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
-  sz = p->sz;
+  vmlock(p);
+  sz = g->sz;
   if(n > 0){
+    if(sz + n < sz || sz + n > mmapbase(g)){
+      vmunlock(p);
+      return -1;
+    }
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+      vmunlock(p);
       return -1;
     }
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
-  p->sz = sz;
+  g->sz = sz;
+  vmunlock(p);
+  return 0;
+}
+
+// Acquire the vm lock of p's thread group, which a thread
+// holds while it changes the group's page table or mmap
+// regions, so that threads faulting, mapping and unmapping
+// at once don't trip over each other. It is a sleep-lock
+// made of glock and vmholder, and comes before inode locks
+// and transactions. Not re-entrant.
+void
+vmlock(struct proc *p)
+{
+  struct proc *g = p->group;
+
+  acquire(&g->glock);
+  while(g->vmholder)
+    sleep(&g->vmholder, &g->glock);
+  g->vmholder = p;
+  release(&g->glock);
+}
+
+void
+vmunlock(struct proc *p)
+{
+  struct proc *g = p->group;
+
+  acquire(&g->glock);
+  if(g->vmholder != p)
+    panic("vmunlock");
+  g->vmholder = 0;
+  wakeup(&g->vmholder);
+  release(&g->glock);
+}
+
+// Acquire the vm lock of thread group leader g for the current
+// thread, which needn't belong to it, unless another thread
+// holds it. Doesn't sleep. Returns 1 if it got the lock.
+static int
+vmtrylock(struct proc *g)
+{
+  int got;
+
+  acquire(&g->glock);
+  got = g->vmholder == 0;
+  if(got)
+    g->vmholder = myproc();
+  release(&g->glock);
+  return got;
+}
+
+static void
+vmrelease(struct proc *g)
+{
+  acquire(&g->glock);
+  g->vmholder = 0;
+  wakeup(&g->vmholder);
+  release(&g->glock);
+}
+
+// the process kpageout() looked at last. Callers on different
+// harts may race on it, which only repeats or skips a process.
+static struct proc *pageouthand;
+
+// Page out up to n pages of some process's memory, since
+// kalloc() has run out, visiting thread groups round robin from
+// where the last call left off. Leaves alone a group whose vm
+// lock another thread holds, since it may be waiting for the
+// caller; one that is exiting; and one with several threads,
+// which may sleep in futex_wait() on a word known by its
+// physical address, which mustn't change. Goes round at most
+// twice, since the first time may only clear pages' PTE_A.
+// The caller may hold its own group's vm lock, but no spinlock.
+// May sleep. Returns the number of pages paged out.
+int
+kpageout(int n)
+{
+  struct proc *p = myproc(), *q;
+  int out = 0, held, ok;
+
+  if(p == 0 || swapavail() == 0)
+    return 0;
+  for(int i = 0; i < 2*nproc && out < n; i++){
+    q = pageouthand ? pageouthand->allnext : 0;
+    if(q == 0)
+      q = allproc;
+    pageouthand = q;
+    held = q == p->group && q->vmholder == p;
+    if(!held && !vmtrylock(q))
+      continue;
+    acquire(&q->lock);
+    ok = q->group == q && !q->vmdead && q->nthread == 1 &&
+      (q->state == SLEEPING || q->state == RUNNABLE || q->state == RUNNING);
+    release(&q->lock);
+    if(ok)
+      out += uvmpageout(q, n - out);
+    if(!held)
+      vmrelease(q);
+  }
+  return out;
+}
+
+// Grow the file descriptor table of g, a thread group leader,
+// from NOFILE entries to NOFILEMAX. Caller must hold g->glock,
+// unless no one else can see g yet.
+// Returns 0, or -1 if it's as big as it gets or out of memory.
+int
+fdgrow(struct proc *g)
+{
+  struct file **ofile;
+
+  if(g->nofile == NOFILEMAX || (ofile = kalloc()) == 0)
+    return -1;
+  memset(ofile, 0, PGSIZE);
+  memmove(ofile, g->ofile, g->nofile * sizeof(ofile[0]));
+  g->ofile = ofile;
+  g->nofile = NOFILEMAX;
+  return 0;
+}
+
+// Give the new process np duplicates of the open files of g,
+// a thread group leader: all of them if fd is 0, or else g's
+// descriptor fd[i] as np's descriptor i, for each i < nfd,
+// which is at most NOFILE.
+// Returns 0, or -1 if out of memory.
+static int
+fdcopy(struct proc *g, struct proc *np, int *fd, int nfd)
+{
+  acquire(&g->glock);
+  if(fd == 0 && g->nofile > np->nofile && fdgrow(np) < 0){
+    release(&g->glock);
+    return -1;
+  }
+  for(int i = 0; i < g->nofile; i++){
+    if(fd == 0){
+      if(g->ofile[i])
+        np->ofile[i] = filedup(g->ofile[i]);
+    } else if(i < nfd && fd[i] >= 0 && fd[i] < g->nofile && g->ofile[fd[i]]){
+      np->ofile[i] = filedup(g->ofile[fd[i]]);
+    }
+  }
+  release(&g->glock);
   return 0;
 }
 
+// Close all of p's open files, when it exits, or when fork()
+// fails after duplicating them. p has no other threads.
+static void
+fdcloseall(struct proc *p)
+{
+  for(int fd = 0; fd < p->nofile; fd++){
+    if(p->ofile[fd]){
+      struct file *f = p->ofile[fd];
+      fileclose(f);
+      p->ofile[fd] = 0;
+    }
+  }
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
+// If the parent is a thread, the child is a process of its own
+// with a copy of the thread group's memory and files.
 int
 kfork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
+  // copying may sleep, so np->lock can't be held; np is
+  // USED rather than RUNNABLE, so no one else looks at it.
+  release(&np->lock);
+
+  // increment reference counts on open file descriptors.
+  if(fdcopy(g, np, 0, 0) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  vmlock(p);
+  if(uvmcopy(p->pagetable, np->pagetable, g->sz) < 0){
+    vmunlock(p);
+    fdcloseall(np);
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->sz = g->sz;
+
+  // and the parent's program segments and mmap regions.
+  if(vmafork(g, np) < 0){
+    vmunlock(p);
+    fdcloseall(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  vmunlock(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -279,83 +619,336 @@ kfork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  acquire(&g->glock);
+  np->cwd = idup(g->cwd);
+  release(&g->glock);
+
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->prio = np->maxprio = p->maxprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
+
   pid = np->pid;
 
+  acquire(&p->childlock);
+  adopt(p, np);
+  release(&p->childlock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a new process running the program at path, without
+// copying the caller's memory as fork() would: the child's
+// image comes straight from execproc(). For each i < nfd,
+// the child's file descriptor i is a duplicate of the caller's
+// descriptor fd[i], or closed if fd[i] < 0; if fd is 0, the
+// child gets all of the caller's descriptors.
+// Returns the child's pid, or -1.
+int
+kspawn(char *path, char **argv, int *fd, int nfd)
+{
+  int pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  // execproc() sleeps, so np->lock can't be held; np is
+  // USED rather than RUNNABLE, so no one else looks at it.
   release(&np->lock);
 
-  acquire(&wait_lock);
-  np->parent = p;
-  release(&wait_lock);
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  if((argc = execproc(np, path, argv)) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  if(fdcopy(g, np, fd, nfd) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  acquire(&g->glock);
+  np->cwd = idup(g->cwd);
+  release(&g->glock);
+
+  np->prio = np->maxprio = p->maxprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
+
+  pid = np->pid;
+
+  acquire(&p->childlock);
+  adopt(p, np);
+  release(&p->childlock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Create a new thread in the caller's thread group, sharing
+// its page table, open files and current directory. The thread
+// starts at user address fn with arg in a0 and its stack
+// pointer at stack, which the caller provides; it must exit()
+// rather than return. Its trapframe gets one of the pages
+// below TRAPFRAME. Returns the thread's id (a pid), or -1.
+int
+kclone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int tid;
+  uint64 va;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  release(&np->lock);
+
+  // np uses the group's page table, and vdso, instead of its own.
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = 0;
+  kfree((void*)np->vdso);
+  np->vdso = 0;
+
+  vmlock(p);
+  for(va = TRAPFRAME - PGSIZE; va > VDSO; va -= PGSIZE)
+    if(!ismapped(p->pagetable, va))
+      break;
+  if(va == VDSO ||
+     mappages(p->pagetable, va, PGSIZE, (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    vmunlock(p);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  vmunlock(p);
+  np->trapva = va;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->trapframe->ra = 0;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->prio = np->maxprio = p->maxprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
+  tid = np->pid;
+
+  acquire(&g->glock);
+  np->pagetable = p->pagetable;
+  np->group = g;
+  if(killed(p)){
+    // the leader may be exiting, and has already killed
+    // the threads it found.
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    release(&g->glock);
+    return -1;
+  }
+  g->nthread++;
+  g->vdso->pid = 0;
+  release(&g->glock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Wait for the thread tid of the caller's group, or any
+// other thread of the group if tid is 0, to exit, and return
+// its id. Return -1 if there is no such thread.
+int
+kjoin(int tid, uint64 addr)
+{
+  struct proc *q;
+  int found, xstate;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  acquire(&g->glock);
+
+  for(;;){
+    found = 0;
+    for(q = allproc; q; q = q->allnext){
+      if(q->group != g || q == g || q == p || (tid != 0 && q->pid != tid))
+        continue;
+      acquire(&q->lock);
+      found = 1;
+      if(q->state == ZOMBIE){
+        tid = q->pid;
+        xstate = q->xstate;
+        ruadd(&g->tru, &q->ru);
+        freeproc(q);
+        release(&q->lock);
+        release(&g->glock);
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                sizeof(xstate)) < 0)
+          return -1;
+        return tid;
+      }
+      release(&q->lock);
+    }
+
+    if(!found || killed(p)){
+      release(&g->glock);
+      return -1;
+    }
+
+    // thread exits wake up the group leader's channel.
+    sleep(g, &g->glock);
+  }
+}
+
+// Make c a child of p. Caller must hold p->childlock.
+static void
+adopt(struct proc *p, struct proc *c)
+{
+  c->parent = p;
+  c->sibling = p->child;
+  p->child = c;
+}
+
 // Pass p's abandoned children to init.
-// Caller must hold wait_lock.
+// Caller must hold p->childlock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  struct proc *c;
+
+  if(p->child == 0)
+    return;
+  acquire(&initproc->childlock);
+  while((c = p->child) != 0){
+    p->child = c->sibling;
+    adopt(initproc, c);
   }
+  // some of them may be zombies already.
+  wakeup(initproc);
+  release(&initproc->childlock);
 }
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
+// A thread exits on its own, leaving the group's memory and
+// files to the others, and remains a zombie until a thread of
+// its group calls join(). The leader of a thread group first
+// kills the other threads and waits for them to exit.
 void
 kexit(int status)
 {
   struct proc *p = myproc();
+  struct proc *q, *pp;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(p->group != p){
+    struct proc *g = p->group;
+
+    acquire(&p->childlock);
+    reparent(p);
+    release(&p->childlock);
+
+    acquire(&g->glock);
+    if(--g->nthread == 1)
+      g->vdso->pid = g->pid;
+    // the leader or a sibling might be sleeping in join()
+    // or exit().
+    wakeup(g);
+    acquire(&p->lock);
+    p->xstate = status;
+    p->state = ZOMBIE;
+    account(p);
+    release(&g->glock);
+    sched();
+    panic("zombie exit");
+  }
+
+  acquire(&p->glock);
+  if(p->nthread > 1){
+    for(q = allproc; q; q = q->allnext)
+      if(q->group == p && q != p)
+        kkill(q->pid);
+    while(p->nthread > 1)
+      sleep(p, &p->glock);
+    for(q = allproc; q; q = q->allnext){
+      if(q->group == p && q != p){
+        acquire(&q->lock);
+        ruadd(&p->tru, &q->ru);
+        freeproc(q);
+        release(&q->lock);
+      }
     }
   }
+  release(&p->glock);
+
+  // keep kpageout() away from the memory from now on.
+  vmlock(p);
+  p->vmdead = 1;
+  vmunlock(p);
+
+  // Close all open files.
+  fdcloseall(p);
+
+  // writes back modified pages of shared file mappings.
+  munmapall(p);
 
   begin_op();
   iput(p->cwd);
+  vmaput(p->vma, NVMA);
   end_op();
   p->cwd = 0;
 
-  acquire(&wait_lock);
-
   // Give any children to init.
+  acquire(&p->childlock);
   reparent(p);
+  release(&p->childlock);
+
+  // Lock the parent's list of children. The parent may be
+  // exiting too and pass us to init meanwhile, so make sure
+  // that it is still the parent with its lock held.
+  for(;;){
+    pp = p->parent;
+    acquire(&pp->childlock);
+    if(p->parent == pp)
+      break;
+    release(&pp->childlock);
+  }
 
   // Parent might be sleeping in wait().
-  wakeup(p->parent);
+  wakeup(pp);
   
   acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
+  account(p);
 
-  release(&wait_lock);
+  release(&pp->childlock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -367,50 +960,224 @@ kexit(int status)
 int
 kwait(uint64 addr)
 {
-  struct proc *pp;
-  int havekids, pid;
+  struct proc *pp, **cp;
+  int havekids, pid, xstate;
+  struct rusage ru;
   struct proc *p = myproc();
 
-  acquire(&wait_lock);
+  acquire(&p->childlock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
-          release(&pp->lock);
-          release(&wait_lock);
-          return pid;
-        }
+    // Scan through our children looking for exited ones.
+    havekids = p->child != 0;
+    for(cp = &p->child; (pp = *cp) != 0; cp = &pp->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      if(pp->state == ZOMBIE){
+        // Found one.
+        *cp = pp->sibling;
+        pid = pp->pid;
+        xstate = pp->xstate;
+        // the child and its threads and children all count
+        // towards the children of p's group.
+        ru = pp->ru;
+        ruadd(&ru, &pp->tru);
+        ruadd(&ru, &pp->cru);
+        freeproc(pp);
         release(&pp->lock);
+        release(&p->childlock);
+        acquire(&p->group->glock);
+        ruadd(&p->group->cru, &ru);
+        release(&p->group->glock);
+        // copyout() may sleep, so it must be called
+        // without holding any spinlocks.
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                sizeof(xstate)) < 0)
+          return -1;
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || killed(p)){
-      release(&wait_lock);
+      release(&p->childlock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &wait_lock);  //DOC: wait-sleep
+    sleep(p, &p->childlock);  //DOC: wait-sleep
   }
 }
 
+// Add the counters of b to a.
+static void
+ruadd(struct rusage *a, struct rusage *b)
+{
+  uint64 *x = (uint64*)a, *y = (uint64*)b;
+
+  for(int i = 0; i < sizeof(*a) / sizeof(uint64); i++)
+    x[i] += y[i];
+}
+
+// Copy the caller's resource usage, or that of its group's
+// children that have been waited for if who is
+// RUSAGE_CHILDREN, to user address addr as a struct rusage.
+// Returns 0, or -1.
+int
+kgetrusage(int who, uint64 addr)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct rusage ru;
+
+  if(who == RUSAGE_SELF){
+    push_off();
+    ru = p->ru;
+    ru.stime += r_time() - p->tstamp;   // this call so far
+    pop_off();
+    acquire(&g->glock);
+    if(p == g)
+      ruadd(&ru, &g->tru);
+    release(&g->glock);
+  } else if(who == RUSAGE_CHILDREN){
+    acquire(&g->glock);
+    ru = g->cru;
+    release(&g->glock);
+  } else {
+    return -1;
+  }
+  return copyout(p->pagetable, addr, (char*)&ru, sizeof(ru));
+}
+
+// Add p to the tail of its level of run queue rq.
+// Caller must hold rq->lock.
+static void
+rqappend(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+}
+
+// Make p RUNNABLE and add it to the tail of its level of its
+// CPU's run queue. Caller must hold p->lock.
+// While p is queued, p->prio may only be changed with the
+// queue's lock held.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+
+  if((p->affinity & (1L << p->cpu)) == 0){
+    // the first started CPU it may use; ksetaffinity()
+    // makes sure there is one.
+    for(p->cpu = 0; (p->affinity & cpustarted & (1L << p->cpu)) == 0; p->cpu++)
+      ;
+  }
+  rq = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  rqappend(rq, p);
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Charge the running process p for the time since it last
+// started running, and its kernel time, moving it down a level
+// if it has used up its time slice there. Called before p gives up the CPU,
+// with p->lock held.
+static void
+account(struct proc *p)
+{
+  uint64 now = r_time();
+
+  p->ru.stime += now - p->tstamp;
+  p->runtime += now - p->runstart;
+  if(p->runtime >= TIMESLICE){
+    p->runtime = 0;
+    if(p->prio < NPRIO-1)
+      p->prio++;
+  }
+  if(p->prio < p->maxprio)
+    p->prio = p->maxprio;
+}
+
+// Move every process of run queue rq up to its best level.
+// Caller must hold rq->lock.
+static void
+boost(struct runq *rq)
+{
+  struct proc *p, *next;
+
+  for(int i = 1; i < NPRIO; i++){
+    p = rq->head[i];
+    rq->head[i] = rq->tail[i] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      p->prio = p->maxprio;
+      p->runtime = 0;
+      rqappend(rq, p);
+    }
+  }
+  rq->boosted = ticks;
+}
+
+// Take the first process that may run on CPU id from the
+// highest level of run queue rq that has one, or return 0.
+// Caller must hold rq->lock.
+static struct proc*
+rqtake(struct runq *rq, int id)
+{
+  struct proc *p, *prev;
+
+  for(int l = 0; l < NPRIO; l++){
+    prev = 0;
+    for(p = rq->head[l]; p; prev = p, p = p->rqnext){
+      if((p->affinity & (1L << id)) == 0)
+        continue;
+      if(prev)
+        prev->rqnext = p->rqnext;
+      else
+        rq->head[l] = p->rqnext;
+      if(rq->tail[l] == p)
+        rq->tail[l] = prev;
+      rq->n--;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Take the next process for CPU id to run from its own run
+// queue or, if there is none, from another CPU's.
+// Returns 0 if none is runnable.
+static struct proc*
+dequeue(int id)
+{
+  struct runq *rq;
+  struct proc *p = 0;
+
+  for(int i = 0; i < NCPU && p == 0; i++){
+    rq = &runq[(id + i) % NCPU];
+    // peek without the lock, so that idle CPUs don't
+    // bounce the locks of empty queues between them.
+    if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+      continue;
+    acquire(&rq->lock);
+    if(ticks - rq->boosted >= BOOSTTICKS)
+      boost(rq);
+    p = rqtake(rq, id);
+    release(&rq->lock);
+  }
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -425,6 +1192,7 @@ scheduler(void)
   struct cpu *c = mycpu();
 
   c->proc = 0;
+  __sync_fetch_and_or(&cpustarted, 1L << cpuid());
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
@@ -434,28 +1202,38 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+    if((p = dequeue(cpuid())) == 0){
+      // nothing to run; stop running on this core until an
+      // interrupt, with no timer interrupt until a pause() is due.
+      timerset(0);
       asm volatile("wfi");
+      continue;
+    }
+
+    // p is off the queues, and until we run it nothing but
+    // us changes its state. But the CPU that made it RUNNABLE
+    // may still be on its way into its own scheduler, holding
+    // p->lock; acquire() waits until it has switched away.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = cpuid();
+      p->runstart = p->tstamp = r_time();
+      c->proc = p;
+      timerset(1);
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      // Its page table might be freed from now on, so it
+      // mustn't stay in the user window.
+      c->proc = 0;
+      c->uwin = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -492,7 +1270,9 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  account(p);
+  p->ru.nivcsw++;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -529,7 +1309,7 @@ forkret(void)
 
   // return to user space, mimicing usertrap()'s return.
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = usersatp(p);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
@@ -540,20 +1320,27 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the queue),
   // so it's okay to release lk.
 
+  acquire(&sq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
+  account(p);
+  p->ru.nvcsw++;
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -570,19 +1357,132 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+// Wake up at most n of the processes sleeping on channel
+// chan, or all of them if n < 0. Returns how many woke up.
+// Caller should hold the condition lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
+  struct proc *p, **pp;
+  int woken = 0;
+
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0 && woken != n; ){
+    acquire(&p->lock);
+    if(p->chan == chan) {
+      *pp = p->sqnext;
+      setrunnable(p);
+      woken++;
+    } else {
+      pp = &p->sqnext;
+    }
+    release(&p->lock);
+  }
+  release(&sq->lock);
+  return woken;
+}
+
+// Return the physical address of the user word at va, if its
+// page is mapped writable and not copy-on-write, so that every
+// thread and process that can store to the word sees the same
+// one; or 0.
+static uint64
+futexpa(uint64 va)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  pte_t *pte;
+  uint64 pa;
+
+  if((pa = walkaddr(pagetable, va)) == 0)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if((*pte & PTE_W) == 0 || (*pte & PTE_COW))
+    return 0;
+  return pa + (va % PGSIZE);
+}
+
+// Sleep until futex_wake() on the int at user address va, if
+// it still holds val. The futex is known by the word's physical
+// address, which is the sleep channel: no kernel object lives
+// in a user page. Returns 0 when woken up, or -1 at once if the
+// word doesn't hold val or va isn't a writable word.
+int
+kfutexwait(uint64 va, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if(va % sizeof(int) != 0 || va >= MAXVA)
+    return -1;
+  for(;;){
+    if((pa = futexpa(va)) == 0){
+      // fault it in, or break copy-on-write sharing.
+      if(uvmfault(va, 0) == 0)
+        return -1;
+      continue;
+    }
+    lk = &futexlock[FUTEXHASH(pa)];
+    acquire(lk);
+    // the page may have changed while interrupts were on.
+    if(futexpa(va) != pa){
+      release(lk);
+      continue;
+    }
+    if(*(int*)pa != val){
+      release(lk);
+      return -1;
     }
+    sleep((void*)pa, lk);
+    release(lk);
+    return 0;
   }
 }
 
+// Wake up at most n processes sleeping in futex_wait() on the
+// int at user address va. Returns how many woke up.
+int
+kfutexwake(uint64 va, int n)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int woken;
+
+  if(va % sizeof(int) != 0 || va >= MAXVA || n <= 0)
+    return 0;
+  // a waiter found the page writable, so no one waits on the
+  // word if it isn't now.
+  if((pa = futexpa(va)) == 0)
+    return 0;
+  lk = &futexlock[FUTEXHASH(pa)];
+  acquire(lk);
+  woken = wakeupn((void*)pa, n);
+  release(lk);
+  return woken;
+}
+
+// Wake p if it is still sleeping on chan.
+static void
+unsleep(struct proc *p, void *chan)
+{
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
+  struct proc **pp;
+
+  acquire(&sq->lock);
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+      ;
+    *pp = p->sqnext;
+    setrunnable(p);
+  }
+  release(&p->lock);
+  release(&sq->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -591,15 +1491,71 @@ kkill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+      void *chan = p->state == SLEEPING ? p->chan : 0;
+      release(&p->lock);
+      // Wake process from sleep(). Its wait queue's lock
+      // comes before p->lock, so look again with it held.
+      if(chan)
+        unsleep(p, chan);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Set the best scheduling level that the process with the
+// given pid may have, from 0 (the highest) to NPRIO-1.
+// A queued process moves to it when it next runs.
+// Returns the process's previous setting, or -1.
+int
+ksetpriority(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = allproc; p; p = p->allnext){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->maxprio;
+      p->maxprio = prio;
+      if(p->state != RUNNABLE){
+        p->prio = prio;
+        p->runtime = 0;
       }
       release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Restrict the process with the given pid to the CPUs in
+// mask, one bit for each. If it is queued or running on
+// another CPU, it moves when it next becomes runnable.
+// CPUs that haven't started are dropped from the mask, as
+// irqroute() refuses them, so that p can always run.
+// Returns 0, or -1 if there is no such process or the mask
+// has no started CPU.
+int
+ksetaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+
+  if((mask &= cpustarted) == 0)
+    return -1;
+  for(p = allproc; p; p = p->allnext){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->affinity = mask;
+      release(&p->lock);
       return 0;
     }
     release(&p->lock);
@@ -674,14 +1630,20 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s prio %d cpu %d", p->pid, state, p->name, p->prio, p->cpu);
+    if(p->affinity != ALLCPUS)
+      printf(" affinity 0x%lx", p->affinity);
+    printf(" ms %lu/%lu csw %lu/%lu flt %lu io %lu/%lu sys %lu",
+           p->ru.utime / (TIMESLICE / 100), p->ru.stime / (TIMESLICE / 100),
+           p->ru.nvcsw, p->ru.nivcsw, p->ru.nfault,
+           p->ru.inblock, p->ru.oublock, p->ru.nsyscall);
     printf("\n");
   }
 }
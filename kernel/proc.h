@@ -24,6 +24,10 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation of this hart's TLB entries
+  pagetable_t kpagetable;     // this hart's copy of the kernel page table
+  pagetable_t uwin;           // user page table shown at UWIN, or 0
+  uint64 sliceend;            // time CSR when the running process's time slice ends
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +83,22 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's user memory whose pages are
+// filled in on first touch by vmfault(): a program segment
+// set up by exec, read from the program file, or a region
+// created by mmap(), read from a file or zero-filled.
+// Bytes at or past filesz within the region are zero.
+// unused if ip == 0 and end == 0.
+struct vma {
+  uint64 start;          // first virtual address, page-aligned
+  uint64 end;            // one past the last virtual address
+  int perm;              // PTE_R, PTE_W, PTE_X for its pages
+  int flags;             // MAP_ flags for an mmap region, 0 for exec's
+  struct inode *ip;      // file holding the data, or 0 if anonymous
+  uint off;              // file offset of start
+  uint filesz;           // bytes of file data in the region
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -92,16 +112,65 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // wait_lock must be held when using this:
+  // the parent's childlock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *sibling;        // Next child of parent
+
+  // childlock must be held when using this. A process's
+  // childlock comes before init's, and before any p->lock.
+  struct spinlock childlock;
+  struct proc *child;          // First child
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  struct vdso *vdso;           // page mapped read-only at VDSO
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files: ofile0, or a page of NOFILEMAX
+  int nofile;                  // Entries in ofile
+  struct file *ofile0[NOFILE]; // The first NOFILE open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Program segments and mmap regions
+  uint64 faultnext;            // Page after the last fault, to spot sequential access
+  int asid;                    // Address space identifier for pagetable
+  uint64 asidgen;              // Generation asid belongs to; 0 if none yet
+  uint64 tlbstale;             // Harts that must flush asid before running us
+  int cpu;                     // CPU p last ran on, whose run queue it joins
+  uint64 affinity;             // CPUs p may run on, a bit for each
+  int prio;                    // Level, 0 (highest) to NPRIO-1; see setrunnable()
+  int maxprio;                 // Best level p may have, set by setpriority()
+  uint64 runstart;             // time CSR when p last started running
+  uint64 runtime;              // Time p has run for at its level
+  struct proc *rqnext;         // Next on run queue; runq lock must be held
+  struct proc *sqnext;         // Next on sleep queue; its lock must be held
+  struct proc *allnext;        // Next on allproc; never changes once set
+  struct proc *freenext;       // Next on free list; proc_lock must be held
+  int logres;                  // Log blocks its FS op reserved and hasn't used
+  int nsleeplocks;             // Sleep-locks held, so as not to fault with one
+  struct file *fheld[4];       // References argfd() took for this system call
+  int nfheld;
+  uint64 tracemask;            // System calls to print, a bit for each number
+  uint64 ncall[NSYSCALL];      // Calls p has made, by number
+  uint64 systime[NSYSCALL];    // Time those calls took
+  struct rusage ru;            // Resources p has used; see getrusage()
+  uint64 tstamp;               // time CSR when p last entered or left user space, or started running
   char name[16];               // Process name (debugging)
+
+  // clone() makes threads that share the group leader's memory,
+  // files and current directory: group->sz, group->vma,
+  // group->ofile and group->cwd are the ones to use, and the
+  // group's ASID is group->asid. p->pagetable is the group's.
+  // the leader's glock must be held to set group.
+  struct proc *group;          // Leader of p's thread group; p itself if not a thread
+  uint64 trapva;               // User address of p->trapframe
+  // these are used only in the leader.
+  int nthread;                 // Threads in the group, the leader included
+  struct spinlock glock;       // Protects nthread, ofile, nofile, cwd and vmholder
+  struct proc *vmholder;       // Thread holding the group's vm lock; see vmlock()
+  int vmdead;                  // Exiting, so kpageout() must leave the memory alone; vm lock protects it
+  uint64 pageoutva;            // Where uvmpageout() next looks; vm lock protects it
+  struct rusage tru;           // Resources of exited threads; glock protects it
+  struct rusage cru;           // Resources of children waited for; glock protects it
 };
@@ -0,0 +1,106 @@
+//
+// Sampling profiler. While it's on, clockintr() records where
+// the timer interrupted each running process, profinterval
+// cycles apart, in a ring per CPU, and profread() drains the
+// rings into user space. Harts with nothing to run aren't
+// sampled. When a ring is full, new samples are dropped and
+// counted as lost.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+#include "prof.h"
+#include "defs.h"
+
+struct profring {
+  struct spinlock lock;
+  struct profsample s[NPROFRING];
+  uint r;              // next to read
+  uint w;              // next to write
+  uint lost;           // samples dropped since the last profile()
+};
+
+struct profring prof[NCPU];
+
+uint64 profinterval;   // cycles between samples, or 0 if off
+
+void
+profinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&prof[i].lock, "prof");
+}
+
+// Record where the timer interrupted this CPU's process.
+// Called by clockintr() with interrupts off, so sepc and
+// sstatus are still those of the interrupt.
+void
+profsample(void)
+{
+  struct proc *p = myproc();
+  struct profring *r = &prof[cpuid()];
+  struct profsample *s;
+
+  acquire(&r->lock);
+  if(r->w - r->r < NPROFRING){
+    s = &r->s[r->w++ % NPROFRING];
+    s->pc = r_sepc();
+    s->user = (r_sstatus() & SSTATUS_SPP) == 0;
+    s->pid = p->pid;
+    safestrcpy(s->name, p->name, sizeof(s->name));
+  } else {
+    r->lost++;
+  }
+  release(&r->lock);
+}
+
+// Take rate samples per tick from now on, or none if rate
+// is 0. Returns the number of samples lost since the last
+// call, or -1 if rate is out of range.
+int
+profile(int rate)
+{
+  int lost = 0;
+
+  if(rate < 0 || rate > PROFRATEMAX)
+    return -1;
+  profinterval = rate ? TIMESLICE / rate : 0;
+  for(int i = 0; i < NCPU; i++){
+    acquire(&prof[i].lock);
+    lost += prof[i].lost;
+    prof[i].lost = 0;
+    release(&prof[i].lock);
+  }
+  return lost;
+}
+
+// Move up to n samples from the rings to user address addr.
+// Returns the number moved, or -1.
+int
+profread(uint64 addr, int n)
+{
+  struct profsample buf[8];
+  struct profring *r;
+  int i, m, got = 0;
+
+  for(i = 0; i < NCPU && got < n; i++){
+    r = &prof[i];
+    do {
+      // copyout() may sleep, so not with the lock held.
+      acquire(&r->lock);
+      for(m = 0; m < NELEM(buf) && got + m < n && r->r != r->w; m++)
+        buf[m] = r->s[r->r++ % NPROFRING];
+      release(&r->lock);
+      if(m > 0 && copyout(myproc()->pagetable, addr + got*sizeof(buf[0]),
+                          (char*)buf, m*sizeof(buf[0])) < 0)
+        return -1;
+      got += m;
+    } while(m == NELEM(buf));
+  }
+  return got;
+}
@@ -0,0 +1,9 @@
+// A sample of the timer-driven profiler, returned by profread().
+struct profsample {
+  uint64 pc;         // sepc when the timer interrupted
+  int pid;           // the process that was running
+  int user;          // 1 if pc is in user space, 0 if in the kernel
+  char name[16];     // its name, for finding its symbols
+};
+
+#define PROFRATEMAX 1000  // most samples per tick profile() takes
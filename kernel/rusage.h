@@ -0,0 +1,15 @@
+// Resources a process has used, returned by getrusage().
+struct rusage {
+  uint64 utime;      // timer cycles running in user space
+  uint64 stime;      // timer cycles running in the kernel
+  uint64 nvcsw;      // times it gave up the CPU to wait
+  uint64 nivcsw;     // times it was switched away while runnable
+  uint64 nfault;     // page faults handled
+  uint64 inblock;    // disk blocks read
+  uint64 oublock;    // disk blocks written
+  uint64 nsyscall;   // system calls made
+};
+
+// getrusage()'s who
+#define RUSAGE_SELF      0  // the caller, and its exited threads
+#define RUSAGE_CHILDREN  1  // its children that it has waited for, and theirs
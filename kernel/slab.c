@@ -0,0 +1,111 @@
+//
+// Object caches: allocators of fixed-size kernel objects, such
+// as pipes, open files and in-memory inodes, packed many to a
+// page. Each CPU keeps a magazine of free objects of each
+// cache, so that most allocations and frees touch only that,
+// with interrupts off. The cache's own free list, under its
+// lock, refills and drains the magazines half a magazine at a
+// time, and grows a page at a time.
+//
+// Each object is followed by a word that links it on the free
+// list, so that a free object keeps the state that the cache's
+// constructor gave it. Pages come from ktryalloc(), since
+// objects may be allocated with locks held that reclaiming
+// buffers would need, and are never given back.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+
+#define LINK(kc, o) (*(void**)((char*)(o) + (kc)->size - sizeof(void*)))
+
+// Set up kc for objects of size bytes, at most max of them
+// (0 for no limit), each set up by ctor, if not 0, when its
+// page is allocated.
+void
+kcinit(struct kcache *kc, char *name, uint size, int max, void (*ctor)(void*))
+{
+  initlock(&kc->lock, name);
+  kc->name = name;
+  kc->size = (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*) + sizeof(void*);
+  if(kc->size > PGSIZE)
+    panic("kcinit");
+  kc->max = max;
+  kc->ctor = ctor;
+}
+
+// Add a page of new objects to kc's free list, if there's
+// memory to spare and kc isn't full.
+// Caller must hold kc->lock.
+static void
+kcgrow(struct kcache *kc)
+{
+  char *pa, *o;
+  int n = PGSIZE / kc->size;
+
+  if(kc->max && kc->nobj + n > kc->max)
+    n = kc->max - kc->nobj;
+  if(n <= 0 || (pa = ktryalloc()) == 0)
+    return;
+  memset(pa, 0, PGSIZE);
+  for(o = pa; o < pa + n*kc->size; o += kc->size){
+    if(kc->ctor)
+      kc->ctor(o);
+    LINK(kc, o) = kc->free;
+    kc->free = o;
+  }
+  kc->nobj += n;
+}
+
+// Allocate an object of kc, in the state its constructor
+// or its last user left it.
+// Returns 0 if out of memory or kc is full.
+void*
+kcalloc(struct kcache *kc)
+{
+  void *o = 0;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(kc->mag[id].n == 0){
+    acquire(&kc->lock);
+    if(kc->free == 0)
+      kcgrow(kc);
+    while(kc->free && kc->mag[id].n < KCMAG/2){
+      kc->mag[id].obj[kc->mag[id].n++] = kc->free;
+      kc->free = LINK(kc, kc->free);
+    }
+    release(&kc->lock);
+  }
+  if(kc->mag[id].n > 0)
+    o = kc->mag[id].obj[--kc->mag[id].n];
+  pop_off();
+  return o;
+}
+
+// Give object o back to kc.
+void
+kcfree(struct kcache *kc, void *o)
+{
+  void *m;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(kc->mag[id].n == KCMAG){
+    acquire(&kc->lock);
+    while(kc->mag[id].n > KCMAG/2){
+      m = kc->mag[id].obj[--kc->mag[id].n];
+      LINK(kc, m) = kc->free;
+      kc->free = m;
+    }
+    release(&kc->lock);
+  }
+  kc->mag[id].obj[kc->mag[id].n++] = o;
+  pop_off();
+}
@@ -0,0 +1,16 @@
+// An object cache; see slab.c.
+#define KCMAG 16   // free objects each CPU keeps to itself
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;                 // bytes per object, with its link
+  int max;                   // most objects, or 0 for no limit
+  int nobj;                  // objects in all, free or not
+  void (*ctor)(void*);       // sets up each new object, or 0
+  void *free;                // free objects not in a magazine
+  struct {
+    int n;
+    void *obj[KCMAG];
+  } mag[NCPU];               // each CPU's free objects
+};
@@ -6,6 +6,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "sleeplock.h"
 
@@ -15,6 +16,7 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
   lk->pid = 0;
 }
 
@@ -22,11 +24,12 @@ void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
+  while (lk->locked || lk->readers) {
     sleep(lk, &lk->lk);
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  myproc()->nsleeplocks++;
   release(&lk->lk);
 }
 
@@ -36,6 +39,73 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  myproc()->nsleeplocks--;
+  wakeup(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk shared, alongside any other readers. Readers
+// don't wait for a process waiting to acquire lk exclusively,
+// so one that holds lk shared may acquire it shared again.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->locked) {
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  myproc()->nsleeplocks++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  myproc()->nsleeplocks--;
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk if no one holds it, without sleeping.
+// Returns 1 if it did, 0 if not.
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+  int r = 0;
+
+  acquire(&lk->lk);
+  if(!lk->locked && !lk->readers){
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    myproc()->nsleeplocks++;
+    r = 1;
+  }
+  release(&lk->lk);
+  return r;
+}
+
+// Stop owning held lock lk without releasing it, so that
+// releasedisowned() can release it later, perhaps from an
+// interrupt handler.
+void
+disownsleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->pid = 0;
+  myproc()->nsleeplocks--;
+  release(&lk->lk);
+}
+
+void
+releasedisowned(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->locked = 0;
   wakeup(lk);
   release(&lk->lk);
 }
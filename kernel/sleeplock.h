@@ -1,6 +1,8 @@
-// Long-term locks for processes
+// Long-term locks for processes, held either exclusively
+// or shared by any number of readers.
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int readers;       // Number holding it shared
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
@@ -5,8 +5,44 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+// Contention counters, kept per lock name so that, say, all
+// the "proc" locks add up to one line. Each CPU counts into
+// its own table, without atomic instructions or shared cache
+// lines, and lockstatcopy() adds the tables up. lockname
+// holds the names, and statlock, which isn't counted itself,
+// guards adding to it.
+struct lockcount {
+  uint64 nacquire;
+  uint64 ncontend;
+  uint64 spin;
+};
+
+static struct lockcount lockcount[NCPU][NLOCKSTAT];
+static char lockname[NLOCKSTAT][16];
+static int nlockname;
+static struct spinlock statlock = { .name = "lockstat" };
+
+// Return 1 + the index of name's counters, adding it if it's
+// new, or 0 if there's no room for another name.
+static int
+lockstatid(char *name)
+{
+  int i;
+
+  acquire(&statlock);
+  for(i = 0; i < nlockname; i++)
+    if(strncmp(lockname[i], name, sizeof(lockname[i]) - 1) == 0)
+      break;
+  if(i == nlockname && nlockname < NLOCKSTAT)
+    safestrcpy(lockname[nlockname++], name, sizeof(lockname[i]));
+  release(&statlock);
+  return i < NLOCKSTAT ? i + 1 : 0;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
@@ -14,6 +50,7 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->stat = lockstatid(name);
 }
 
 // Acquire the lock.
@@ -29,8 +66,20 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  struct lockcount *lc = 0;
+  if(lk->stat)
+    lc = &lockcount[cpuid()][lk->stat - 1];
+  if(__sync_lock_test_and_set(&lk->locked, 1) != 0){
+    uint64 t0 = r_time();
+    while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+      ;
+    if(lc){
+      lc->ncontend++;
+      lc->spin += r_time() - t0;
+    }
+  }
+  if(lc)
+    lc->nacquire++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -111,3 +160,52 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Copy the counters of up to n lock names to user address
+// addr as struct lockstats, most contended first.
+// Returns the number copied, or -1.
+int
+lockstatcopy(uint64 addr, int n)
+{
+  struct lockstat ls;
+  char done[NLOCKSTAT];
+  int i, j, best, nname;
+
+  acquire(&statlock);
+  nname = nlockname;
+  release(&statlock);
+
+  memset(done, 0, sizeof(done));
+  for(i = 0; i < n && i < nname; i++){
+    best = -1;
+    for(j = 0; j < nname; j++){
+      uint64 c = 0;
+      if(done[j])
+        continue;
+      for(int k = 0; k < NCPU; k++)
+        c += lockcount[k][j].ncontend;
+      if(best < 0 || c > ls.ncontend){
+        best = j;
+        ls.ncontend = c;
+      }
+    }
+    done[best] = 1;
+    safestrcpy(ls.name, lockname[best], sizeof(ls.name));
+    ls.nacquire = ls.spin = 0;
+    for(int k = 0; k < NCPU; k++){
+      ls.nacquire += lockcount[k][best].nacquire;
+      ls.spin += lockcount[k][best].spin;
+    }
+    if(copyout(myproc()->pagetable, addr + i*sizeof(ls), (char*)&ls, sizeof(ls)) < 0)
+      return -1;
+  }
+  return i;
+}
+
+// Zero all the counters. Acquisitions racing with this
+// may survive it.
+void
+lockstatreset(void)
+{
+  memset(lockcount, 0, sizeof(lockcount));
+}
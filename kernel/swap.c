@@ -0,0 +1,121 @@
+//
+// Swap space: slots of a page each on the swap disk, SWAPDEV,
+// that pages of user memory are paged out to when kalloc()
+// runs out; see uvmpageout() and kpageout().
+//
+// A paged-out page's PTE holds its slot; see PTE_SWAP. Each
+// slot has a reference count, since fork() shares paged-out
+// pages copy-on-write as it does pages in memory: each page
+// table whose PTE holds the slot has a reference, and the slot
+// is free again when the last goes away. Slots are handed out
+// round robin, so that a batch of pages paged out together
+// mostly lands in consecutive blocks.
+//
+// There's no swap space if the machine has no second disk.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)  // disk blocks per slot
+
+struct {
+  struct spinlock lock;
+  int nslot;             // slots on the disk, up to NSWAP; 0 if no swap
+  int nfree;
+  ushort ref[NSWAP];     // references to each slot; 0 if free
+  int hand;              // where the search for a free slot starts
+} swap;
+
+void
+swapinit(void)
+{
+  uint64 n;
+
+  initlock(&swap.lock, "swap");
+  n = virtio_disk_size(SWAPDEV) / SLOTBLOCKS;
+  if(n > NSWAP)
+    n = NSWAP;
+  swap.nslot = swap.nfree = n;
+  if(n > 0)
+    printf("swap: %d pages on disk %d\n", swap.nslot, SWAPDEV);
+}
+
+// The number of free slots.
+int
+swapavail(void)
+{
+  return swap.nfree;
+}
+
+// Allocate a swap slot, with one reference.
+// Returns the slot, or -1 if there's none free.
+int
+swapalloc(void)
+{
+  int slot = -1;
+
+  acquire(&swap.lock);
+  if(swap.nfree > 0){
+    while(swap.ref[swap.hand] != 0)
+      swap.hand = (swap.hand + 1) % swap.nslot;
+    slot = swap.hand;
+    swap.ref[slot] = 1;
+    swap.nfree--;
+    swap.hand = (swap.hand + 1) % swap.nslot;
+  }
+  release(&swap.lock);
+  return slot;
+}
+
+// Add a reference to an allocated slot, e.g. when fork
+// shares a paged-out page between two page tables.
+void
+swapdup(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to a slot, freeing it if it was the last.
+void
+swapput(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapput");
+  if(--swap.ref[slot] == 0)
+    swap.nfree++;
+  release(&swap.lock);
+}
+
+// Write the page at physical address pa to slot, or read
+// it from slot if write is 0. Uses stand-in bufs, as the log
+// does, so that the page's data doesn't go through the buffer
+// cache. Sleeps until the transfer is done.
+void
+swaprw(int slot, uint64 pa, int write)
+{
+  struct buf b[SLOTBLOCKS], *bp[SLOTBLOCKS];
+
+  memset(b, 0, sizeof(b));
+  for(int i = 0; i < SLOTBLOCKS; i++){
+    b[i].dev = SWAPDEV;
+    b[i].blockno = slot * SLOTBLOCKS + i;
+    b[i].data = (uchar*)(pa + i * BSIZE);
+    bp[i] = &b[i];
+  }
+  iocount(SLOTBLOCKS, write);
+  virtio_disk_start(bp, SLOTBLOCKS, write);
+  for(int i = 0; i < SLOTBLOCKS; i++)
+    virtio_disk_wait(bp[i]);
+}
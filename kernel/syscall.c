@@ -3,8 +3,10 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "syscall.h"
+#include "sysstat.h"
 #include "defs.h"
 
 // Fetch the uint64 at addr from the current process.
@@ -12,7 +14,8 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  uint64 sz = p->group->sz;
+  if(addr >= sz || addr+sizeof(uint64) > sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -101,6 +104,33 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_setaffinity(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_lseek(void);
+extern uint64 sys_fallocate(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_ringenter(void);
+extern uint64 sys_sysstat(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_profile(void);
+extern uint64 sys_profread(void);
+extern uint64 sys_irqroute(void);
+extern uint64 sys_irqstat(void);
+extern uint64 sys_getrusage(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,19 +156,178 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_vmstat]  sys_vmstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_spawn]   sys_spawn,
+[SYS_setpriority] sys_setpriority,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_lockstat] sys_lockstat,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_lseek]   sys_lseek,
+[SYS_fallocate] sys_fallocate,
+[SYS_splice]  sys_splice,
+[SYS_poll]    sys_poll,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_ringenter] sys_ringenter,
+[SYS_sysstat] sys_sysstat,
+[SYS_trace]  sys_trace,
+[SYS_profile] sys_profile,
+[SYS_profread] sys_profread,
+[SYS_irqroute] sys_irqroute,
+[SYS_irqstat] sys_irqstat,
+[SYS_getrusage] sys_getrusage,
 };
 
+// The names of the system calls, for sysstat() and tracing.
+static char *syscallnames[] = {
+[SYS_fork]   "fork",
+[SYS_exit]   "exit",
+[SYS_wait]   "wait",
+[SYS_pipe]   "pipe",
+[SYS_read]   "read",
+[SYS_kill]   "kill",
+[SYS_exec]   "exec",
+[SYS_fstat]  "fstat",
+[SYS_chdir]  "chdir",
+[SYS_dup]    "dup",
+[SYS_getpid] "getpid",
+[SYS_sbrk]   "sbrk",
+[SYS_pause]  "pause",
+[SYS_uptime] "uptime",
+[SYS_open]   "open",
+[SYS_write]  "write",
+[SYS_mknod]  "mknod",
+[SYS_unlink] "unlink",
+[SYS_link]   "link",
+[SYS_mkdir]  "mkdir",
+[SYS_close]  "close",
+[SYS_vmstat] "vmstat",
+[SYS_mmap]   "mmap",
+[SYS_munmap] "munmap",
+[SYS_spawn]  "spawn",
+[SYS_setpriority] "setpriority",
+[SYS_setaffinity] "setaffinity",
+[SYS_clone]  "clone",
+[SYS_join]   "join",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_lockstat] "lockstat",
+[SYS_pread]  "pread",
+[SYS_pwrite] "pwrite",
+[SYS_lseek]  "lseek",
+[SYS_fallocate] "fallocate",
+[SYS_splice] "splice",
+[SYS_poll]   "poll",
+[SYS_readv]  "readv",
+[SYS_writev] "writev",
+[SYS_ringenter] "ringenter",
+[SYS_sysstat] "sysstat",
+[SYS_trace]  "trace",
+[SYS_profile] "profile",
+[SYS_profread] "profread",
+[SYS_irqroute] "irqroute",
+[SYS_irqstat] "irqstat",
+[SYS_getrusage] "getrusage",
+};
+
+// Call counts and times, for sysstat(). Each CPU counts into
+// its own table, as for lockstat(), and sysstatcopy() adds
+// them up; each process also counts its own calls, in
+// p->ncall[] and p->systime[].
+struct syscount {
+  uint64 ncall;
+  uint64 time;
+  uint64 hist[NSYSHIST];
+};
+
+static struct syscount syscount[NCPU][NSYSCALL];
+
+// Count a call to system call num by p that took dt cycles.
+static void
+syscountadd(struct proc *p, int num, uint64 dt)
+{
+  struct syscount *c;
+  int b;
+
+  if(num >= NSYSCALL)
+    return;
+  for(b = 0; b < NSYSHIST-1 && (dt >> (b+1)) != 0; b++)
+    ;
+  push_off();
+  c = &syscount[cpuid()][num];
+  c->ncall++;
+  c->time += dt;
+  c->hist[b]++;
+  pop_off();
+  p->ncall[num]++;
+  p->systime[num] += dt;
+  p->ru.nsyscall++;
+}
+
+// Copy the counters of every system call number to user
+// address addr as NSYSCALL struct sysstats: all processes'
+// if which is SYSSTAT_ALL, else the caller's. Then zero them
+// if reset is set; calls racing with this may survive it.
+// Returns NSYSCALL, or -1.
+int
+sysstatcopy(uint64 addr, int which, int reset)
+{
+  struct proc *p = myproc();
+  struct sysstat st;
+
+  for(int num = 0; num < NSYSCALL; num++){
+    memset(&st, 0, sizeof(st));
+    if(num < NELEM(syscallnames) && syscallnames[num])
+      safestrcpy(st.name, syscallnames[num], sizeof(st.name));
+    if(which == SYSSTAT_ALL){
+      for(int i = 0; i < NCPU; i++){
+        st.ncall += syscount[i][num].ncall;
+        st.time += syscount[i][num].time;
+        for(int b = 0; b < NSYSHIST; b++)
+          st.hist[b] += syscount[i][num].hist[b];
+      }
+    } else {
+      st.ncall = p->ncall[num];
+      st.time = p->systime[num];
+    }
+    if(copyout(p->pagetable, addr + num*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  if(reset && which == SYSSTAT_ALL){
+    memset(syscount, 0, sizeof(syscount));
+  } else if(reset){
+    memset(p->ncall, 0, sizeof(p->ncall));
+    memset(p->systime, 0, sizeof(p->systime));
+  }
+  return NSYSCALL;
+}
+
 void
 syscall(void)
 {
   int num;
   struct proc *p = myproc();
+  uint64 t0;
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
+    t0 = r_time();
     p->trapframe->a0 = syscalls[num]();
+    // drop the file references argfd() took.
+    while(p->nfheld > 0)
+      fileclose(p->fheld[--p->nfheld]);
+    syscountadd(p, num, r_time() - t0);
+    if(num < NSYSCALL && (p->tracemask & (1L << num)))
+      printf("%d: %s -> %ld\n", p->pid, syscallnames[num], (long)p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
@@ -20,3 +20,30 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_vmstat 22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_spawn  25
+#define SYS_setpriority 26
+#define SYS_setaffinity 27
+#define SYS_clone  28
+#define SYS_join   29
+#define SYS_futex_wait 30
+#define SYS_futex_wake 31
+#define SYS_lockstat 32
+#define SYS_pread  33
+#define SYS_pwrite 34
+#define SYS_lseek  35
+#define SYS_fallocate 36
+#define SYS_splice 37
+#define SYS_poll   38
+#define SYS_readv  39
+#define SYS_writev 40
+#define SYS_ringenter 41
+#define SYS_sysstat 42
+#define SYS_trace  43
+#define SYS_profile 44
+#define SYS_profread 45
+#define SYS_irqroute 46
+#define SYS_irqstat  47
+#define SYS_getrusage 48
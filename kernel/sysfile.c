@@ -10,23 +10,45 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "poll.h"
+#include "uio.h"
+#include "uring.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// If the process has other threads, one of them might close the
+// descriptor meanwhile, so the file gets a reference of its own
+// that syscall() drops when the system call is done.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0)
+    return -1;
+  acquire(&g->glock);
+  if(fd >= g->nofile || (f=g->ofile[fd]) == 0){
+    release(&g->glock);
     return -1;
+  }
+  if(g->nthread > 1){
+    if(p->nfheld == NELEM(p->fheld)){
+      release(&g->glock);
+      return -1;
+    }
+    p->fheld[p->nfheld++] = filedup(f);
+  }
+  release(&g->glock);
   if(pfd)
     *pfd = fd;
   if(pf)
@@ -40,17 +62,31 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *g = myproc()->group;
 
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+  acquire(&g->glock);
+  for(fd = 0; fd < g->nofile || fdgrow(g) == 0; fd++){
+    if(g->ofile[fd] == 0){
+      g->ofile[fd] = f;
+      release(&g->glock);
       return fd;
     }
   }
+  release(&g->glock);
   return -1;
 }
 
+// Clear file descriptor fd, whose file the caller then closes.
+static void
+fdclear(int fd)
+{
+  struct proc *g = myproc()->group;
+
+  acquire(&g->glock);
+  g->ofile[fd] = 0;
+  release(&g->glock);
+}
+
 uint64
 sys_dup(void)
 {
@@ -94,6 +130,123 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the array of buffers for readv() or writev(): its
+// address is argument n, its length argument n+1. The buffers
+// must add up to what an int can count.
+// Returns the number of buffers, or -1.
+static int
+argiov(int n, struct iovec *iov)
+{
+  uint64 addr;
+  int niov;
+  long tot = 0;
+
+  argaddr(n, &addr);
+  argint(n+1, &niov);
+  if(niov < 0 || niov > IOV_MAX)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, addr, niov * sizeof(iov[0])) < 0)
+    return -1;
+  for(int i = 0; i < niov; i++){
+    if(iov[i].iov_len < 0)
+      return -1;
+    tot += iov[i].iov_len;
+  }
+  return tot > 0x7fffffff ? -1 : niov;
+}
+
+uint64
+sys_readv(void)
+{
+  struct iovec iov[IOV_MAX];
+  struct file *f;
+  int niov;
+
+  if((niov = argiov(1, iov)) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  return filereadv(f, iov, niov);
+}
+
+uint64
+sys_writev(void)
+{
+  struct iovec iov[IOV_MAX];
+  struct file *f;
+  int niov;
+
+  if((niov = argiov(1, iov)) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  return filewritev(f, iov, niov);
+}
+
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+uint64
+sys_lseek(void)
+{
+  struct file *f;
+  int off, whence;
+
+  argint(1, &off);
+  argint(2, &whence);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return fileseek(f, off, whence);
+}
+
+uint64
+sys_fallocate(void)
+{
+  struct file *f;
+  int off, len;
+
+  argint(1, &off);
+  argint(2, &len);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return fileallocate(f, off, len);
+}
+
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
 uint64
 sys_close(void)
 {
@@ -102,7 +255,7 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  fdclear(fd);
   fileclose(f);
   return 0;
 }
@@ -189,7 +342,6 @@ uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -219,9 +371,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  direrase(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -230,6 +380,8 @@ sys_unlink(void)
 
   ip->nlink--;
   iupdate(ip);
+  if(ip->nlink == 0)
+    iorphan(ip);
   iunlockput(ip);
 
   end_op();
@@ -301,20 +453,20 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with mode omode, for open() and ringenter().
+// Returns the new file descriptor, or -1.
+static int
+kopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
-  begin_op();
+  // without O_CREATE, at most O_TRUNC frees blocks.
+  if(omode & O_CREATE)
+    begin_op();
+  else
+    begin_opn(IPUTBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -370,6 +522,18 @@ sys_open(void)
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  return kopen(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -410,10 +574,10 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct proc *g = myproc()->group;
   
-  begin_op();
+  begin_opn(IPUTBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -425,26 +589,27 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&g->glock);
+  old = g->cwd;
+  g->cwd = ip;
+  release(&g->glock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Fetch the null-terminated array of user strings at uargv
+// into argv, allocating a page for each string.
+// Returns 0, or -1 with nothing left allocated.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -460,6 +625,27 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
+
+ bad:
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+  return -1;
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int i;
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
   int ret = kexec(path, argv);
 
@@ -467,11 +653,32 @@ sys_exec(void)
     kfree(argv[i]);
 
   return ret;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int i, nfd, fd[NOFILE];
+  uint64 uargv, ufd;
+
+  argaddr(1, &uargv);
+  argaddr(2, &ufd);
+  argint(3, &nfd);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(ufd && (nfd < 0 || nfd > NOFILE ||
+             copyin(myproc()->pagetable, (char*)fd, ufd, nfd*sizeof(int)) < 0))
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = kspawn(path, argv, ufd ? fd : 0, nfd);
 
- bad:
   for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
     kfree(argv[i]);
-  return -1;
+
+  return ret;
 }
 
 uint64
@@ -488,18 +695,196 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdclear(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdclear(fd0);
+    fdclear(fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// poll(fds, nfds, timeout): wait for events on any of nfds
+// descriptors, for at most timeout ticks, or forever if timeout
+// is negative.
+uint64
+sys_poll(void)
+{
+  struct pollfd fds0[NOFILE], *fds = fds0;
+  struct file *f0[NOFILE], **f = f0;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  uint64 addr;
+  int nfds, timeout, n = -1;
+
+  argaddr(0, &addr);
+  argint(1, &nfds);
+  argint(2, &timeout);
+  if(nfds < 0 || nfds > NOFILEMAX)
+    return -1;
+  if(nfds > NOFILE){
+    // too many for the stack: a page for each array.
+    fds = kalloc();
+    f = kalloc();
+    if(fds == 0 || f == 0)
+      goto out;
+  }
+  if(copyin(p->pagetable, (char*)fds, addr, nfds * sizeof(fds[0])) < 0)
+    goto out;
+
+  // hold references, in case another thread closes the files.
+  acquire(&g->glock);
+  for(int i = 0; i < nfds; i++){
+    f[i] = 0;
+    if(fds[i].fd >= 0 && fds[i].fd < g->nofile && g->ofile[fds[i].fd])
+      f[i] = filedup(g->ofile[fds[i].fd]);
+  }
+  release(&g->glock);
+
+  n = kpoll(fds, f, nfds, timeout);
+
+  for(int i = 0; i < nfds; i++)
+    if(f[i])
+      fileclose(f[i]);
+  if(n >= 0 && copyout(p->pagetable, addr, (char*)fds, nfds * sizeof(fds[0])) < 0)
+    n = -1;
+
+ out:
+  if(fds && fds != fds0)
+    kfree(fds);
+  if(f && f != f0)
+    kfree(f);
+  return n;
+}
+
+// Return a reference of the caller's own to the file open as
+// descriptor fd, or 0.
+static struct file*
+fdget(int fd)
+{
+  struct proc *g = myproc()->group;
+  struct file *f = 0;
+
+  acquire(&g->glock);
+  if(fd >= 0 && fd < g->nofile && g->ofile[fd])
+    f = filedup(g->ofile[fd]);
+  release(&g->glock);
+  return f;
+}
+
+// Carry out one entry of a submission ring.
+// Returns what the system call would have.
+static int
+uringop(struct sqe *e)
+{
+  char path[MAXPATH];
+  struct file *f;
+  struct proc *g = myproc()->group;
+  int r;
+
+  switch(e->op){
+  case URING_READ:
+  case URING_WRITE:
+    if((f = fdget(e->fd)) == 0)
+      return -1;
+    if(e->op == URING_READ)
+      r = fileread(f, e->addr, e->n);
+    else
+      r = filewrite(f, e->addr, e->n);
+    fileclose(f);
+    return r;
+  case URING_OPEN:
+    if(fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    return kopen(path, e->n);
+  case URING_CLOSE:
+    f = 0;
+    acquire(&g->glock);
+    if(e->fd >= 0 && e->fd < g->nofile){
+      f = g->ofile[e->fd];
+      g->ofile[e->fd] = 0;
+    }
+    release(&g->glock);
+    if(f == 0)
+      return -1;
+    fileclose(f);
+    return 0;
+  }
+  return -1;
+}
+
+// ringenter(r): carry out the entries queued in the submission
+// ring of r, a struct uring, in order, posting a completion for
+// each, until there are no more or no room for completions.
+// Returns the number carried out, or -1 if r is bad.
+uint64
+sys_ringenter(void)
+{
+  struct proc *p = myproc();
+  struct uring *r;
+  uint64 addr;
+  uint hdr[4];  // sqhead, sqtail, cqhead, cqtail
+  struct sqe e;
+  struct cqe c;
+  int n = 0;
+
+  argaddr(0, &addr);
+  r = (struct uring *)addr;  // for its fields' user addresses
+  if(copyin(p->pagetable, (char*)hdr, addr, sizeof(hdr)) < 0)
+    return -1;
+  if(hdr[1] - hdr[0] > URING_SIZE || hdr[3] - hdr[2] > URING_SIZE)
+    return -1;
+
+  while(hdr[0] != hdr[1] && hdr[3] - hdr[2] < URING_SIZE && !killed(p)){
+    if(copyin(p->pagetable, (char*)&e, (uint64)&r->sq[hdr[0] % URING_SIZE], sizeof(e)) < 0)
+      break;
+    c.data = e.data;
+    c.res = uringop(&e);
+    if(copyout(p->pagetable, (uint64)&r->cq[hdr[3] % URING_SIZE], (char*)&c, sizeof(c)) < 0)
+      break;
+    hdr[0]++;
+    hdr[3]++;
+    n++;
+  }
+
+  // only the kernel's own indexes: the user may be adding more.
+  if(copyout(p->pagetable, (uint64)&r->sqhead, (char*)&hdr[0], sizeof(hdr[0])) < 0 ||
+     copyout(p->pagetable, (uint64)&r->cqtail, (char*)&hdr[3], sizeof(hdr[3])) < 0)
+    return -1;
+  return n;
+}
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f = 0;
+
+  argaddr(0, &addr);  // a hint, which is ignored
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return kmmap(f, len, prot, flags, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  return kmunmap(addr, len);
+}
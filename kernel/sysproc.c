@@ -4,8 +4,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "vm.h"
+#include "sysstat.h"
 
 uint64
 sys_exit(void)
@@ -36,16 +38,29 @@ sys_wait(void)
   return kwait(p);
 }
 
+uint64
+sys_getrusage(void)
+{
+  int who;
+  uint64 addr;
+
+  argint(0, &who);
+  argaddr(1, &addr);
+  return kgetrusage(who, addr);
+}
+
 uint64
 sys_sbrk(void)
 {
   uint64 addr;
   int t;
   int n;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
 
   argint(0, &n);
   argint(1, &t);
-  addr = myproc()->sz;
+  addr = g->sz;
 
   if(t == SBRK_EAGER || n < 0) {
     if(growproc(n) < 0) {
@@ -55,9 +70,14 @@ sys_sbrk(void)
     // Lazily allocate memory for this process: increase its memory
     // size but don't allocate memory. If the processes uses the
     // memory, vmfault() will allocate it.
-    if(addr + n < addr)
+    vmlock(p);
+    addr = g->sz;
+    if(addr + n < addr || addr + n > mmapbase(g)){
+      vmunlock(p);
       return -1;
-    myproc()->sz += n;
+    }
+    g->sz += n;
+    vmunlock(p);
   }
   return addr;
 }
@@ -72,12 +92,15 @@ sys_pause(void)
   if(n < 0)
     n = 0;
   acquire(&tickslock);
+  tickupdate();
   ticks0 = ticks;
   while(ticks - ticks0 < n){
     if(killed(myproc())){
       release(&tickslock);
       return -1;
     }
+    if(ticks0 + n < tickwake)
+      tickwake = ticks0 + n;
     sleep(&ticks, &tickslock);
   }
   release(&tickslock);
@@ -93,6 +116,82 @@ sys_kill(void)
   return kkill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return ksetpriority(pid, prio);
+}
+
+uint64
+sys_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+  struct proc *p = myproc();
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  if(ksetaffinity(pid, mask) < 0)
+    return -1;
+  // move off this CPU now if we may no longer run here.
+  if(pid == p->pid){
+    push_off();
+    int away = (mask & (1L << cpuid())) == 0;
+    pop_off();
+    if(away)
+      yield();
+  }
+  return 0;
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return kclone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  argint(0, &tid);
+  argaddr(1, &p);
+  return kjoin(tid, p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return kfutexwait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return kfutexwake(addr, n);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -101,7 +200,116 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
+  tickupdate();
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
+
+// copy the virtual memory counters to user space.
+uint64
+sys_vmstat(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  if(copyout(myproc()->pagetable, addr, (char *)&vmstat, sizeof(vmstat)) < 0)
+    return -1;
+  return 0;
+}
+
+// copy the counters of the n most contended locks to user
+// space, and then zero all the counters if reset is set.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n, reset, r = 0;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  argint(2, &reset);
+  if(n > 0)
+    r = lockstatcopy(addr, n);
+  if(reset)
+    lockstatreset();
+  return r;
+}
+
+// copy the counters of every system call number, of all
+// processes or of the caller (see sysstat.h), to user space.
+uint64
+sys_sysstat(void)
+{
+  uint64 addr;
+  int which, reset;
+
+  argaddr(0, &addr);
+  argint(1, &which);
+  argint(2, &reset);
+  if(which != SYSSTAT_ALL && which != SYSSTAT_SELF)
+    return -1;
+  return sysstatcopy(addr, which, reset);
+}
+
+// print the system calls in mask, a bit for each number, as
+// the caller and its future children make them.
+uint64
+sys_trace(void)
+{
+  uint64 mask;
+
+  argaddr(0, &mask);
+  myproc()->tracemask = mask;
+  return 0;
+}
+
+// take rate profiler samples per tick, or stop if rate is 0.
+uint64
+sys_profile(void)
+{
+  int rate;
+
+  argint(0, &rate);
+  return profile(rate);
+}
+
+// move up to n profiler samples to user space.
+uint64
+sys_profread(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  return profread(addr, n);
+}
+
+// send device interrupt irq to hart from now on.
+uint64
+sys_irqroute(void)
+{
+  int irq, hart;
+
+  argint(0, &irq);
+  argint(1, &hart);
+  return irqroute(irq, hart);
+}
+
+// copy the routing and counts of up to n device
+// interrupts to user space.
+uint64
+sys_irqstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  return irqstatcopy(addr, n);
+}
@@ -0,0 +1,13 @@
+// Counters of one system call, returned by sysstat().
+#define NSYSHIST 24   // latency histogram buckets
+
+struct sysstat {
+  char name[16];     // "" if there's no such call
+  uint64 ncall;      // calls
+  uint64 time;       // timer cycles spent in them
+  uint64 hist[NSYSHIST]; // calls taking [2^i, 2^(i+1)) cycles; the last bucket, any longer
+};
+
+// sysstat()'s which
+#define SYSSTAT_ALL   0  // every process's calls, with histograms
+#define SYSSTAT_SELF  1  // the caller's own, without
@@ -3,14 +3,23 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
 
+// ticks counts TIMESLICEs of the time CSR, and is brought up
+// to date by whichever harts take timer interrupts. Idle harts
+// don't take them, except for the earliest tick that a pause()
+// or poll() caller is waiting for, in tickwake.
 struct spinlock tickslock;
 uint ticks;
+uint tickwake = ~0;
 
 extern char trampoline[], uservec[];
 
+// in ucopy.S.
+extern char ucopyfault[], ucopyend[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -27,6 +36,9 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+  // let user code read the time CSR, for uptime() in the vdso,
+  // and the cycle counter, for timing.
+  w_scounteren(r_scounteren() | 3);
 }
 
 //
@@ -47,6 +59,14 @@ usertrap(void)
   w_stvec((uint64)kernelvec);  //DOC: kernelvec
 
   struct proc *p = myproc();
+  uint64 now = r_time();
+
+  p->ru.utime += now - p->tstamp;
+  p->tstamp = now;
+
+  // another thread may be waiting for this hart to forget
+  // page table entries it has removed.
+  tlbsync(p);
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -68,9 +88,9 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if((r_scause() == 15 || r_scause() == 13) &&
-            vmfault(p->pagetable, r_stval(), (r_scause() == 13)? 1 : 0) != 0) {
-    // page fault on lazily-allocated page
+  } else if((r_scause() == 15 || r_scause() == 13 || r_scause() == 12) &&
+            uvmfault(r_stval(), (r_scause() != 15)? 1 : 0) != 0) {
+    // page fault on lazily-allocated, file-backed, or copy-on-write page
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -80,14 +100,14 @@ usertrap(void)
   if(killed(p))
     kexit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if its time slice is over.
   if(which_dev == 2)
     yield();
 
   prepare_return();
 
   // the user page table to switch to, for trampoline.S
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = usersatp(p);
 
   // return to trampoline.S; satp value in a0.
   return satp;
@@ -100,12 +120,17 @@ void
 prepare_return(void)
 {
   struct proc *p = myproc();
+  uint64 now;
 
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(). because a trap from kernel
   // code to usertrap would be a disaster, turn off interrupts.
   intr_off();
 
+  now = r_time();
+  p->ru.stime += now - p->tstamp;
+  p->tstamp = now;
+
   // send syscalls, interrupts, and exceptions to uservec in trampoline.S
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
   w_stvec(trampoline_uservec);
@@ -117,6 +142,9 @@ prepare_return(void)
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
+  // tell uservec and userret where this thread's trapframe is.
+  w_sscratch(p->trapva);
+
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
   
@@ -145,13 +173,18 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopy && sepc < (uint64)ucopyend){
+    // a page fault on user memory in ucopy.S: resume at
+    // ucopyfault, which makes the copy return -1.
+    sepc = (uint64)ucopyfault;
+  } else if((which_dev = devintr()) == 0){
     // interrupt or trap from an unknown source
     printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if its time slice is over.
   if(which_dev == 2 && myproc() != 0)
     yield();
 
@@ -161,26 +194,81 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date, waking pause() and poll() callers if
+// it has reached tickwake. Caller must hold tickslock.
 void
+tickupdate(void)
+{
+  uint now = r_time() / TIMESLICE;
+
+  if(now != ticks){
+    ticks = now;
+    if(ticks >= tickwake){
+      // the sleepers set tickwake again if they must wait on.
+      tickwake = ~0;
+      wakeup(&ticks);
+      pollwakeup();
+    }
+  }
+}
+
+// Set this hart's next timer interrupt: the end of the time
+// slice if it is running a process, or else only the tick in
+// tickwake, so an idle hart sleeps until there is something to
+// do; or sooner, for the profiler's next sample of a process.
+// This also clears the interrupt request.
+static void
+timerarm(int busy)
+{
+  uint64 next;
+
+  if(busy)
+    next = mycpu()->sliceend;
+  else if(tickwake == ~0)
+    next = ~0L;
+  else
+    next = (uint64)tickwake * TIMESLICE;
+  if(busy && profinterval && r_time() + profinterval < next)
+    next = r_time() + profinterval;
+  w_stimecmp(next);
+}
+
+// Returns 1 if the running process's time slice is over.
+int
 clockintr()
 {
-  if(cpuid() == 0){
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
+  int busy = myproc() != 0;
+
+  acquire(&tickslock);
+  tickupdate();
+  release(&tickslock);
+
+  if(busy && profinterval)
+    profsample();
+
+  // ask for the next timer interrupt.
+  if(busy && r_time() >= mycpu()->sliceend){
+    timerset(1);
+    return 1;
   }
+  timerarm(busy);
+  return 0;
+}
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+// Set this hart's next timer interrupt, starting a time slice
+// if it is about to run a process. Called with interrupts off.
+void
+timerset(int busy)
+{
+  if(busy)
+    mycpu()->sliceend = r_time() + TIMESLICE;
+  timerarm(busy);
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
-// 1 if other device,
+// returns 2 if a timer interrupt ended the time slice,
+// 1 if other device or timer interrupt,
 // 0 if not recognized.
 int
 devintr()
@@ -195,8 +283,8 @@ devintr()
 
     if(irq == UART0_IRQ){
       uartintr();
-    } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+    } else if(irq >= VIRTIO_IRQ(0) && irq < VIRTIO_IRQ(NDISK)){
+      virtio_disk_intr(irq);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
@@ -210,8 +298,7 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000005L){
     // timer interrupt.
-    clockintr();
-    return 2;
+    return clockintr() ? 2 : 1;
   } else {
     return 0;
   }
@@ -7,6 +7,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -33,15 +34,20 @@
 #define LCR_BAUD_LATCH (1<<7) // special mode to set baud rate
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
-#define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define LSR_TX_IDLE (1<<5)    // THR and the transmit FIFO are empty
+#define TX_FIFO 16            // bytes the transmit FIFO holds
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// for transmission.
+// for transmission: a ring of bytes that write()s queue and
+// that uartstart() hands to the UART's FIFO a burst at a time,
+// whenever it empties.
 static struct spinlock tx_lock;
-static int tx_busy;           // is the UART busy sending?
-static int tx_chan;           // &tx_chan is the "wait channel"
+#define TX_BUF_SIZE 1024
+static char tx_buf[TX_BUF_SIZE];
+static uint64 tx_w;           // write next to tx_buf[tx_w % TX_BUF_SIZE]
+static uint64 tx_r;           // read next from tx_buf[tx_r % TX_BUF_SIZE]
 
 extern volatile int panicking; // from printf.c
 extern volatile int panicked; // from printf.c
@@ -74,30 +80,59 @@ uartinit(void)
   initlock(&tx_lock, "uart");
 }
 
-// transmit buf[] to the uart. it blocks if the
-// uart is busy, so it cannot be called from
-// interrupts, only from write() system calls.
+// if the UART's transmit FIFO is empty and there are
+// bytes waiting in the ring, fill the FIFO from the ring.
+// the UART interrupts when the FIFO has drained again.
+// caller must hold tx_lock.
+static void
+uartstart(void)
+{
+  if(tx_w == tx_r || (ReadReg(LSR) & LSR_TX_IDLE) == 0)
+    return;
+  for(int i = 0; i < TX_FIFO && tx_r != tx_w; i++)
+    WriteReg(THR, tx_buf[tx_r++ % TX_BUF_SIZE]);
+  // maybe uartwrite() is waiting for space in the ring.
+  wakeup(&tx_r);
+}
+
+// queue buf[] for transmission, and return once it's all
+// in the ring. it blocks if the ring is full, so it cannot
+// be called from interrupts, only from write() system calls.
 void
 uartwrite(char buf[], int n)
 {
   acquire(&tx_lock);
 
   int i = 0;
-  while(i < n){ 
-    while(tx_busy != 0){
-      // wait for a UART transmit-complete interrupt
-      // to set tx_busy to 0.
-      sleep(&tx_chan, &tx_lock);
-    }   
-      
-    WriteReg(THR, buf[i]);
-    i += 1;
-    tx_busy = 1;
+  while(i < n){
+    while(tx_w == tx_r + TX_BUF_SIZE){
+      // wait for uartstart() to make room.
+      uartstart();
+      sleep(&tx_r, &tx_lock);
+    }
+    while(i < n && tx_w != tx_r + TX_BUF_SIZE)
+      tx_buf[tx_w++ % TX_BUF_SIZE] = buf[i++];
+    uartstart();
   }
 
   release(&tx_lock);
 }
 
+// queue as many of the n bytes at buf as there is room for
+// in the ring, without waiting, for printf().
+// returns the number queued.
+int
+uartqueue(char *buf, int n)
+{
+  int i = 0;
+
+  acquire(&tx_lock);
+  while(i < n && tx_w != tx_r + TX_BUF_SIZE)
+    tx_buf[tx_w++ % TX_BUF_SIZE] = buf[i++];
+  uartstart();
+  release(&tx_lock);
+  return i;
+}
 
 // write a byte to the uart without using
 // interrupts, for use by kernel printf() and
@@ -123,6 +158,16 @@ uartputc_sync(int c)
     pop_off();
 }
 
+// write the bytes still waiting in the transmit ring straight
+// to the uart, for panic(). doesn't take tx_lock, since the
+// CPU holding it may never release it.
+void
+uartflush(void)
+{
+  while(tx_r != tx_w)
+    uartputc_sync(tx_buf[tx_r++ % TX_BUF_SIZE]);
+}
+
 // read one input character from the UART.
 // return -1 if none is waiting.
 int
@@ -144,13 +189,12 @@ uartintr(void)
 {
   ReadReg(ISR); // acknowledge the interrupt
 
+  // send more of the ring, if the FIFO has drained, and
+  // refill the ring from printf()'s buffers.
   acquire(&tx_lock);
-  if(ReadReg(LSR) & LSR_TX_IDLE){
-    // UART finished transmitting; wake up sending thread.
-    tx_busy = 0;
-    wakeup(&tx_chan);
-  }
+  uartstart();
   release(&tx_lock);
+  printdrain();
 
   // read and process incoming characters.
   while(1){
@@ -0,0 +1,7 @@
+// readv() and writev() buffers
+struct iovec {
+  void *iov_base;  // start of the buffer
+  int iov_len;     // its length in bytes
+};
+
+#define IOV_MAX 16  // most buffers per call
@@ -0,0 +1,35 @@
+// Submission and completion rings for ringenter(): a batch of
+// system calls for one trap. The user fills sq[sqtail %
+// URING_SIZE] and advances sqtail; ringenter() carries out the
+// entries from sqhead on, in order, and posts a completion for
+// each to cq[cqtail % URING_SIZE]; the user consumes those
+// from cqhead on.
+#define URING_SIZE 32   // entries in each ring
+
+// operations
+#define URING_READ   1  // read(fd, addr, n)
+#define URING_WRITE  2  // write(fd, addr, n)
+#define URING_OPEN   3  // open(addr, n)
+#define URING_CLOSE  4  // close(fd)
+
+struct sqe {
+  int op;
+  int fd;
+  uint64 addr;
+  int n;
+  uint64 data;    // passed back in the completion
+};
+
+struct cqe {
+  uint64 data;    // the sqe's
+  int res;        // what the system call would have returned
+};
+
+struct uring {
+  uint sqhead;    // set by the kernel
+  uint sqtail;    // set by the user
+  uint cqhead;    // set by the user
+  uint cqtail;    // set by the kernel
+  struct sqe sq[URING_SIZE];
+  struct cqe cq[URING_SIZE];
+};
@@ -0,0 +1,7 @@
+// The vdso page: data that the kernel keeps for every process,
+// mapped read-only at VDSO in its user memory, so that the user
+// library can answer some questions without a system call.
+struct vdso {
+  uint64 timeslice;  // time CSR counts per tick, for uptime()
+  int pid;           // getpid(), or 0 while there are threads, whose pids differ
+};
@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -45,9 +46,21 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
+// offset of the 64-bit capacity, in 512-byte sectors, in a
+// block device's configuration.
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+
+// offset of the 16-bit queue count in a block device's
+// configuration, if it offers VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 32
+
+// most blocks in one request. its chain, with a header and a
+// status descriptor, must fit in the NUM descriptors.
+#define NSEG (NUM/2)
 
 // a single descriptor, from the spec.
 struct virtq_desc {
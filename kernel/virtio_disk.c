@@ -1,8 +1,10 @@
 //
-// driver for qemu's virtio disk device.
+// driver for qemu's virtio disk devices.
 // uses qemu's mmio interface to virtio.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// and the same for further disks, on bus virtio-mmio-bus.1 and so on;
+// ,num-queues=n on the -device gives a disk more request queues.
 //
 
 #include "types.h"
@@ -16,10 +18,13 @@
 #include "buf.h"
 #include "virtio.h"
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+// the address of virtio mmio register r of disk d.
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
 
-static struct disk {
+// one of a disk's request queues. each has its own lock, and
+// harts submit to the one for their group, so that harts
+// using the same disk don't contend.
+struct vq {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -44,7 +49,8 @@ static struct disk {
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // b is the buf of a data descriptor; status is
+  // that of the request whose chain starts here.
   struct {
     struct buf *b;
     char status;
@@ -54,111 +60,177 @@ static struct disk {
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
   
-  struct spinlock vdisk_lock;
-  
-} disk;
+  struct spinlock lock;
+};
 
-void
-virtio_disk_init(void)
+// virtio disk i, if present, is device ROOTDEV+i, in mmio
+// slot i.
+static struct disk {
+  uint64 base;     // mmio registers
+  int irq;
+  int nvq;         // queues in use; 0 if there's no disk here
+  struct vq vq[NVQ];
+} disks[NDISK];
+
+// Set up queue n of disk d, which d has selected.
+static void
+vqinit(struct disk *d, int n)
 {
-  uint32 status = 0;
+  struct vq *q = &d->vq[n];
+
+  initlock(&q->lock, "virtio_disk");
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  // initialize queue n.
+  *R(d, VIRTIO_MMIO_QUEUE_SEL) = n;
+
+  // ensure queue n is not in use.
+  if(*R(d, VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 2 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
+  // check maximum queue size.
+  uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if(!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(d, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(d, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
+
+// Set up disk i, if there is one in slot i.
+static void
+diskinit(int i)
+{
+  struct disk *d = &disks[i];
+  uint32 status = 0;
+
+  d->base = VIRTIO(i);
+  d->irq = VIRTIO_IRQ(i);
+  if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+     *R(d, VIRTIO_MMIO_VERSION) != 2 ||
+     *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+     *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+    if(i == 0)
+      panic("could not find virtio disk");
+    return;
   }
   
   // reset device
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
+  if(NVQ == 1)
+    features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // re-read status to ensure FEATURES_OK is set.
-  status = *R(VIRTIO_MMIO_STATUS);
+  status = *R(d, VIRTIO_MMIO_STATUS);
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  // use as many of the device's queues as we may.
+  d->nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    d->nvq = *(volatile uint16*)(d->base + VIRTIO_MMIO_CONFIG +
+                                 VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if(d->nvq > NVQ)
+      d->nvq = NVQ;
+    if(d->nvq < 1)
+      d->nvq = 1;
+  }
+  for(int n = 0; n < d->nvq; n++)
+    vqinit(d, n);
 
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  // tell device we're completely ready.
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // plic.c and trap.c arrange for interrupts from d->irq.
+}
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+void
+virtio_disk_init(void)
+{
+  for(int i = 0; i < NDISK; i++)
+    diskinit(i);
+}
 
-  // tell device we're completely ready.
-  status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+// The disk that holds device dev's blocks.
+static struct disk*
+devdisk(uint dev)
+{
+  if(dev < ROOTDEV || dev >= ROOTDEV + NDISK || disks[dev - ROOTDEV].nvq == 0)
+    panic("virtio disk: no such device");
+  return &disks[dev - ROOTDEV];
+}
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+// The size of device dev in blocks, or 0 if there's no such disk.
+uint64
+virtio_disk_size(uint dev)
+{
+  struct disk *d;
+  uint64 sectors;
+
+  if(dev < ROOTDEV || dev >= ROOTDEV + NDISK || disks[dev - ROOTDEV].nvq == 0)
+    return 0;
+  d = &disks[dev - ROOTDEV];
+  sectors = *R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY) |
+    (uint64)*R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+  return sectors * 512 / BSIZE;
 }
 
-// find a free descriptor, mark it non-free, return its index.
+// find a free descriptor of q, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +239,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -196,46 +268,54 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous),
+// or none if there aren't that many free.
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vq *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Queue one request on queue qn of disk d, to read or write the
+// n bufs b[0..n-1], which hold consecutive blocks. Caller must
+// hold the queue's lock, and notify the device once it has
+// queued all its requests.
+static void
+submit(struct disk *d, int qn, struct buf **b, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  struct vq *q = &d->vq[qn];
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, one for each run
+  // of data, and one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NSEG+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(q, idx, n+2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    // this batch's earlier requests may be what holds the
+    // descriptors, and nobody else may notify this queue, so
+    // tell the device about them before waiting.
+    __sync_synchronize();
+    *R(d, VIRTIO_MMIO_QUEUE_NOTIFY) = qn;
+    sleep(&q->free[0], &q->lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,84 +324,153 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  q->desc[idx[0]].addr = (uint64) buf0;
+  q->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  q->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  q->desc[idx[0]].next = idx[1];
+
+  for(int i = 0; i < n; i++){
+    int d = idx[i+1];
+    q->desc[d].addr = (uint64) b[i]->data;
+    q->desc[d].len = BSIZE;
+    if(write)
+      q->desc[d].flags = 0; // device reads b->data
+    else
+      q->desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    q->desc[d].flags |= VRING_DESC_F_NEXT;
+    q->desc[d].next = idx[i+2];
+
+    // record struct buf for virtio_disk_intr(), and the
+    // queue for virtio_disk_wait().
+    b[i]->disk = 1;
+    b[i]->vq = qn;
+    q->info[d].b = b[i];
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  q->desc[idx[n+1]].addr = (uint64) &q->info[idx[0]].status;
+  q->desc[idx[n+1]].len = 1;
+  q->desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  q->desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % NUM ...
+}
 
+// Start reading or writing the n locked bufs b[0..n-1], all
+// of the same device, without waiting. Each run of consecutive
+// block numbers, up to NSEG blocks, is one request, on the
+// queue of the calling hart's group. The disk field of each
+// buf stays set until its transfer is done, and then bufs with
+// async set are passed to bdone(); virtio_disk_wait() waits
+// for the others.
+void
+virtio_disk_start(struct buf **b, int n, int write)
+{
+  struct disk *d = devdisk(b[0]->dev);
+  struct vq *q;
+  int i, j, qn;
+
+  push_off();
+  qn = cpuid() % d->nvq;
+  pop_off();
+  q = &d->vq[qn];
+
+  acquire(&q->lock);
+  for(i = 0; i < n; i = j){
+    if(b[i]->dev != b[0]->dev)
+      panic("virtio_disk_start: dev");
+    for(j = i+1; j < n && j-i < NSEG && b[j]->blockno == b[j-1]->blockno + 1; j++)
+      ;
+    submit(d, qn, b+i, j-i, write);
+  }
   __sync_synchronize();
+  *R(d, VIRTIO_MMIO_QUEUE_NOTIFY) = qn; // value is queue number
+  release(&q->lock);
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Wait for the transfer of b started by virtio_disk_start()
+// to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vq *q = &devdisk(b->dev)->vq[b->vq];
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&q->lock);
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &q->lock);
   }
+  release(&q->lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write);
+  virtio_disk_wait(b);
+}
+
+// Finish the requests the device has completed on q.
+// Caller must hold q->lock.
+static void
+vqintr(struct vq *q)
+{
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
+
+  while(q->used_idx != q->used->idx){
+    __sync_synchronize();
+    int id = q->used->ring[q->used_idx % NUM].id;
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+    if(q->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    // finish each buf of the request, and free its descriptors.
+    for(int d = q->desc[id].next; q->desc[d].flags & VRING_DESC_F_NEXT; d = q->desc[d].next){
+      struct buf *b = q->info[d].b;
+      q->info[d].b = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->async){
+        b->async = 0;
+        bdone(b);
+      } else {
+        wakeup(b);
+      }
+    }
+    free_chain(q, id);
 
-  release(&disk.vdisk_lock);
+    q->used_idx += 1;
+  }
 }
 
+// Handle an interrupt from the disk with interrupt irq.
 void
-virtio_disk_intr()
+virtio_disk_intr(int irq)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *d = &disks[irq - VIRTIO_IRQ(0)];
+
+  if(d->nvq == 0)
+    return;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
-  // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  // in the next interrupt, which is harmless. all of the
+  // device's queues share the interrupt.
+  *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  for(int n = 0; n < d->nvq; n++){
+    acquire(&d->vq[n].lock);
+    vqintr(&d->vq[n]);
+    release(&d->vq[n].lock);
   }
-
-  release(&disk.vdisk_lock);
 }
@@ -5,8 +5,13 @@
 #include "riscv.h"
 #include "defs.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "vm.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -17,6 +22,32 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walkto(pagetable_t, uint64, int, int *);
+static int megafree(pagetable_t, uint64);
+static void *ukalloc(void);
+
+// the flags a paged-out page's PTE keeps; see PTE_SWAP.
+#define SWAPFLAGS (PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW)
+
+// a page of zeros, mapped read-only and copy-on-write by
+// vmfault() for reads of pages that haven't been written yet.
+// the kernel's own reference keeps it from ever being freed.
+static char *zeropage;
+
+struct vmstat vmstat;
+
+// Each process's page table is tagged with an address space
+// identifier (ASID), so that switching satp between it and
+// the kernel's page table (ASID 0) needn't flush the TLB.
+// ASIDs are handed out in increasing order and never reused
+// within a generation; when they run out, a new generation
+// starts, and each hart flushes its whole TLB before it next
+// runs a process with an ASID of the new generation.
+struct spinlock asidlock;
+static uint64 maxasid;      // largest ASID the hardware supports
+static uint64 asidgen = 1;  // current generation
+static uint64 nextasid = 1;
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -30,7 +61,7 @@ kvmmake(void)
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
   // virtio mmio disk interface
-  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, NDISK*PGSIZE, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
@@ -39,6 +70,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages for the 2-megabyte aligned part.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -65,18 +97,39 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 void
 kvminit(void)
 {
+  initlock(&asidlock, "asid");
   kernel_pagetable = kvmmake();
+
+  if((zeropage = kalloc()) == 0)
+    panic("kvminit: zeropage");
+  memset(zeropage, 0, PGSIZE);
 }
 
 // Switch the current CPU's h/w page table register to
-// the kernel's page table, and enable paging.
+// its own copy of the kernel's page table, and enable paging.
+// The copies share all but the top-level page, whose upper
+// half each hart fills with the user window (see uwin()), so
+// the kernel's top-level PTEs must not change after this.
 void
 kvminithart()
 {
+  struct cpu *c = mycpu();
+
+  if((c->kpagetable = (pagetable_t) kalloc()) == 0)
+    panic("kvminithart");
+  memmove(c->kpagetable, kernel_pagetable, PGSIZE);
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // find out how many ASID bits are implemented, by writing
+  // all ones and reading back what sticks.
+  if(cpuid() == 0){
+    w_satp(MAKE_SATP(c->kpagetable) | SATP_ASID(0xFFFF));
+    maxasid = SATP2ASID(r_satp());
+  }
+
+  w_satp(MAKE_SATP(c->kpagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
@@ -94,15 +147,34 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid level-1 PTE with any of R, W or X set is a leaf
+// that maps a whole 2-megabyte megapage; if va lies in one,
+// walk() returns that level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walkto(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but stop at the page-table level *level:
+// 0 for the PTE of a 4096-byte page, 1 for the PTE of a
+// megapage. Sets *level to the level of the returned PTE,
+// which is 1 when asked for level 0 if va lies in a megapage.
+static pte_t *
+walkto(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
+    if((*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X))) {
+      *level = l;    // megapage leaf
+      return pte;
+    } else if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -111,7 +183,7 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -122,11 +194,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkto(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -134,19 +207,25 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va % MEGAPGSIZE);
   return pa;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Where va and pa are both 2-megabyte aligned, at least
+// 2 megabytes remain, and no page table exists yet for that
+// range, maps a megapage instead of 512 pages.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("mappages: va not aligned");
@@ -160,19 +239,63 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    level = 0;
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+       last - a >= MEGAPGSIZE - PGSIZE && megafree(pagetable, a))
+      level = 1;
+    if((pte = walkto(pagetable, a, 1, &level)) == 0)
       return -1;
-    if(*pte & PTE_V)
+    if(*pte & (PTE_V|PTE_SWAP))
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    sz = level ? MEGAPGSIZE : PGSIZE;
+    if(a + sz - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
+// Is the level-1 PTE for va unused, so that
+// a megapage can be mapped there?
+static int
+megafree(pagetable_t pagetable, uint64 va)
+{
+  int level = 1;
+  pte_t *pte = walkto(pagetable, va, 0, &level);
+
+  return pte == 0 || (*pte & PTE_V) == 0;
+}
+
+// Replace the megapage leaf *pte with a page-table page of
+// 512 leaves that map the same memory with the same flags,
+// so that its pages can be unmapped and freed one at a time.
+// If pt is 0, allocates the page-table page. Otherwise pt is
+// one of the megapage's own pages, being unmapped anyway,
+// which is used as the page-table page and left unmapped.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte, uint64 pt)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+  pagetable_t pagetable;
+
+  if(pt == 0 && (pt = (uint64)kalloc()) == 0)
+    return -1;
+  ksplit((void*)pa);
+  pagetable = (pagetable_t)pt;
+  for(int i = 0; i < 512; i++){
+    if(pa + i*PGSIZE == pt)
+      pagetable[i] = 0;
+    else
+      pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  }
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -186,56 +309,133 @@ uvmcreate()
   return pagetable;
 }
 
+// Free the n pages in freed that uvmunmap() has unmapped from
+// pagetable, a 2-megabyte run where the low bit is set, once no
+// hart's TLB can still map them for another thread.
+static void
+unmapfree(pagetable_t pagetable, uint64 *freed, int n)
+{
+  uvmflush(pagetable, -1);
+  uvmsync(pagetable);
+  for(int i = 0; i < n; i++){
+    if(freed[i] & 1)
+      kfreemega((void*)(freed[i] & ~1L));
+    else
+      kfree((void*)freed[i]);
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  uint64 a, end;
+  pte_t *pte, old;
+  int level;
+  uint64 freed[32];
+  int nfreed = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if(nfreed == NELEM(freed)){
+      unmapfree(pagetable, freed, nfreed);
+      nfreed = 0;
+    }
+    level = 0;
+    if((pte = walkto(pagetable, a, 0, &level)) == 0) // leaf page table entry allocated?
       continue;   
+    if(*pte & PTE_SWAP){
+      // paged out: drop the swap slot instead.
+      if(do_free)
+        swapput(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)  // has physical page been allocated?
       continue;
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    if(level == 1){
+      if(a % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+        if(do_free)
+          freed[nfreed++] = PTE2PA(*pte) | 1;
+        *pte = 0;
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      // only part of the megapage is going away; split it.
+      if(!do_free)
+        panic("uvmunmap: megapage");
+      if(demote(pte, 0) == 0){
+        a -= PGSIZE;  // look at a's page again
+        continue;
+      }
+      // out of memory: recycle the page at a as the page-table
+      // page, once no other thread can still write to it.
+      old = *pte;
+      *pte = 0;
+      uvmflush(pagetable, -1);
+      uvmsync(pagetable);
+      *pte = old;
+      demote(pte, PTE2PA(old) + PGROUNDDOWN(a % MEGAPGSIZE));
+      continue;
+    }
+    if(*pte & PTE_FA){
+      // the hardware sets PTE_A when the page is referenced.
+      if(*pte & PTE_A)
+        __sync_fetch_and_add(&vmstat.nfaused, 1);
+      else
+        __sync_fetch_and_add(&vmstat.nfaunused, 1);
     }
+    if(do_free)
+      freed[nfreed++] = PTE2PA(*pte);
     *pte = 0;
   }
+  if(nfreed > 0)
+    unmapfree(pagetable, freed, nfreed);
+  else
+    uvmflush(pagetable, -1);
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Aligned 2-megabyte stretches are mapped with megapages when
+// kallocmega() has a run to spare.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, sz;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(a = oldsz; a < newsz; a += sz){
+    mem = 0;
+    if(a % MEGAPGSIZE == 0 && newsz - a >= MEGAPGSIZE && megafree(pagetable, a))
+      mem = kallocmega();
+    sz = mem ? MEGAPGSIZE : PGSIZE;
+    if(mem == 0)
+      mem = ukalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
-      kfree(mem);
+    memset(mem, 0, sz);
+    if(mappages(pagetable, a, sz, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+      if(sz == MEGAPGSIZE)
+        kfreemega(mem);
+      else
+        kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
   }
+  uvmflush(pagetable, -1);
   return newsz;
 }
 
@@ -282,6 +482,13 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  // don't leave the page table in this hart's user window:
+  // a new one might be allocated at the same address.
+  push_off();
+  if(mycpu()->uwin == pagetable)
+    mycpu()->uwin = 0;
+  pop_off();
+
   if(sz > 0)
     uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
   freewalk(pagetable);
@@ -289,37 +496,71 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: writable pages are
+// shared copy-on-write; see uvmshare().
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of old in [start, end) into new as well.
+// If cow, writable pages are shared copy-on-write, by clearing
+// PTE_W and setting PTE_COW in both page tables; vmfault()
+// makes a private copy on the first store. Otherwise pages are
+// shared as they are, as for MAP_SHARED regions. megapages are
+// first split into pages, so that each can be copied on its own.
+// Paged-out pages are shared by their swap slot.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walkto(old, i, 0, &level)) == 0)
       continue;   // page table entry hasn't been allocated
+    if(*pte & PTE_SWAP){
+      // paged out: share the swap slot copy-on-write instead.
+      if(cow && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(PTE2SLOT(*pte));
+      continue;
+    }
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
+    if(level == 1){
+      if(demote(pte, 0) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    flags = PTE_FLAGS(*pte) & ~(PTE_FA|PTE_A|PTE_D);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kincref((void*)pa);
   }
+  // a thread still writing through a stale TLB entry would
+  // change the page under new.
+  uvmflush(old, -1);
+  uvmsync(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmflush(old, -1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
@@ -336,36 +577,141 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Show pagetable in this hart's user window, if it is the
+// current process's, and return the window address of user
+// address va; or return 0 if a copy of len bytes at va must
+// take the slow path through walkaddr(). The window copies
+// the user page table's top-level PTEs, so it shares their
+// lower-level pages and sees later changes to them, and it is
+// reloaded if a PTE it needs has changed. Must be called with
+// interrupts off, which keeps the window in place until the
+// copy is done.
+static char *
+uwin(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct cpu *c = mycpu();
+  pte_t *w = &c->kpagetable[PX(2, UWIN)];
+  uint64 last = va + len - 1;
+
+  // the trapframes and trampoline aren't PTE_U, but the kernel
+  // could still reach them at UWIN.
+  if(c->proc == 0 || c->proc->pagetable != pagetable ||
+     len == 0 || va >= MMAPTOP || len > MMAPTOP - va)
+    return 0;
+
+  tlbsync(c->proc);
+
+  if(c->uwin == pagetable){
+    for(uint64 i = PX(2, va); i <= PX(2, last); i++)
+      if(w[i] != pagetable[i])
+        c->uwin = 0;
+  }
+  if(c->uwin != pagetable){
+    memmove(w, pagetable, PX(2, UWIN) * sizeof(pte_t));
+    sfence_vma_asid(0);
+    c->uwin = pagetable;
+  }
+  return (char *)(UWIN + va);
+}
+
+// Fault in the page at va of pagetable for a copy that
+// couldn't find it. Returns the physical address, or 0.
+// A process with other threads faults holding its vm lock;
+// if this thread holds a spinlock or a sleep-lock, the thread
+// holding the vm lock might need it, so it gives up instead.
+// fileread() and filewrite() make sure their user buffers are
+// there first.
+static uint64
+copyfault(pagetable_t pagetable, uint64 va, int read)
+{
+  struct proc *p = myproc();
+  int spinning;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return vmfault(pagetable, va, read);
+  push_off();
+  spinning = mycpu()->noff > 1;
+  pop_off();
+  if(p->group->nthread > 1 && (spinning || p->nsleeplocks > 0))
+    return 0;
+  return uvmfault(va, read);
+}
+
+// Fault in the pages of the n bytes at user address va of the
+// current process that aren't there yet, or, unless read, are
+// copy-on-write, for a copy that will be made holding a lock
+// and so can't fault if the process has other threads. If a
+// page can't be faulted in, the copy will fail on it.
+void
+uvmprefault(uint64 va, int n, int read)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(p->group->nthread == 1 || n <= 0 || va >= MAXVA || n > MAXVA - va)
+    return;
+  for(uint64 a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(walkaddr(p->pagetable, a) == 0 ||
+       (!read && (pte = walk(p->pagetable, a, 0)) != 0 && (*pte & PTE_COW)))
+      uvmfault(a, read);
+  }
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
+//
+// Tries a copy through the user window first, with sstatus.SUM
+// set. If that faults, e.g. on a lazily allocated, copy-on-write
+// or read-only page, ucopy() gives up, and the copy starts over
+// page by page through walkaddr() and vmfault(). Each page is
+// copied with interrupts off, so that this hart keeps running
+// the thread and another thread can't free the page meanwhile;
+// see uvmsync().
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
   pte_t *pte;
+  char *w;
+
+  push_off();
+  if((w = uwin(pagetable, dstva, len)) != 0 && ucopy(w, src, len) == 0){
+    pop_off();
+    return 0;
+  }
+  pop_off();
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
   
+    push_off();
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+    // fill in the page, or break copy-on-write sharing, before
+    // writing, and look again.
+    if(pa0 == 0 || (*(pte = walk(pagetable, va0, 0)) & PTE_COW)){
+      pop_off();
+      if(copyfault(pagetable, va0, 0) == 0)
         return -1;
-      }
+      continue;
     }
-
-    pte = walk(pagetable, va0, 0);
     // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
+    if((*pte & PTE_W) == 0){
+      pop_off();
       return -1;
+    }
+    // the store bypasses the user mapping, so mark it dirty
+    // by hand, e.g. for writing back MAP_SHARED file pages.
+    // atomically, since kpageout() may be changing the PTE.
+    __sync_fetch_and_or(pte, PTE_D);
       
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -381,19 +727,30 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  char *w;
+
+  push_off();
+  if((w = uwin(pagetable, srcva, len)) != 0 && ucopy(dst, w, len) == 0){
+    pop_off();
+    return 0;
+  }
+  pop_off();
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
+    push_off();
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+      pop_off();
+      if(copyfault(pagetable, va0, 1) == 0)
         return -1;
-      }
+      continue;
     }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -411,12 +768,26 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  char *w;
+  int r = -1;
+
+  push_off();
+  if((w = uwin(pagetable, srcva, max)) != 0)
+    r = ucopystr(dst, w, max);
+  pop_off();
+  if(r >= 0)
+    return r == 0 ? 0 : -1;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
+    push_off();
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0) {
+      pop_off();
+      if(copyfault(pagetable, va0, 1) == 0)
+        return -1;
+      continue;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -435,6 +806,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -445,33 +817,549 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-// allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
-// returns 0 if va is invalid or already mapped, or if
+// Allocate a page for user memory, paging some out to swap
+// space if kalloc() can't find one. May sleep.
+// Returns 0 if there's still none.
+static void *
+ukalloc(void)
+{
+  void *mem;
+
+  while((mem = kalloc()) == 0)
+    if(kpageout(SWAPBATCH) == 0)
+      return 0;
+  return mem;
+}
+
+// Give the page mapped by the copy-on-write PTE pte its own
+// writable physical page, copying the shared one unless this
+// page table holds the only reference to it. Sets *old to the
+// shared page if the caller must drop its reference to it.
+// returns the new physical address, or 0 if out of memory.
+static uint64
+cowcopy(pte_t *pte, uint64 *old)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  char *mem;
+
+  *old = 0;
+  if(krefcount((void*)pa) == 1){
+    // no one else shares it any longer.
+    *pte = PA2PTE(pa) | flags;
+    return pa;
+  }
+  if((mem = ukalloc()) == 0)
+    return 0;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  *old = pa;
+  return (uint64)mem;
+}
+
+// Find the vma of process p that covers the page at va.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(va >= v->start && va < PGROUNDUP(v->end))
+      return v;
+  }
+  return 0;
+}
+
+// Read the file data belonging to the page at va of vma v
+// into mem, a zeroed kernel page.
+// Returns 0 on success, -1 on error.
+int
+vmaread(struct vma *v, uint64 va, uint64 mem)
+{
+  uint pos = va - v->start;
+  uint n;
+  int r, locked;
+
+  if(pos >= v->filesz)
+    return 0;   // all zero-fill, e.g. bss
+  n = v->filesz - pos;
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  // the fault may come from copyout() in a read() of this
+  // very file, in which case the caller already holds the lock,
+  // exclusively, or shared, which a reader may take again.
+  locked = holdingsleep(&v->ip->lock);
+  if(!locked)
+    ilockshared(v->ip);
+  r = readi(v->ip, 0, mem, v->off + pos, n);
+  if(!locked)
+    iunlockshared(v->ip);
+  return r == n ? 0 : -1;
+}
+
+// Return a referenced page cache page to map read-only for
+// the page at va of private file-backed vma v, so that every
+// process running a program shares its text. The page's file
+// data must start at a page-aligned offset and fill the page,
+// or run to the end of the file, past which a cached page is
+// zero. Returns 0 if the page can't be shared.
+static uint64
+vmashare(struct vma *v, uint64 va)
+{
+  uint pos = va - v->start;
+  uint64 pa = 0;
+  int locked;
+
+  if((v->off + pos) % PGSIZE != 0 || pos >= v->filesz)
+    return 0;
+  // as in vmaread().
+  locked = holdingsleep(&v->ip->lock);
+  if(!locked)
+    ilockshared(v->ip);
+  if(pos + PGSIZE <= v->filesz || v->off + v->filesz >= v->ip->size)
+    pa = pcgetpriv(v->ip, v->off + pos);
+  if(!locked)
+    iunlockshared(v->ip);
+  return pa;
+}
+
+// Drop the file references held by the n vmas at v,
+// and mark them unused.
+// Must be called inside a transaction, since it calls iput().
+void
+vmaput(struct vma *v, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(v[i].ip)
+      iput(v[i].ip);
+    memset(&v[i], 0, sizeof(v[i]));
+  }
+}
+
+// map a page at the unmapped user address va, which belongs
+// to vma v, or to anonymous memory if v is 0, adding the PTE
+// bits in extra. pages of file-backed vmas are read from the
+// file; other pages are zero-filled. a read of a page with no
+// file data maps the shared zero page copy-on-write, so that
+// memory is only allocated on the first store, and a read of
+// a private file page maps the page cache's, copy-on-write if
+// the vma is writable.
+// returns the physical address, or 0 on error.
+static uint64
+vmfill(pagetable_t pagetable, struct vma *v, uint64 va, int read, int extra)
+{
+  uint64 mem;
+  int perm = (v ? v->perm : PTE_W|PTE_R) | PTE_U | extra;
+
+  if(v && (v->flags & MAP_SHARED)){
+    // every mapping must see the same page.
+    if((mem = mmapget(v, va)) == 0)
+      return 0;
+    if(mappages(pagetable, va, PGSIZE, mem, perm) != 0){
+      mmapput(v, va, mem);
+      return 0;
+    }
+    return mem;
+  }
+  if(read && (v == 0 || va - v->start >= v->filesz)){
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+    if(mappages(pagetable, va, PGSIZE, (uint64)zeropage, perm) != 0)
+      return 0;
+    kincref(zeropage);
+    return (uint64)zeropage;
+  }
+  if(read && v && v->ip && (mem = vmashare(v, va)) != 0){
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+    if(mappages(pagetable, va, PGSIZE, mem, perm) != 0){
+      kfree((void *)mem);
+      return 0;
+    }
+    __sync_fetch_and_add(&vmstat.nshared, 1);
+    return mem;
+  }
+  mem = (uint64) ukalloc();
+  if(mem == 0)
+    return 0;
+  memset((void *) mem, 0, PGSIZE);
+  if(v && vmaread(v, va, mem) < 0){
+    kfree((void *)mem);
+    return 0;
+  }
+  if (mappages(pagetable, va, PGSIZE, mem, perm) != 0) {
+    kfree((void *)mem);
+    return 0;
+  }
+  return mem;
+}
+
+// Read the paged-out page whose PTE is pte, at va of pagetable,
+// back in from its swap slot, into a page of its own.
+// Returns the physical address, or 0 if out of memory.
+static uint64
+swapin(pagetable_t pagetable, pte_t *pte, uint64 va)
+{
+  pte_t old = *pte;
+  char *mem;
+
+  if((mem = ukalloc()) == 0)
+    return 0;
+  swaprw(PTE2SLOT(old), (uint64)mem, 0);
+  *pte = PA2PTE(mem) | (old & SWAPFLAGS) | PTE_A | PTE_V;
+  swapput(PTE2SLOT(old));
+  uvmflush(pagetable, va);
+  __sync_fetch_and_add(&vmstat.nswapin, 1);
+  return (uint64)mem;
+}
+
+// handle a fault on user address va: either a store to a
+// copy-on-write page shared by fork, or a reference to a page
+// that hasn't been allocated yet, which vmfill() maps, or to
+// one that has been paged out, which swapin() reads back.
+// if the fault is on the page just after the previous fault's,
+// the process is probably walking through memory, so also map
+// up to FAULTAROUND following pages to save it the traps.
+// may sleep, so callers must not hold spinlocks.
+// returns 0 if va is invalid or the access isn't allowed, or if
 // out of physical memory, and physical address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
-  uint64 mem;
+  uint64 mem, a, old;
+  pte_t *pte;
+  struct vma *v;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
-  if (va >= p->sz)
+  v = vmalookup(g, PGROUNDDOWN(va));
+  if (va >= g->sz && v == 0)
     return 0;
   va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_SWAP)){
+    if(swapin(pagetable, pte, va) == 0)
+      return 0;
+    __sync_fetch_and_add(&vmstat.nfault, 1);
+    p->ru.nfault++;
+    // now as if it had never gone, e.g. still copy-on-write.
+  }
   if(ismapped(pagetable, va)) {
+    pte = walk(pagetable, va, 0);
+    if(!read && (*pte & PTE_COW) && (*pte & PTE_U)){
+      __sync_fetch_and_add(&vmstat.nfault, 1);
+      p->ru.nfault++;
+      if((mem = cowcopy(pte, &old)) != 0){
+        uvmflush(pagetable, va);
+        if(old){
+          // other threads may still read the old page.
+          uvmsync(pagetable);
+          kfree((void*)old);
+        }
+      }
+      return mem;
+    }
+    if((*pte & PTE_U) && (*pte & (read ? PTE_R|PTE_X : PTE_W))){
+      // another thread faulted the page in first.
+      uvmflush(pagetable, va);
+      return walkaddr(pagetable, va);
+    }
     return 0;
   }
-  mem = (uint64) kalloc();
-  if(mem == 0)
+  if(v && !read && (v->perm & PTE_W) == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
-    kfree((void *)mem);
+  // PTE_A, as the access is about to set it anyway: so that
+  // kpageout() doesn't take the page right back.
+  if((mem = vmfill(pagetable, v, va, read, PTE_A)) == 0)
     return 0;
+  uvmflush(pagetable, va);
+  __sync_fetch_and_add(&vmstat.nfault, 1);
+  p->ru.nfault++;
+
+  a = va + PGSIZE;
+  if(va == p->faultnext){
+    for(; a < va + (FAULTAROUND+1)*PGSIZE && a < (v ? PGROUNDUP(v->end) : g->sz); a += PGSIZE){
+      if(((pte = walk(pagetable, a, 0)) != 0 && *pte != 0) || vmalookup(g, a) != v)
+        break;   // mapped, or paged out
+      if(vmfill(pagetable, v, a, read, PTE_FA) == 0)
+        break;
+      uvmflush(pagetable, a);
+      __sync_fetch_and_add(&vmstat.nfaround, 1);
+    }
   }
+  p->faultnext = a;
   return mem;
 }
 
+// Return the satp value for switching to process p's page
+// table on the way to user space, first assigning p's thread
+// group an ASID if it has none in the current generation, and
+// flushing this hart's TLB entries that might be stale. If the
+// hardware has no ASIDs, the satp has ASID 0 and trampoline.S
+// flushes the whole TLB instead. Called with interrupts off.
+uint64
+usersatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *g = p->group;
+  uint64 hart = 1L << cpuid();
+
+  if(maxasid == 0){
+    tlbsync(p);
+    return MAKE_SATP(p->pagetable);
+  }
+
+  if(g->asidgen != c->asidgen || c->asidgen != asidgen){
+    acquire(&asidlock);
+    if(g->asidgen != asidgen){
+      if(nextasid > maxasid){
+        asidgen++;
+        nextasid = 1;
+      }
+      g->asid = nextasid++;
+      g->asidgen = asidgen;
+      g->tlbstale = hart;  // order our own page table writes
+    }
+    if(c->asidgen != asidgen){
+      // this hart's TLB holds entries from older generations.
+      c->asidgen = asidgen;
+      sfence_vma();
+      __sync_fetch_and_and(&g->tlbstale, ~hart);
+    }
+    release(&asidlock);
+  }
+
+  tlbsync(p);
+  return MAKE_SATP(p->pagetable) | SATP_ASID(g->asid);
+}
+
+// Flush this hart's TLB entries for p's page table, and its
+// user window, if another thread has changed the page table
+// since this hart last did. Called with interrupts off.
+void
+tlbsync(struct proc *p)
+{
+  struct proc *g = p->group;
+  uint64 hart = 1L << cpuid();
+
+  if((g->tlbstale & hart) == 0)
+    return;
+  __sync_fetch_and_and(&g->tlbstale, ~hart);
+  if(maxasid == 0)
+    sfence_vma();
+  else if(g->asidgen != 0)
+    sfence_vma_asid(g->asid);
+  if(mycpu()->uwin == p->pagetable)
+    mycpu()->uwin = 0;
+}
+
+// Note that PTEs of pagetable have been added, changed or
+// removed: just the one for va, or any if va is -1.
+// If it belongs to the current process, flush them from this
+// hart's TLB, and have the other harts flush the process's ASID
+// before they next run any of its threads. Other page tables
+// have no ASID yet: they are still being built by fork or exec.
+void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct proc *g;
+
+  // the user window's TLB entries are tagged with ASID 0.
+  push_off();
+  if(mycpu()->uwin == pagetable){
+    if(va == -1)
+      sfence_vma_asid(0);
+    else
+      sfence_vma_page(UWIN + va, 0);
+  }
+  pop_off();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  g = p->group;
+  push_off();
+  __sync_fetch_and_or(&g->tlbstale, ~(1L << cpuid()));
+  if(maxasid != 0 && g->asidgen != 0){
+    if(va == -1)
+      sfence_vma_asid(g->asid);
+    else
+      sfence_vma_page(va, g->asid);
+  }
+  pop_off();
+}
+
+// Wait until no other hart can still be using TLB entries for
+// pagetable that uvmflush() has asked it to drop, so that the
+// pages they mapped can be freed or changed. Only the threads
+// of the current process share its page table. There are no
+// inter-processor interrupts: a hart running one of them drops
+// its entries on its next trap, or timer interrupt, or
+// kernel copy through the user window. May yield, so the
+// caller must not hold a spinlock.
+void
+uvmsync(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+  struct proc *g, *q;
+  int busy;
+
+  if(p == 0 || p->pagetable != pagetable || p->group->nthread == 1)
+    return;
+  g = p->group;
+  for(;;){
+    // another thread waiting in uvmsync() on this hart's entries.
+    push_off();
+    tlbsync(p);
+    pop_off();
+    __sync_synchronize();
+    busy = 0;
+    for(int i = 0; i < NCPU; i++){
+      q = cpus[i].proc;
+      if(q && q != p && q->group == g && (g->tlbstale & (1L << i)))
+        busy = 1;
+    }
+    if(!busy)
+      return;
+    yield();
+  }
+}
+
+// Have every hart drop its TLB entries for the page table of
+// thread group g, and, if wait, wait until none can still be
+// using them, as uvmflush() and uvmsync() do for the current
+// process. A hart running one of g's threads drops them on its
+// next trap; any other does before it next runs one.
+static void
+pageoutsync(struct proc *g, int wait)
+{
+  struct proc *p = myproc(), *q;
+  int busy;
+
+  if(p->group == g){
+    uvmflush(g->pagetable, -1);
+    if(wait)
+      uvmsync(g->pagetable);
+    return;
+  }
+  __sync_fetch_and_or(&g->tlbstale, ALLCPUS);
+  while(wait){
+    __sync_synchronize();
+    busy = 0;
+    for(int i = 0; i < NCPU; i++){
+      q = cpus[i].proc;
+      if(q && q->group == g && (g->tlbstale & (1L << i)))
+        busy = 1;
+    }
+    if(!busy)
+      return;
+    yield();
+  }
+}
+
+// Return the last-level PTE for va of pagetable, or 0 if there's
+// none, setting *step to how far on the next PTE worth looking at
+// is: past the rest of a missing page-table page, or a megapage.
+static pte_t *
+pageoutpte(pagetable_t pagetable, uint64 va, uint64 *step)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  *step = PGSIZE;
+  if((*pte & PTE_V) == 0){
+    *step = (1L << PXSHIFT(2)) - va % (1L << PXSHIFT(2));
+    return 0;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)) != 0){
+    *step = MEGAPGSIZE - va % MEGAPGSIZE;
+    return 0;
+  }
+  return &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
+}
+
+// May the page that pte maps at va of thread group g be paged
+// out? Only private pages of the heap, stack and private
+// mappings qualify, and only if no other page table maps them,
+// which leaves out the zero page and the page cache's pages.
+static int
+pageable(struct proc *g, pte_t pte, uint64 va)
+{
+  uint64 pa = PTE2PA(pte);
+  struct vma *v;
+
+  if((pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U) || pa == (uint64)zeropage ||
+     krefcount((void*)pa) != 1)
+    return 0;
+  if((v = vmalookup(g, va)) != 0)
+    return (v->flags & MAP_SHARED) == 0;
+  return va < g->sz;
+}
+
+// Page out up to n pages (at most SWAPBATCH) of the memory of
+// thread group leader g, whose vm lock the caller holds, to
+// swap space. Pages are picked by the clock algorithm: a scan
+// of g's page table, from where the last one stopped, passes
+// over pages referenced since it last came by, clearing their
+// PTE_A for next time, and pages out the others. May sleep.
+// Returns the number of pages paged out.
+int
+uvmpageout(struct proc *g, int n)
+{
+  uint64 va = g->pageoutva, scanned, step, pa[SWAPBATCH];
+  int slot[SWAPBATCH], nout = 0, nclear = 0, s;
+  pte_t *pte, old;
+
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  for(scanned = 0; scanned < MMAPTOP && nout < n; scanned += step){
+    pte = pageoutpte(g->pagetable, va, &step);
+    if(pte && pageable(g, old = *pte, va)){
+      if(old & PTE_A){
+        __sync_fetch_and_and(pte, ~PTE_A);
+        nclear++;
+      } else if((s = swapalloc()) < 0){
+        break;
+      } else if(__sync_val_compare_and_swap(pte, old,
+                  PTE_SWAP | SLOT2PTE(s) | (old & SWAPFLAGS)) != old){
+        swapput(s);   // referenced meanwhile
+      } else {
+        slot[nout] = s;
+        pa[nout++] = PTE2PA(old);
+      }
+    }
+    if((va += step) >= MMAPTOP)
+      va = 0;
+  }
+  g->pageoutva = va;
+
+  // no thread may still reach a page through the TLB while
+  // it's written out, and the hardware must see cleared PTE_As.
+  if(nout > 0 || nclear > 0)
+    pageoutsync(g, nout > 0);
+  for(int i = 0; i < nout; i++){
+    swaprw(slot[i], pa[i], 1);
+    kfree((void*)pa[i]);
+  }
+  __sync_fetch_and_add(&vmstat.nswapout, nout);
+  return nout;
+}
+
+// Handle a page fault at va by the current process, holding
+// its vm lock so that its threads change its page table one
+// at a time. Returns the physical address, or 0.
+uint64
+uvmfault(uint64 va, int read)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  vmlock(p);
+  pa = vmfault(p->pagetable, va, read);
+  vmunlock(p);
+  return pa;
+}
+
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
@@ -1,2 +1,13 @@
 #define SBRK_EAGER 1
 #define SBRK_LAZY  2
+
+// virtual memory counters, returned by vmstat().
+struct vmstat {
+  uint64 nfault;    // page faults handled by vmfault()
+  uint64 nfaround;  // extra pages mapped by fault-around
+  uint64 nfaused;   // fault-around pages referenced before unmap
+  uint64 nfaunused; // fault-around pages unmapped unreferenced
+  uint64 nshared;   // private file pages mapped from the page cache
+  uint64 nswapout;  // pages paged out to the swap disk
+  uint64 nswapin;   // pages paged back in by vmfault()
+};
@@ -15,18 +15,21 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+// an inode for every 10 blocks, but at least 200, and no more
+// than a directory entry can name.
+#define NINODES (FSSIZE/10 < 200 ? 200 : FSSIZE/10 < 65535 ? FSSIZE/10 : 65535)
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
 int nbitmap = FSSIZE/BPB + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGBLOCKS+1;   // Header followed by LOGBLOCKS data blocks.
+int nlog = 2*(LOGBLOCKS+1);  // Two areas: header followed by LOGBLOCKS data blocks.
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+uchar *img;   // the image, built in memory and written out at the end
 struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
@@ -34,6 +37,7 @@ uint freeblock;
 
 
 void balloc(int);
+void wimg(void);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
@@ -84,10 +88,13 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct superblock) <= BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
+  if((img = calloc(FSSIZE, BSIZE)) == 0)
+    die("calloc");
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
@@ -107,9 +114,6 @@ main(int argc, char *argv[])
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -128,10 +132,12 @@ main(int argc, char *argv[])
   iappend(rootino, &de, sizeof(de));
 
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/", or "kernel/" for kernel.sym
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
       shortname = argv[i] + 5;
+    else if(strncmp(argv[i], "kernel/", 7) == 0)
+      shortname = argv[i] + 7;
     else
       shortname = argv[i];
     
@@ -170,17 +176,36 @@ main(int argc, char *argv[])
   winode(rootino, &din);
 
   balloc(freeblock);
+  wimg();
 
   exit(0);
 }
 
+// Write the image out, each run of blocks that aren't all
+// zeroes with one write, and leave the rest as holes.
+void
+wimg(void)
+{
+  uint b, e;
+
+  for(b = 0; b < FSSIZE; b = e){
+    for(e = b; e < FSSIZE && memcmp(img + (off_t)e * BSIZE, zeroes, BSIZE) != 0; e++)
+      ;
+    if(e > b && pwrite(fsfd, img + (off_t)b * BSIZE, (size_t)(e - b) * BSIZE,
+                       (off_t)b * BSIZE) != (ssize_t)(e - b) * BSIZE)
+      die("write");
+    while(e < FSSIZE && memcmp(img + (off_t)e * BSIZE, zeroes, BSIZE) == 0)
+      e++;
+  }
+  if(ftruncate(fsfd, (off_t)FSSIZE * BSIZE) < 0)
+    die("ftruncate");
+}
+
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  assert(sec < FSSIZE);
+  memmove(img + (off_t)sec * BSIZE, buf, BSIZE);
 }
 
 void
@@ -213,10 +238,8 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  assert(sec < FSSIZE);
+  memmove(buf, img + (off_t)sec * BSIZE, BSIZE);
 }
 
 uint
@@ -237,20 +260,37 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, k;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < FSSIZE);
+  for(k = 0; k * BPB < used; k++){
+    bzero(buf, BSIZE);
+    for(i = k * BPB; i < used && i < (k + 1) * BPB; i++){
+      buf[i%BPB/8] = buf[i%BPB/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", xint(sb.bmapstart) + k);
+    wsect(xint(sb.bmapstart) + k, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of indirect block blk, allocating
+// a block for it if it's empty.
+uint
+indirect(uint blk, uint i)
+{
+  uint a[NINDIRECT];
+
+  rsect(blk, (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(blk, (char*)a);
+  }
+  return xint(a[i]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,7 +298,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -272,16 +311,17 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = indirect(xint(din.addrs[NDIRECT]), fbn - NDIRECT);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = indirect(xint(din.addrs[NDIRECT+1]), (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+      x = indirect(x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -0,0 +1,379 @@
+//
+// microbenchmarks of system calls, processes, pipes, memory
+// and the file system.
+// bench [-m] [name ...]: run the named benchmarks, or all of
+// them, printing the time and cycles per operation, and the
+// throughput of those that move data. -m prints one line per
+// benchmark of tab-separated fields instead, for comparing
+// kernels by script: name, operations, total nanoseconds,
+// total cycles, bytes moved.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define TIMEHZ 10000000   // time CSR frequency on qemu's virt machine
+#define BUFSZ  8192
+
+int machine;
+char buf[BUFSZ];
+char *self;               // how to exec bench, for forkexec
+
+struct clock {
+  uint64 time;
+  uint64 cycle;
+};
+
+void
+start(struct clock *c)
+{
+  c->time = r_time();
+  c->cycle = r_cycle();
+}
+
+// Turn c, from start(), into the time since then.
+void
+stop(struct clock *c)
+{
+  c->time = r_time() - c->time;
+  c->cycle = r_cycle() - c->cycle;
+}
+
+// Print the results of n operations, moving bytes in all,
+// that took c, from stop().
+void
+report(char *name, struct clock *c, int n, uint64 bytes)
+{
+  uint64 ns = c->time * (1000000000 / TIMEHZ);
+  uint64 cycles = c->cycle;
+
+  if(machine){
+    printf("%s\t%d\t%lu\t%lu\t%lu\n", name, n, ns, cycles, bytes);
+    return;
+  }
+  printf("%s:\t%lu ns/op\t%lu cycles/op", name, ns / n, cycles / n);
+  if(bytes && ns)
+    printf("\t%lu KB/s", bytes * (1000000000 / 1024) / ns);
+  printf("\n");
+}
+
+void
+die(char *what)
+{
+  fprintf(2, "bench: %s failed\n", what);
+  exit(1);
+}
+
+void
+nullcall(void)
+{
+  struct clock c;
+  int n = 10000;
+
+  start(&c);
+  for(int i = 0; i < n; i++)
+    sys_getpid();
+  stop(&c);
+  report("nullcall", &c, n, 0);
+
+  start(&c);
+  for(int i = 0; i < n; i++)
+    getpid();
+  stop(&c);
+  report("vdsocall", &c, n, 0);
+}
+
+void
+forkwait(void)
+{
+  struct clock c;
+  int n = 100, pid;
+
+  start(&c);
+  for(int i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  stop(&c);
+  report("forkwait", &c, n, 0);
+}
+
+void
+forkexec(void)
+{
+  struct clock c;
+  int n = 50, pid;
+  char *args[] = { self, "-x", 0 };
+
+  start(&c);
+  for(int i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0){
+      exec(self, args);
+      die("exec");
+    }
+    wait(0);
+  }
+  stop(&c);
+  report("forkexec", &c, n, 0);
+}
+
+// one byte back and forth between two processes: a round
+// trip, and two switches between them, which is most of it.
+void
+pipertt(void)
+{
+  struct clock c;
+  int n = 1000, pid, p1[2], p2[2];
+  char b = 0;
+
+  if(pipe(p1) < 0 || pipe(p2) < 0)
+    die("pipe");
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    for(int i = 0; i < n; i++){
+      if(read(p1[0], &b, 1) != 1 || write(p2[1], &b, 1) != 1)
+        die("pipe echo");
+    }
+    exit(0);
+  }
+  start(&c);
+  for(int i = 0; i < n; i++){
+    if(write(p1[1], &b, 1) != 1 || read(p2[0], &b, 1) != 1)
+      die("pipe ping");
+  }
+  stop(&c);
+  report("pipertt", &c, n, 0);
+  report("ctxsw", &c, 2*n, 0);
+  wait(0);
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[0]);
+  close(p2[1]);
+}
+
+void
+pipebw(void)
+{
+  struct clock c;
+  int total = 4*1024*1024, pid, fds[2], n;
+
+  if(pipe(fds) < 0)
+    die("pipe");
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    close(fds[1]);
+    while(read(fds[0], buf, BUFSZ) > 0)
+      ;
+    exit(0);
+  }
+  close(fds[0]);
+  start(&c);
+  for(n = 0; n < total; n += BUFSZ)
+    if(write(fds[1], buf, BUFSZ) != BUFSZ)
+      die("pipe write");
+  close(fds[1]);
+  wait(0);
+  stop(&c);
+  report("pipebw", &c, total / BUFSZ, total);
+}
+
+// grow the heap by n pages, eagerly or lazily, touch them
+// all, and shrink it again.
+void
+sbrktouch(char *name, int lazy)
+{
+  struct clock c;
+  int n = 256;
+  char *p;
+
+  start(&c);
+  p = lazy ? sbrklazy(n*PGSIZE) : sbrk(n*PGSIZE);
+  if(p == SBRK_ERROR)
+    die("sbrk");
+  for(int i = 0; i < n; i++)
+    p[i*PGSIZE] = 1;
+  stop(&c);
+  report(name, &c, n, (uint64)n*PGSIZE);
+  sbrk(-n*PGSIZE);
+}
+
+void
+sbrkbench(void)
+{
+  sbrktouch("sbrkeager", 0);
+  sbrktouch("sbrklazy", 1);
+}
+
+void
+fname(char *name, int i)
+{
+  name[0] = 'b';
+  name[1] = 'f';
+  name[2] = '0' + i / 100;
+  name[3] = '0' + i / 10 % 10;
+  name[4] = '0' + i % 10;
+  name[5] = 0;
+}
+
+void
+smallfiles(void)
+{
+  struct clock c;
+  int n = 100, fd;
+  char name[8];
+
+  start(&c);
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY|O_TRUNC)) < 0 || write(fd, buf, 1024) != 1024)
+      die("small file write");
+    close(fd);
+  }
+  stop(&c);
+  report("smallwrite", &c, n, n*1024);
+
+  start(&c);
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_RDONLY)) < 0 || read(fd, buf, 1024) != 1024)
+      die("small file read");
+    close(fd);
+  }
+  stop(&c);
+  report("smallread", &c, n, n*1024);
+
+  start(&c);
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    if(unlink(name) < 0)
+      die("unlink");
+  }
+  stop(&c);
+  report("smallunlink", &c, n, 0);
+}
+
+void
+largefile(void)
+{
+  struct clock c;
+  int total = 512*1024, fd, n;
+
+  start(&c);
+  if((fd = open("bigfile", O_CREATE|O_WRONLY|O_TRUNC)) < 0)
+    die("open");
+  for(n = 0; n < total; n += BUFSZ)
+    if(write(fd, buf, BUFSZ) != BUFSZ)
+      die("large file write");
+  close(fd);
+  stop(&c);
+  report("largewrite", &c, total / BUFSZ, total);
+
+  start(&c);
+  if((fd = open("bigfile", O_RDONLY)) < 0)
+    die("open");
+  for(n = 0; n < total; n += BUFSZ)
+    if(read(fd, buf, BUFSZ) != BUFSZ)
+      die("large file read");
+  close(fd);
+  stop(&c);
+  report("largeread", &c, total / BUFSZ, total);
+
+  start(&c);
+  if(unlink("bigfile") < 0)
+    die("unlink");
+  stop(&c);
+  report("largeunlink", &c, 1, 0);
+}
+
+// stat() paths 1, 2, 4 and 8 directories deep.
+void
+nameidepth(void)
+{
+  struct clock c;
+  struct stat st;
+  char path[64], name[16];
+  int n = 200, depth, len = 0;
+
+  for(depth = 1; depth <= 8; depth++){
+    path[len++] = 'd';
+    path[len] = 0;
+    if(mkdir(path) < 0)
+      die("mkdir");
+    if((depth & (depth - 1)) == 0){
+      start(&c);
+      for(int i = 0; i < n; i++)
+        if(stat(path, &st) < 0)
+          die("stat");
+      stop(&c);
+      strcpy(name, "namei0");
+      name[5] = '0' + depth;
+      report(name, &c, n, 0);
+    }
+    path[len++] = '/';
+  }
+  while(len > 0){
+    path[--len] = 0;   // the trailing '/'
+    unlink(path);
+    len--;
+  }
+}
+
+struct bench {
+  void (*f)(void);
+  char *name;
+} benches[] = {
+  { nullcall, "nullcall" },
+  { forkwait, "forkwait" },
+  { forkexec, "forkexec" },
+  { pipertt, "pipertt" },
+  { pipebw, "pipebw" },
+  { sbrkbench, "sbrk" },
+  { smallfiles, "smallfiles" },
+  { largefile, "largefile" },
+  { nameidepth, "namei" },
+  { 0, 0 },
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct bench *b;
+  int i, ran = 0;
+
+  // forkexec's child: exit right away.
+  if(argc == 2 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+  self = argv[0];
+  if(argc > 1 && strcmp(argv[1], "-m") == 0){
+    machine = 1;
+    argc--;
+    argv++;
+  }
+
+  for(b = benches; b->f; b++){
+    if(argc > 1){
+      for(i = 1; i < argc && strcmp(argv[i], b->name) != 0; i++)
+        ;
+      if(i == argc)
+        continue;
+    }
+    b->f();
+    ran++;
+  }
+  if(ran == 0){
+    fprintf(2, "usage: bench [-m] [name ...]\n");
+    exit(1);
+  }
+  exit(0);
+}
@@ -2,7 +2,11 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
+// read and write this much at a time, so that copying a big
+// file takes few system calls.
+#define BUFSZ (16*4096)
+
+char buf[BUFSZ];
 
 void
 cat(int fd)
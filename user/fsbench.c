@@ -0,0 +1,294 @@
+//
+// parallel file system benchmark.
+// fsbench [-p procs] [-f filesize] [-b iosize] [-n ops]
+//         [-r read%] [-w write%] [-s]
+// forks procs workers (default 4), each with a file of its own
+// of filesize bytes (default 65536), that do ops operations
+// each (default 500): reads and writes of iosize bytes (default
+// 4096) at random offsets with pread() and pwrite(), read% and
+// write% of the time (default 50 and 40), and otherwise the
+// metadata operation of creating and unlinking a small file.
+// Reports throughput and latency percentiles of each kind of
+// operation. -s also prints how the lock contention and system
+// call counters changed over the run.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/lockstat.h"
+#include "kernel/sysstat.h"
+#include "user/user.h"
+
+#define TIMEHZ 10000000   // time CSR frequency on qemu's virt machine
+#define MAXPROCS 16
+#define MAXOPS   4096
+#define MAXIO    16384
+
+enum { READ, WRITE, META, NKIND };
+char *kindname[NKIND] = { "read", "write", "meta" };
+
+// what a worker sends back: its finish time, and the
+// latency of each of its ops, in time CSR units, with
+// the kind of op in the top two bits.
+struct result {
+  uint64 end;
+  int n;
+  uint lat[MAXOPS];
+};
+
+int procs = 4, filesize = 65536, iosize = 4096, nops = 500;
+int readpct = 50, writepct = 40, snap;
+char buf[MAXIO];
+struct result res;
+uint lat[NKIND][MAXPROCS*MAXOPS];
+int nlat[NKIND];
+struct lockstat ls0[NLOCKSTAT], ls1[NLOCKSTAT];
+struct sysstat ss0[NSYSCALL], ss1[NSYSCALL];
+
+uint64 randstate;
+
+uint
+rnd(void)
+{
+  randstate = randstate * 6364136223846793005UL + 1442695040888963407UL;
+  return randstate >> 33;
+}
+
+void
+die(char *what)
+{
+  fprintf(2, "fsbench: %s failed\n", what);
+  exit(1);
+}
+
+void
+setname(char *name, char c, int i)
+{
+  name[0] = 'f';
+  name[1] = 's';
+  name[2] = c;
+  name[3] = '0' + i / 10;
+  name[4] = '0' + i % 10;
+  name[5] = 0;
+}
+
+// worker i: wait for go, do the ops, and send the
+// results on out.
+void
+worker(int i, int ready, int go, int out)
+{
+  char name[8], meta[8];
+  uint64 t0;
+  int fd, mfd, kind, off;
+  uint r;
+  char c;
+
+  randstate = getpid();
+  setname(name, 'f', i);
+  setname(meta, 'm', i);
+  if((fd = open(name, O_CREATE|O_RDWR|O_TRUNC)) < 0)
+    die("create");
+  memset(buf, 'a' + i, iosize);
+  for(off = 0; off < filesize; off += iosize)
+    if(write(fd, buf, iosize) != iosize)
+      die("fill");
+
+  if(write(ready, "r", 1) != 1 || read(go, &c, 1) != 1)
+    die("start");
+  for(res.n = 0; res.n < nops; res.n++){
+    r = rnd() % 100;
+    kind = r < readpct ? READ : r < readpct + writepct ? WRITE : META;
+    off = rnd() % (filesize / iosize) * iosize;
+    t0 = r_time();
+    if(kind == READ){
+      if(pread(fd, buf, iosize, off) != iosize)
+        die("read");
+    } else if(kind == WRITE){
+      if(pwrite(fd, buf, iosize, off) != iosize)
+        die("write");
+    } else {
+      if((mfd = open(meta, O_CREATE|O_RDWR)) < 0)
+        die("meta create");
+      close(mfd);
+      if(unlink(meta) < 0)
+        die("meta unlink");
+    }
+    res.lat[res.n] = (r_time() - t0) | (uint)kind << 30;
+  }
+  res.end = r_time();
+  close(fd);
+  unlink(name);
+  if(write(out, &res, sizeof(res)) != sizeof(res))
+    die("result write");
+  exit(0);
+}
+
+// shell sort, since there may be thousands.
+void
+sort(uint *a, int n)
+{
+  int gap, i, j;
+  uint x;
+
+  for(gap = n / 2; gap > 0; gap /= 2){
+    for(i = gap; i < n; i++){
+      x = a[i];
+      for(j = i; j >= gap && a[j-gap] > x; j -= gap)
+        a[j] = a[j-gap];
+      a[j] = x;
+    }
+  }
+}
+
+// microseconds, from time CSR units.
+uint
+us(uint t)
+{
+  return t / (TIMEHZ / 1000000);
+}
+
+void
+report(uint64 elapsed)
+{
+  uint64 ops = 0, bytes, ms;
+
+  for(int k = 0; k < NKIND; k++)
+    ops += nlat[k];
+  bytes = (uint64)(nlat[READ] + nlat[WRITE]) * iosize;
+  ms = elapsed / (TIMEHZ / 1000);
+  if(ms == 0)
+    ms = 1;
+  printf("%lu ops in %lu ms: %lu ops/s, %lu KB/s\n", ops, ms,
+         ops * 1000 / ms, bytes * 1000 / 1024 / ms);
+  for(int k = 0; k < NKIND; k++){
+    int n = nlat[k];
+    if(n == 0)
+      continue;
+    sort(lat[k], n);
+    printf("%s:\t%d ops\tp50 %d us\tp90 %d us\tp99 %d us\tmax %d us\n",
+           kindname[k], n, us(lat[k][n/2]), us(lat[k][n*9/10]),
+           us(lat[k][n*99/100]), us(lat[k][n-1]));
+  }
+}
+
+// print how the counters changed since ls0 and ss0.
+void
+snapreport(void)
+{
+  int i, j, n1;
+
+  n1 = lockstat(ls1, NLOCKSTAT, 0);
+  printf("lock\tacquire\tcontend\tspin\n");
+  for(i = 0; i < n1; i++){
+    for(j = 0; j < NLOCKSTAT && strcmp(ls0[j].name, ls1[i].name) != 0; j++)
+      ;
+    if(j < NLOCKSTAT){
+      ls1[i].nacquire -= ls0[j].nacquire;
+      ls1[i].ncontend -= ls0[j].ncontend;
+      ls1[i].spin -= ls0[j].spin;
+    }
+    if(ls1[i].ncontend > 0)
+      printf("%s\t%lu\t%lu\t%lu\n", ls1[i].name, ls1[i].nacquire,
+             ls1[i].ncontend, ls1[i].spin);
+  }
+
+  sysstat(ss1, SYSSTAT_ALL, 0);
+  printf("call\tcount\tavg cycles\n");
+  for(i = 0; i < NSYSCALL; i++){
+    uint64 n = ss1[i].ncall - ss0[i].ncall;
+    if(n > 0)
+      printf("%s\t%lu\t%lu\n", ss1[i].name, n, (ss1[i].time - ss0[i].time) / n);
+  }
+}
+
+void
+usage(void)
+{
+  fprintf(2, "usage: fsbench [-p procs] [-f filesize] [-b iosize] [-n ops] [-r read%%] [-w write%%] [-s]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ready[2], go[2], out[MAXPROCS][2], i, pid;
+  uint64 t0, end = 0;
+  char c;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-s") == 0){
+      snap = 1;
+      continue;
+    }
+    if(i + 1 >= argc || argv[i][0] != '-')
+      usage();
+    int v = atoi(argv[i+1]);
+    switch(argv[i][1]){
+    case 'p': procs = v; break;
+    case 'f': filesize = v; break;
+    case 'b': iosize = v; break;
+    case 'n': nops = v; break;
+    case 'r': readpct = v; break;
+    case 'w': writepct = v; break;
+    default: usage();
+    }
+    i++;
+  }
+  if(procs < 1 || procs > MAXPROCS || nops < 1 || nops > MAXOPS ||
+     iosize < 1 || iosize > MAXIO || filesize < iosize ||
+     readpct < 0 || writepct < 0 || readpct + writepct > 100)
+    usage();
+
+  printf("fsbench: %d procs, %d-byte files, %d-byte I/O, %d ops each, %d%% read %d%% write %d%% meta\n",
+         procs, filesize, iosize, nops, readpct, writepct, 100 - readpct - writepct);
+
+  if(pipe(ready) < 0 || pipe(go) < 0)
+    die("pipe");
+  for(i = 0; i < procs; i++){
+    if(pipe(out[i]) < 0)
+      die("pipe");
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0)
+      worker(i, ready[1], go[0], out[i][1]);
+    close(out[i][1]);
+  }
+
+  for(i = 0; i < procs; i++)
+    if(read(ready[0], &c, 1) != 1)
+      die("worker start");
+  if(snap){
+    memset(ls0, 0, sizeof(ls0));
+    lockstat(ls0, NLOCKSTAT, 0);
+    sysstat(ss0, SYSSTAT_ALL, 0);
+  }
+  t0 = r_time();
+  for(i = 0; i < procs; i++)
+    if(write(go[1], "g", 1) != 1)
+      die("go");
+
+  for(i = 0; i < procs; i++){
+    char *p = (char*)&res;
+    int n, got = 0;
+    while(got < sizeof(res) && (n = read(out[i][0], p + got, sizeof(res) - got)) > 0)
+      got += n;
+    if(got != sizeof(res))
+      die("worker");
+    if(res.end > end)
+      end = res.end;
+    for(int j = 0; j < res.n; j++){
+      int k = res.lat[j] >> 30;
+      lat[k][nlat[k]++] = res.lat[j] & ~(3U << 30);
+    }
+    close(out[i][0]);
+    wait(0);
+  }
+
+  report(end - t0);
+  if(snap)
+    snapreport();
+  exit(0);
+}
@@ -1,53 +1,246 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// Reads BUFSZ bytes at a time and writes matching lines out in
+// batches, so that a big file takes few system calls. A pattern
+// with no operators is searched for as a string, through the
+// whole buffer rather than line by line; any other runs one pass
+// over each line with the bit-parallel matcher, and only patterns
+// too long for it use the backtracking one. Lines longer than
+// the buffer are split.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[1024];
+#define BUFSZ (16*4096)
+
+char buf[BUFSZ+1];
+char out[BUFSZ];
+int nout;
+char *pattern;
 int match(char*, char*);
 
+// how the pattern is searched for: a string, bit-parallel,
+// or by match().
+enum { LITERAL, NFA, BACKTRACK } how;
+
+// LITERAL: the string, and how far on a mismatch on each
+// byte at its end can skip; see findlit().
+char *lit;
+int litlen;
+int skip[256];
+
+// NFA: state i of the matcher means the first i atoms of the
+// pattern have matched, one bit each, up to 63 atoms. An atom
+// is a character, or . for any, perhaps followed by *.
+uint64 atom[256];   // atoms each byte matches
+uint64 star;        // atoms with a *
+uint64 accept;      // the state after the last atom
+int bol, eol;       // pattern starts with ^, ends with $
+
+void
+flush(void)
+{
+  if(nout > 0 && write(1, out, nout) != nout){
+    fprintf(2, "grep: write error\n");
+    exit(1);
+  }
+  nout = 0;
+}
+
+// Print the line of n bytes at p, with a newline.
+void
+emit(char *p, int n)
+{
+  if(nout + n + 1 > sizeof(out)){
+    flush();
+    if(n + 1 > sizeof(out)){
+      if(write(1, p, n) != n || write(1, "\n", 1) != 1){
+        fprintf(2, "grep: write error\n");
+        exit(1);
+      }
+      return;
+    }
+  }
+  memmove(out + nout, p, n);
+  nout += n;
+  out[nout++] = '\n';
+}
+
+// Work out how to search for re.
+void
+compile(char *re)
+{
+  int n, c;
+
+  for(n = 0; re[n]; n++)
+    if(re[n] == '.' || re[n] == '*' || (n == 0 && re[n] == '^') ||
+       (re[n] == '$' && re[n+1] == '\0'))
+      break;
+  if(re[n] == '\0'){
+    how = LITERAL;
+    lit = re;
+    litlen = n;
+    for(c = 0; c < 256; c++)
+      skip[c] = litlen;
+    for(n = 0; n < litlen - 1; n++)
+      skip[(uchar)lit[n]] = litlen - 1 - n;
+    return;
+  }
+
+  how = NFA;
+  if(*re == '^'){
+    bol = 1;
+    re++;
+  }
+  for(n = 0; *re; n++){
+    if(re[0] == '$' && re[1] == '\0'){
+      // as in matchhere(), $ is an operator only at the end.
+      eol = 1;
+      break;
+    }
+    if(n == 63){
+      how = BACKTRACK;
+      return;
+    }
+    for(c = 0; c < 256; c++)
+      if(re[0] == '.' || re[0] == c)
+        atom[c] |= (uint64)1 << n;
+    if(re[1] == '*'){
+      star |= (uint64)1 << n;
+      re++;
+    }
+    re++;
+  }
+  accept = (uint64)1 << n;
+}
+
+// Add to states s those reached by skipping atoms with a *.
+uint64
+closure(uint64 s)
+{
+  uint64 t;
+
+  while((t = s | ((s & star) << 1)) != s)
+    s = t;
+  return s;
+}
+
+// Does the line of n bytes at p match, by the NFA?
+int
+nfamatch(char *p, int n)
+{
+  uint64 s, start = closure(1), m;
+  int i;
+
+  s = start;
+  for(i = 0; i < n; i++){
+    if((s & accept) && !eol)
+      return 1;
+    m = s & atom[(uchar)p[i]];
+    s = closure(((m & ~star) << 1) | (m & star));
+    if(!bol)
+      s |= start;
+    else if(s == 0)
+      return 0;
+  }
+  return (s & accept) != 0;
+}
+
+// Find lit in the n bytes at p, Boyer-Moore-Horspool.
+// Returns where, or 0.
+char*
+findlit(char *p, int n)
+{
+  char *q, *end = p + n - litlen;
+  int i;
+
+  if(litlen == 0)
+    return p;
+  for(q = p; q <= end; q += skip[(uchar)q[litlen-1]]){
+    for(i = litlen - 1; i >= 0 && q[i] == lit[i]; i--)
+      ;
+    if(i < 0)
+      return q;
+  }
+  return 0;
+}
+
+// Print the matching lines among the n bytes at p, which
+// are whole lines without their last newline.
+void
+greplines(char *p, int n)
+{
+  char *end = p + n, *q, *e;
+
+  if(how == LITERAL){
+    while(p <= end && (q = findlit(p, end - p)) != 0){
+      for(; q > p && q[-1] != '\n'; q--)
+        ;
+      for(e = q; e < end && *e != '\n'; e++)
+        ;
+      emit(q, e - q);
+      p = e + 1;
+    }
+    return;
+  }
+
+  while(p <= end){
+    for(e = p; e < end && *e != '\n'; e++)
+      ;
+    if(how == NFA){
+      if(nfamatch(p, e - p))
+        emit(p, e - p);
+    } else {
+      *e = '\0';  // in place of the newline, which emit() adds back
+      if(match(pattern, p))
+        emit(p, e - p);
+    }
+    p = e + 1;
+  }
+}
+
 void
-grep(char *pattern, int fd)
+grep(int fd)
 {
-  int n, m;
-  char *p, *q;
+  int n, m, i;
 
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
+  while((n = read(fd, buf+m, BUFSZ-m)) > 0){
     m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
+    for(i = m; i > 0 && buf[i-1] != '\n'; i--)
+      ;
+    if(i == 0){
+      if(m == BUFSZ){
+        greplines(buf, m);  // a line too long for buf
+        m = 0;
       }
-      p = q+1;
-    }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+      continue;
     }
+    greplines(buf, i - 1);
+    m -= i;
+    memmove(buf, buf + i, m);
   }
+  if(m > 0)
+    greplines(buf, m);  // the last line has no newline
+  flush();
 }
 
 int
 main(int argc, char *argv[])
 {
   int fd, i;
-  char *pattern;
 
   if(argc <= 1){
     fprintf(2, "usage: grep pattern [file ...]\n");
     exit(1);
   }
   pattern = argv[1];
+  compile(pattern);
 
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(0);
     exit(0);
   }
 
@@ -56,7 +249,7 @@ main(int argc, char *argv[])
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit(0);
@@ -104,4 +297,3 @@ int matchstar(int c, char *re, char *text)
   }while(*text!='\0' && (*text++==c || c=='.'));
   return 0;
 }
-
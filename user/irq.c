@@ -0,0 +1,46 @@
+// Show or change where device interrupts go.
+// irq: print each device interrupt's number, name, the hart
+// it's routed to, and how many times each hart has taken it.
+// irq n hart: route interrupt n to hart from now on.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/irq.h"
+#include "user/user.h"
+
+struct irqstat st[8];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n;
+
+  if(argc == 3){
+    if(irqroute(atoi(argv[1]), atoi(argv[2])) < 0){
+      fprintf(2, "irq: cannot route %s to hart %s\n", argv[1], argv[2]);
+      exit(1);
+    }
+    exit(0);
+  }
+  if(argc != 1){
+    fprintf(2, "usage: irq [n hart]\n");
+    exit(1);
+  }
+
+  if((n = irqstat(st, sizeof(st)/sizeof(st[0]))) < 0){
+    fprintf(2, "irq: irqstat failed\n");
+    exit(1);
+  }
+  printf("irq\tname\thart");
+  for(j = 0; j < NCPU; j++)
+    printf("\tcpu%d", j);
+  printf("\n");
+  for(i = 0; i < n; i++){
+    printf("%d\t%s\t%d", st[i].irq, st[i].name, st[i].hart);
+    for(j = 0; j < NCPU; j++)
+      printf("\t%lu", st[i].count[j]);
+    printf("\n");
+  }
+  exit(0);
+}
@@ -0,0 +1,252 @@
+// Profile a command with the kernel's sampling profiler.
+// kprof [-r rate] [-n top] cmd [arg ...]: run cmd, sampling
+// every running process rate times a tick (default 10), and
+// print the top functions (default 20), kernel and user, by
+// samples. Functions come from /kernel.sym and /prog.sym,
+// which the Makefile puts in the file system.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+struct sym {
+  uint64 addr;
+  char *name;
+  int count;
+};
+
+// the symbols of the kernel or of one program,
+// sorted by address.
+struct symtab {
+  char prog[16];
+  struct sym *sym;
+  int nsym;
+  int other;             // samples at no known symbol
+  struct symtab *next;
+};
+
+struct symtab *kernel, *progs;
+struct profsample samples[256];
+int nsamples;
+
+// Read the symbols in path, as the Makefile writes them:
+// lines of a hex address and a name. A missing file
+// gives no symbols.
+void
+loadsyms(struct symtab *t, char *path)
+{
+  struct stat st;
+  char *buf, *p, *q;
+  int fd, n;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return;
+  if(fstat(fd, &st) < 0 || (buf = malloc(st.size + 1)) == 0){
+    close(fd);
+    return;
+  }
+  n = read(fd, buf, st.size);
+  close(fd);
+  if(n < 0)
+    n = 0;
+  buf[n] = 0;
+
+  t->nsym = 0;
+  for(p = buf; *p; p++)
+    if(*p == '\n')
+      t->nsym++;
+  t->sym = malloc((t->nsym + 1) * sizeof(struct sym));
+  t->nsym = 0;
+
+  for(p = buf; *p; p = q){
+    struct sym s = { 0, 0, 0 };
+    for(q = p; *q && *q != '\n'; q++)
+      ;
+    if(*q)
+      *q++ = 0;
+    for(; *p && *p != ' '; p++){
+      if(*p >= '0' && *p <= '9')
+        s.addr = s.addr*16 + *p - '0';
+      else if(*p >= 'a' && *p <= 'f')
+        s.addr = s.addr*16 + *p - 'a' + 10;
+    }
+    if(*p++ != ' ' || s.addr == 0 || *p == '.' || *p == '$' || *p == 0)
+      continue;
+    s.name = p;
+    // insert in address order.
+    n = t->nsym++;
+    while(n > 0 && t->sym[n-1].addr > s.addr){
+      t->sym[n] = t->sym[n-1];
+      n--;
+    }
+    t->sym[n] = s;
+  }
+}
+
+struct symtab*
+newtab(char *prog, char *path)
+{
+  struct symtab *t = malloc(sizeof(*t));
+
+  memset(t, 0, sizeof(*t));
+  strcpy(t->prog, prog);
+  loadsyms(t, path);
+  return t;
+}
+
+// Return the symbols for sample s, loading them
+// the first time a program is seen.
+struct symtab*
+gettab(struct profsample *s)
+{
+  struct symtab *t;
+  char path[32];
+
+  if(!s->user)
+    return kernel;
+  for(t = progs; t; t = t->next)
+    if(strcmp(t->prog, s->name) == 0)
+      return t;
+  path[0] = '/';
+  strcpy(path + 1, s->name);
+  strcpy(path + strlen(path), ".sym");
+  t = newtab(s->name, path);
+  t->next = progs;
+  progs = t;
+  return t;
+}
+
+// Count sample s against the function it's in: the
+// last symbol at or below its pc.
+void
+count(struct profsample *s)
+{
+  struct symtab *t = gettab(s);
+  int lo = 0, hi = t->nsym;
+
+  nsamples++;
+  while(lo < hi){
+    int mid = (lo + hi) / 2;
+    if(t->sym[mid].addr <= s->pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == 0)
+    t->other++;
+  else
+    t->sym[lo-1].count++;
+}
+
+void
+drain(void)
+{
+  int i, n;
+
+  while((n = profread(samples, sizeof(samples)/sizeof(samples[0]))) > 0)
+    for(i = 0; i < n; i++)
+      count(&samples[i]);
+}
+
+// Print the top n functions of all the tables, taking each
+// from the tables as it's printed.
+void
+report(int top)
+{
+  struct symtab *t, *bt;
+  struct sym *best;
+  int i, c;
+
+  kernel->next = progs;
+  printf("%d samples\n", nsamples);
+  for(; top > 0; top--){
+    best = 0;
+    bt = 0;
+    c = 0;
+    for(t = kernel; t; t = t->next){
+      if(t->other > c){
+        best = 0;
+        bt = t;
+        c = t->other;
+      }
+      for(i = 0; i < t->nsym; i++){
+        if(t->sym[i].count > c){
+          best = &t->sym[i];
+          bt = t;
+          c = best->count;
+        }
+      }
+    }
+    if(c == 0)
+      break;
+    printf("%d\t%d%%\t%s:%s\n", c, c * 100 / nsamples, bt->prog,
+           best ? best->name : "?");
+    if(best)
+      best->count = 0;
+    else
+      bt->other = 0;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rate = 10, top = 20, pid, lost, fds[2];
+  struct pollfd pfd;
+
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-r") == 0)
+      rate = atoi(argv[2]);
+    else if(strcmp(argv[1], "-n") == 0)
+      top = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || argv[1][0] == '-' || rate <= 0 || rate > PROFRATEMAX){
+    fprintf(2, "usage: kprof [-r rate] [-n top] cmd [arg ...]\n");
+    exit(1);
+  }
+
+  kernel = newtab("kernel", "/kernel.sym");
+  if(pipe(fds) < 0){
+    fprintf(2, "kprof: pipe failed\n");
+    exit(1);
+  }
+  drain();
+  nsamples = 0;
+  profile(rate);
+
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "kprof: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    // cmd holds the write end, so the read end
+    // hangs up when it exits.
+    close(fds[0]);
+    exec(argv[1], argv + 1);
+    fprintf(2, "kprof: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  close(fds[1]);
+
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  do {
+    drain();
+  } while(poll(&pfd, 1, 1) == 0);
+  wait(0);
+  lost = profile(0);
+  drain();
+
+  report(top);
+  if(lost > 0)
+    printf("%d samples lost\n", lost);
+  exit(0);
+}
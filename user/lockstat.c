@@ -0,0 +1,36 @@
+// Print the most contended spinlocks.
+// lockstat [-r] [n]: show the top n lock names (default 10);
+// -r zeroes the counters afterwards.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define MAXLOCKS 64
+
+struct lockstat ls[MAXLOCKS];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n = 10, reset = 0;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-r") == 0)
+      reset = 1;
+    else if((n = atoi(argv[i])) <= 0 || n > MAXLOCKS){
+      fprintf(2, "usage: lockstat [-r] [n]\n");
+      exit(1);
+    }
+  }
+
+  if((n = lockstat(ls, n, reset)) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+  printf("%s\t%s\t%s\t%s\n", "lock", "acquire", "contend", "spin");
+  for(i = 0; i < n; i++)
+    printf("%s\t%lu\t%lu\t%lu\n", ls[i].name, ls[i].nacquire, ls[i].ncontend, ls[i].spin);
+  exit(0);
+}
@@ -6,14 +6,77 @@
 
 static char digits[] = "0123456789ABCDEF";
 
+// Output is buffered, so that a printf() costs one write()
+// rather than one for each character. Output to the console
+// and to pipes is written at each newline and at the end of
+// each call; output to a file, only when its buffer fills, on
+// fflush(), and at exit(). As with stdio, fflush() before
+// fork() so as not to write the output twice.
+#define NOUTBUF 8     // fds with buffers of their own
+#define OUTBUFSZ 512
+
+struct outbuf {
+  int fd;
+  int n;        // bytes buffered
+  int known;    // has lazy been set?
+  int lazy;     // a file: write only when full
+  char buf[OUTBUFSZ];
+};
+
+static struct outbuf outbuf[NOUTBUF];
+
 static void
-putc(int fd, char c)
+flushbuf(struct outbuf *b)
 {
-  write(fd, &c, 1);
+  if(b->n > 0)
+    write(b->fd, b->buf, b->n);
+  b->n = 0;
+}
+
+// Return the buffer to use for fd, or tmp if fd has none.
+// Whether fd is a file is decided when it's first written.
+static struct outbuf*
+getbuf(int fd, struct outbuf *tmp)
+{
+  struct outbuf *b = tmp;
+  struct stat st;
+
+  if(fd >= 0 && fd < NOUTBUF)
+    b = &outbuf[fd];
+  if(!b->known){
+    b->fd = fd;
+    b->lazy = b != tmp && fstat(fd, &st) == 0 && st.type == T_FILE;
+    b->known = 1;
+  }
+  return b;
 }
 
 static void
-printint(int fd, long long xx, int base, int sgn)
+putc(struct outbuf *b, char c)
+{
+  b->buf[b->n++] = c;
+  if(b->n == OUTBUFSZ || (c == '\n' && !b->lazy))
+    flushbuf(b);
+}
+
+// Write out what's buffered for fd.
+void
+fflush(int fd)
+{
+  if(fd >= 0 && fd < NOUTBUF)
+    flushbuf(&outbuf[fd]);
+}
+
+// Write out everything buffered; exit() calls this.
+void
+fflushall(void)
+{
+  for(int fd = 0; fd < NOUTBUF; fd++)
+    flushbuf(&outbuf[fd]);
+}
+
+static void
+printint(struct outbuf *b, long long xx, int base, int sgn)
 {
   char buf[20];
   int i, neg;
@@ -35,16 +98,16 @@ printint(int fd, long long xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(b, buf[i]);
 }
 
 static void
-printptr(int fd, uint64 x) {
+printptr(struct outbuf *b, uint64 x) {
   int i;
-  putc(fd, '0');
-  putc(fd, 'x');
+  putc(b, '0');
+  putc(b, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(b, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %c, %s.
@@ -53,6 +116,10 @@ vprintf(int fd, const char *fmt, va_list ap)
 {
   char *s;
   int c0, c1, c2, i, state;
+  struct outbuf tmp, *b;
+
+  tmp.n = tmp.known = 0;
+  b = getbuf(fd, &tmp);
 
   state = 0;
   for(i = 0; fmt[i]; i++){
@@ -61,56 +128,58 @@ vprintf(int fd, const char *fmt, va_list ap)
       if(c0 == '%'){
         state = '%';
       } else {
-        putc(fd, c0);
+        putc(b, c0);
       }
     } else if(state == '%'){
       c1 = c2 = 0;
       if(c0) c1 = fmt[i+1] & 0xff;
       if(c1) c2 = fmt[i+2] & 0xff;
       if(c0 == 'd'){
-        printint(fd, va_arg(ap, int), 10, 1);
+        printint(b, va_arg(ap, int), 10, 1);
       } else if(c0 == 'l' && c1 == 'd'){
-        printint(fd, va_arg(ap, uint64), 10, 1);
+        printint(b, va_arg(ap, uint64), 10, 1);
         i += 1;
       } else if(c0 == 'l' && c1 == 'l' && c2 == 'd'){
-        printint(fd, va_arg(ap, uint64), 10, 1);
+        printint(b, va_arg(ap, uint64), 10, 1);
         i += 2;
       } else if(c0 == 'u'){
-        printint(fd, va_arg(ap, uint32), 10, 0);
+        printint(b, va_arg(ap, uint32), 10, 0);
       } else if(c0 == 'l' && c1 == 'u'){
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(b, va_arg(ap, uint64), 10, 0);
         i += 1;
       } else if(c0 == 'l' && c1 == 'l' && c2 == 'u'){
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(b, va_arg(ap, uint64), 10, 0);
         i += 2;
       } else if(c0 == 'x'){
-        printint(fd, va_arg(ap, uint32), 16, 0);
+        printint(b, va_arg(ap, uint32), 16, 0);
       } else if(c0 == 'l' && c1 == 'x'){
-        printint(fd, va_arg(ap, uint64), 16, 0);
+        printint(b, va_arg(ap, uint64), 16, 0);
         i += 1;
       } else if(c0 == 'l' && c1 == 'l' && c2 == 'x'){
-        printint(fd, va_arg(ap, uint64), 16, 0);
+        printint(b, va_arg(ap, uint64), 16, 0);
         i += 2;
       } else if(c0 == 'p'){
-        printptr(fd, va_arg(ap, uint64));
+        printptr(b, va_arg(ap, uint64));
       } else if(c0 == 'c'){
-        putc(fd, va_arg(ap, uint32));
+        putc(b, va_arg(ap, uint32));
       } else if(c0 == 's'){
         if((s = va_arg(ap, char*)) == 0)
           s = "(null)";
         for(; *s; s++)
-          putc(fd, *s);
+          putc(b, *s);
       } else if(c0 == '%'){
-        putc(fd, '%');
+        putc(b, '%');
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c0);
+        putc(b, '%');
+        putc(b, c0);
       }
 
       state = 0;
     }
   }
+  if(!b->lazy)
+    flushbuf(b);
 }
 
 void
@@ -53,6 +53,8 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int plaincmd(char*);
+void spawncmd(struct cmd*, int, int);
 
 // Execute cmd.  Never returns.
 void
@@ -102,14 +104,18 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    if(pcmd->left->type == EXEC){
+      spawncmd(pcmd->left, 0, p[1]);
+    } else if(fork1() == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    if(pcmd->right->type == EXEC){
+      spawncmd(pcmd->right, p[0], 1);
+    } else if(fork1() == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -168,6 +174,12 @@ main(void)
       cmd[strlen(cmd)-1] = 0;  // chop \n
       if(chdir(cmd+3) < 0)
         fprintf(2, "cannot cd %s\n", cmd+3);
+    } else if(plaincmd(cmd)){
+      // parsing can't fail, so the shell can do it itself.
+      struct cmd *c = parsecmd(cmd);
+      spawncmd(c, 0, 1);
+      wait(0);
+      free(c);
     } else {
       if(fork1() == 0)
         runcmd(parsecmd(cmd));
@@ -195,6 +207,21 @@ fork1(void)
   return pid;
 }
 
+// Start the EXEC command cmd in a new process with spawn(),
+// with standard input in and standard output out, rather
+// than forking a copy of the shell just to exec it.
+void
+spawncmd(struct cmd *cmd, int in, int out)
+{
+  struct execcmd *ecmd = (struct execcmd*)cmd;
+  int fd[3] = { in, out, 2 };
+
+  if(ecmd->argv[0] == 0)
+    return;
+  if(spawn(ecmd->argv[0], ecmd->argv, fd, 3) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+}
+
 //PAGEBREAK!
 // Constructors
 
@@ -268,6 +295,30 @@ backcmd(struct cmd *subcmd)
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
+// Is s a command and its arguments, with no redirection,
+// pipes or lists, which parsecmd() turns into a single
+// execcmd without any chance of a syntax error?
+int
+plaincmd(char *s)
+{
+  int n = 0;
+
+  while(*s){
+    while(*s && strchr(whitespace, *s))
+      s++;
+    if(*s == 0)
+      break;
+    if(++n >= MAXARGS)
+      return 0;
+    while(*s && !strchr(whitespace, *s)){
+      if(strchr(symbols, *s))
+        return 0;
+      s++;
+    }
+  }
+  return n > 0;
+}
+
 int
 gettoken(char **ps, char *es, char **q, char **eq)
 {
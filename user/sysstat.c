@@ -0,0 +1,57 @@
+// Print system call counters, or trace a command's calls.
+// sysstat [-r] [-h]: show each call's count, time and average
+// time in timer cycles over all processes since boot or the last
+// -r, which zeroes the counters afterwards; -h adds the latency
+// histograms, bucket i counting calls of 2^i to 2^(i+1) cycles.
+// sysstat -t cmd [arg ...]: run cmd, printing each system call
+// it and its children make.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/sysstat.h"
+#include "user/user.h"
+
+struct sysstat st[NSYSCALL];
+
+int
+main(int argc, char *argv[])
+{
+  int i, b, reset = 0, hist = 0;
+
+  if(argc >= 3 && strcmp(argv[1], "-t") == 0){
+    trace(~0L);
+    exec(argv[2], argv + 2);
+    trace(0);
+    fprintf(2, "sysstat: exec %s failed\n", argv[2]);
+    exit(1);
+  }
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-r") == 0)
+      reset = 1;
+    else if(strcmp(argv[i], "-h") == 0)
+      hist = 1;
+    else {
+      fprintf(2, "usage: sysstat [-r] [-h] | -t cmd [arg ...]\n");
+      exit(1);
+    }
+  }
+
+  if(sysstat(st, SYSSTAT_ALL, reset) < 0){
+    fprintf(2, "sysstat: failed\n");
+    exit(1);
+  }
+  printf("%s\t%s\t%s\t%s\n", "call", "count", "cycles", "avg");
+  for(i = 0; i < NSYSCALL; i++){
+    if(st[i].ncall == 0)
+      continue;
+    printf("%s\t%lu\t%lu\t%lu\n", st[i].name, st[i].ncall, st[i].time,
+           st[i].time / st[i].ncall);
+    if(!hist)
+      continue;
+    for(b = 0; b < NSYSHIST; b++)
+      if(st[i].hist[b])
+        printf("\t2^%d\t%lu\n", b, st[i].hist[b]);
+  }
+  exit(0);
+}
@@ -0,0 +1,58 @@
+// Run a command and print the resources it used.
+// time cmd [arg ...]: the elapsed time, the user and system
+// time of cmd and its children, their voluntary and
+// involuntary context switches, page faults, disk blocks read
+// and written, and system calls.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/rusage.h"
+#include "user/user.h"
+
+#define TIMEHZ 10000000   // time CSR frequency on qemu's virt machine
+
+uint64
+ms(uint64 t)
+{
+  return t / (TIMEHZ / 1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct rusage r0, r1;
+  uint64 t0;
+  int pid;
+
+  if(argc < 2){
+    fprintf(2, "usage: time cmd [arg ...]\n");
+    exit(1);
+  }
+  if(getrusage(RUSAGE_CHILDREN, &r0) < 0){
+    fprintf(2, "time: getrusage failed\n");
+    exit(1);
+  }
+  t0 = r_time();
+  if((pid = fork()) < 0){
+    fprintf(2, "time: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv + 1);
+    fprintf(2, "time: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  t0 = r_time() - t0;
+  getrusage(RUSAGE_CHILDREN, &r1);
+
+  printf("%lu ms real, %lu ms user, %lu ms sys\n",
+         ms(t0), ms(r1.utime - r0.utime), ms(r1.stime - r0.stime));
+  printf("%lu voluntary and %lu involuntary switches, %lu faults\n",
+         r1.nvcsw - r0.nvcsw, r1.nivcsw - r0.nivcsw, r1.nfault - r0.nfault);
+  printf("%lu blocks in, %lu out, %lu system calls\n",
+         r1.inblock - r0.inblock, r1.oublock - r0.oublock,
+         r1.nsyscall - r0.nsyscall);
+  exit(0);
+}
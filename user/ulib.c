@@ -1,8 +1,11 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
 #include "kernel/riscv.h"
 #include "kernel/vm.h"
+#include "kernel/memlayout.h"
+#include "kernel/vdso.h"
 #include "user/user.h"
 
 //
@@ -46,14 +49,38 @@ strlen(const char *s)
   return n;
 }
 
+// memset(), memmove() and memcmp() go a 64-bit word at a
+// time where they can, as in the kernel's string.c.
+typedef uint64 __attribute__((may_alias)) word;
+
+#define WSIZE sizeof(word)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE-1)) == 0)
+#define COALIGNED(p, q) ((((uint64)(p) ^ (uint64)(q)) & (WSIZE-1)) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  word w, *wd;
+
+  if(n == 0)
+    return dst;
+  for(; n > 0 && !ALIGNED(d); n--)
+    *d++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(wd = (word*)d; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4){
+    wd[0] = w;
+    wd[1] = w;
+    wd[2] = w;
+    wd[3] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE)
+    *wd++ = w;
+  for(d = (uchar*)wd; n > 0; n--)
+    *d++ = c;
   return dst;
 }
 
@@ -114,15 +141,55 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  word *wd;
+  const word *ws;
 
+  // n is signed but the word loops compare it with unsigned
+  // sizes, so a negative n would run them wild.
+  if(n <= 0)
+    return vdst;
   dst = vdst;
   src = vsrc;
   if (src > dst) {
+    if(COALIGNED(src, dst)){
+      for(; n > 0 && !ALIGNED(dst); n--)
+        *dst++ = *src++;
+      wd = (word*)dst;
+      ws = (const word*)src;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4, ws += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      dst = (char*)wd;
+      src = (const char*)ws;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(COALIGNED(src, dst)){
+      for(; n > 0 && !ALIGNED(dst); n--)
+        *--dst = *--src;
+      wd = (word*)dst;
+      ws = (const word*)src;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        wd -= 4;
+        ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      dst = (char*)wd;
+      src = (const char*)ws;
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -132,7 +199,18 @@ memmove(void *vdst, const void *vsrc, int n)
 int
 memcmp(const void *s1, const void *s2, uint n)
 {
-  const char *p1 = s1, *p2 = s2;
+  const uchar *p1 = s1, *p2 = s2;
+
+  if(COALIGNED(p1, p2)){
+    for(; n > 0 && !ALIGNED(p1); n--, p1++, p2++)
+      if(*p1 != *p2)
+        return *p1 - *p2;
+    // skip equal words; the bytes below find the difference.
+    for(; n >= WSIZE && *(word*)p1 == *(word*)p2; n -= WSIZE){
+      p1 += WSIZE;
+      p2 += WSIZE;
+    }
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -159,3 +237,35 @@ sbrklazy(int n) {
   return sys_sbrk(n, SBRK_LAZY);
 }
 
+// the kernel's page of answers; see kernel/vdso.h.
+#define vdso ((struct vdso *)VDSO)
+
+int
+getpid(void)
+{
+  // threads have pids of their own, which the vdso can't tell.
+  if(vdso->pid != 0)
+    return vdso->pid;
+  return sys_getpid();
+}
+
+// ticks since boot, as the kernel counts them: TIMESLICEs of
+// the time CSR, which user code may read.
+int
+uptime(void)
+{
+  return (uint)(r_time() / vdso->timeslice);
+}
+
+// in printf.c, if the program has it.
+extern void fflushall(void) __attribute__((weak));
+
+// write out what printf() has buffered, and exit.
+int
+exit(int status)
+{
+  if(fflushall)
+    fflushall();
+  sys_exit(status);
+}
+
@@ -4,7 +4,16 @@
 #include "kernel/param.h"
 
 // Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// The C programming Language, 2nd ed.  Section 8.7,
+// for large blocks; small ones come from per-size free
+// lists, so that allocating and freeing them is O(1).
+//
+// Every block starts with a Header. A free large block's
+// holds the next block on the address-ordered free list and
+// its size in units; a small block's holds the next on its
+// size class's list, and its class with SMALL set.
+// Small blocks are carved from slabs that the large allocator
+// hands out, and are never given back to it.
 
 typedef long Align;
 
@@ -18,15 +27,31 @@ union header {
 
 typedef union header Header;
 
+#define NCLASS   7              // small block sizes: 2, 4, ..., 128 units
+#define CLASSUNITS(c) (2 << (c))
+#define SMALL    0x80000000     // in a small block's size: not a unit count
+#define SLABUNITS (4096 / sizeof(Header))
+
 static Header base;
 static Header *freep;
+static Header *classfree[NCLASS];
+static int lazy;
 
+// Grow the heap with sbrklazy() from now on if on is set, so
+// that the kernel only allocates pages when they are touched.
 void
-free(void *ap)
+malloclazy(int on)
 {
-  Header *bp, *p;
+  lazy = on;
+}
+
+// Put large block bp back on the free list, merging it
+// with its neighbours.
+static void
+lfree(Header *bp)
+{
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,6 +68,21 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  Header *bp;
+  uint c;
+
+  bp = (Header*)ap - 1;
+  if(bp->s.size & SMALL){
+    c = bp->s.size & ~SMALL;
+    bp->s.ptr = classfree[c];
+    classfree[c] = bp;
+  } else
+    lfree(bp);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -51,22 +91,22 @@ morecore(uint nu)
 
   if(nu < 4096)
     nu = 4096;
-  p = sbrk(nu * sizeof(Header));
+  p = lazy ? sbrklazy(nu * sizeof(Header)) : sbrk(nu * sizeof(Header));
   if(p == SBRK_ERROR)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  lfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// Allocate a large block of nunits units, header included,
+// first fit.
+static Header*
+lmalloc(uint nunits)
 {
   Header *p, *prevp;
-  uint nunits;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +121,49 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
-      return (void*)(p + 1);
+      return p;
     }
     if(p == freep)
       if((p = morecore(nunits)) == 0)
         return 0;
   }
 }
+
+// Carve a new slab into blocks of class c.
+// Returns 0, or -1 if out of memory.
+static int
+refill(int c)
+{
+  Header *slab, *bp;
+
+  if((slab = lmalloc(SLABUNITS)) == 0)
+    return -1;
+  for(bp = slab; bp + CLASSUNITS(c) <= slab + SLABUNITS; bp += CLASSUNITS(c)){
+    bp->s.ptr = classfree[c];
+    classfree[c] = bp;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p;
+  uint nunits;
+  int c;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if(nunits <= CLASSUNITS(NCLASS-1)){
+    for(c = 0; CLASSUNITS(c) < nunits; c++)
+      ;
+    if(classfree[c] == 0 && refill(c) < 0)
+      return 0;
+    p = classfree[c];
+    classfree[c] = p->s.ptr;
+    p->s.size = SMALL | c;
+    return (void*)(p + 1);
+  }
+  if((p = lmalloc(nunits)) == 0)
+    return 0;
+  return (void*)(p + 1);
+}
@@ -1,10 +1,20 @@
 #define SBRK_ERROR ((char *)-1)
+#define MAP_FAILED ((char *)-1)
 
 struct stat;
+struct pollfd;
+struct iovec;
+struct uring;
+struct vmstat;
+struct lockstat;
+struct sysstat;
+struct profsample;
+struct irqstat;
+struct rusage;
 
 // system calls
 int fork(void);
-int exit(int) __attribute__((noreturn));
+int sys_exit(int) __attribute__((noreturn));
 int wait(int*);
 int pipe(int*);
 int write(int, const void*, int);
@@ -20,10 +30,37 @@ int link(const char*, const char*);
 int mkdir(const char*);
 int chdir(const char*);
 int dup(int);
-int getpid(void);
+int sys_getpid(void);
 char* sys_sbrk(int,int);
 int pause(int);
-int uptime(void);
+int sys_uptime(void);
+int vmstat(struct vmstat*);
+char* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int spawn(const char*, char**, int*, int);
+int setpriority(int, int);
+int setaffinity(int, uint64);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int lockstat(struct lockstat*, int, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int lseek(int, int, int);
+int fallocate(int, int, int);
+int splice(int, int, int);
+int poll(struct pollfd*, int, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+int ringenter(struct uring*);
+int sysstat(struct sysstat*, int, int);
+int trace(uint64);
+int profile(int);
+int profread(struct profsample*, int);
+int irqroute(int, int);
+int irqstat(struct irqstat*, int);
+int getrusage(int, struct rusage*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -39,11 +76,16 @@ int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 char* sbrk(int);
 char* sbrklazy(int);
+int exit(int) __attribute__((noreturn));
+int getpid(void);
+int uptime(void);
 
 // printf.c
 void fprintf(int, const char*, ...) __attribute__ ((format (printf, 2, 3)));
 void printf(const char*, ...) __attribute__ ((format (printf, 1, 2)));
+void fflush(int);
 
 // umalloc.c
 void* malloc(uint);
 void free(void*);
+void malloclazy(int);
@@ -4,9 +4,18 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/uio.h"
+#include "kernel/uring.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/vm.h"
+#include "kernel/lockstat.h"
+#include "kernel/sysstat.h"
+#include "kernel/prof.h"
+#include "kernel/irq.h"
+#include "kernel/rusage.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -578,6 +587,9 @@ writetest(char *s)
   }
 }
 
+// as big a file as the disk has room for, at most MAXFILE blocks.
+#define NBIG (MAXFILE < FSSIZE/2 ? MAXFILE : FSSIZE/2)
+
 void
 writebig(char *s)
 {
@@ -589,7 +601,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +621,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != NBIG){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1089,6 +1101,64 @@ mem(char *s)
   }
 }
 
+// many small blocks of assorted sizes, some freed and allocated
+// again, shouldn't overlap; a freed small block should be the
+// next one of its size; and a lazily grown heap should work.
+void
+smallmalloc(char *s)
+{
+  enum { N = 1000 };
+  static char *p[N];
+  char *q;
+  int i, j, pid, xstatus;
+
+  for(int round = 0; round < 2; round++){
+    for(i = 0; i < N; i++){
+      if(p[i])
+        continue;
+      if((p[i] = malloc(i % 300 + 1)) == 0){
+        printf("%s: malloc failed\n", s);
+        exit(1);
+      }
+      memset(p[i], i, i % 300 + 1);
+    }
+    for(i = 0; i < N; i++){
+      for(j = 0; j <= i % 300; j++){
+        if(p[i][j] != (char)i){
+          printf("%s: block %d overwritten\n", s, i);
+          exit(1);
+        }
+      }
+    }
+    for(i = 0; i < N; i += 2){
+      free(p[i]);
+      p[i] = 0;
+    }
+  }
+
+  q = malloc(40);
+  free(q);
+  if(malloc(40) != q){
+    printf("%s: freed block not reused\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    malloclazy(1);
+    q = malloc(1024*1024);
+    if(q == 0)
+      exit(1);
+    q[0] = q[1024*1024-1] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: lazy malloc failed\n", s);
+    exit(1);
+  }
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -1727,6 +1797,82 @@ bigwrite(char *s)
   }
 }
 
+// concurrent big writes and an unlink, so that group commits
+// hold more blocks than the disk has descriptors for in one
+// queue, both to write the log and to install it.
+void
+biglog(char *s)
+{
+  enum { NCHILD=4, N=2 };
+  char *names[] = { "biglog0", "biglog1", "biglog2", "biglog3" };
+  int fd, pid, i, pi, xstatus;
+
+  unlink("biglogx");
+  fd = open("biglogx", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, buf, BUFSZ) != BUFSZ){
+    printf("%s: write biglogx failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(pi = 0; pi < NCHILD; pi++){
+    unlink(names[pi]);
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      fd = open(names[pi], O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("%s: create failed\n", s);
+        exit(1);
+      }
+      memset(buf, 'a'+pi, BUFSZ);
+      for(i = 0; i < N; i++){
+        if(write(fd, buf, BUFSZ) != BUFSZ){
+          printf("%s: write failed\n", s);
+          exit(1);
+        }
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+  // frees a file's blocks while the children's writes commit.
+  if(unlink("biglogx") < 0){
+    printf("%s: unlink biglogx failed\n", s);
+    exit(1);
+  }
+  for(pi = 0; pi < NCHILD; pi++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(pi = 0; pi < NCHILD; pi++){
+    fd = open(names[pi], O_RDONLY);
+    if(fd < 0){
+      printf("%s: open %s failed\n", s, names[pi]);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd, buf, BUFSZ) != BUFSZ){
+        printf("%s: read %s failed\n", s, names[pi]);
+        exit(1);
+      }
+      for(int j = 0; j < BUFSZ; j++){
+        if(buf[j] != 'a'+pi){
+          printf("%s: %s has wrong content\n", s, names[pi]);
+          exit(1);
+        }
+      }
+    }
+    close(fd);
+    unlink(names[pi]);
+  }
+}
+
 
 void
 bigfile(char *s)
@@ -2698,171 +2844,1903 @@ lazy_copy(char *s)
   exit(0);
 }
 
-struct test {
-  void (*f)(char *);
-  char *s;
-} quicktests[] = {
-  {copyin, "copyin"},
-  {copyout, "copyout"},
-  {copyinstr1, "copyinstr1"},
-  {copyinstr2, "copyinstr2"},
-  {copyinstr3, "copyinstr3"},
-  {rwsbrk, "rwsbrk" },
-  {truncate1, "truncate1"},
-  {truncate2, "truncate2"},
-  {truncate3, "truncate3"},
-  {openiputtest, "openiput"},
-  {exitiputtest, "exitiput"},
-  {iputtest, "iput"},
-  {opentest, "opentest"},
-  {writetest, "writetest"},
-  {writebig, "writebig"},
-  {createtest, "createtest"},
-  {dirtest, "dirtest"},
-  {exectest, "exectest"},
-  {pipe1, "pipe1"},
-  {killstatus, "killstatus"},
-  {preempt, "preempt"},
-  {exitwait, "exitwait"},
-  {reparent, "reparent" },
-  {twochildren, "twochildren"},
-  {forkfork, "forkfork"},
-  {forkforkfork, "forkforkfork"},
-  {reparent2, "reparent2"},
-  {mem, "mem"},
-  {sharedfd, "sharedfd"},
-  {fourfiles, "fourfiles"},
-  {createdelete, "createdelete"},
-  {unlinkread, "unlinkread"},
-  {linktest, "linktest"},
-  {concreate, "concreate"},
-  {linkunlink, "linkunlink"},
-  {subdir, "subdir"},
-  {bigwrite, "bigwrite"},
-  {bigfile, "bigfile"},
-  {fourteen, "fourteen"},
-  {rmdot, "rmdot"},
-  {dirfile, "dirfile"},
-  {iref, "iref"},
-  {forktest, "forktest"},
-  {sbrkbasic, "sbrkbasic"},
-  {sbrkmuch, "sbrkmuch"},
-  {kernmem, "kernmem"},
-  {MAXVAplus, "MAXVAplus"},
-  {sbrkfail, "sbrkfail"},
-  {sbrkarg, "sbrkarg"},
-  {validatetest, "validatetest"},
-  {bsstest, "bsstest"},
-  {bigargtest, "bigargtest"},
-  {argptest, "argptest"},
-  {stacktest, "stacktest"},
-  {nowrite, "nowrite"},
-  {pgbug, "pgbug" },
-  {sbrkbugs, "sbrkbugs" },
-  {sbrklast, "sbrklast"},
-  {sbrk8000, "sbrk8000"},
-  {badarg, "badarg" },
-  {lazy_alloc, "lazy_alloc"},
-  {lazy_unmap, "lazy_unmap"},
-  {lazy_copy, "lazy_copy"},
-  { 0, 0},
-};
-
-//
-// Section with tests that take a fair bit of time
-//
+int countfree();
 
-// directory that uses indirect blocks
+// mmap() of files, private and shared, and of shared
+// anonymous memory, and munmap() of part of a mapping.
 void
-bigdir(char *s)
+mmaptest(char *s)
 {
-  enum { N = 500 };
-  int i, fd;
-  char name[10];
+  char *f = "mmaptest.tmp";
+  static char data[2*PGSIZE];
+  char *p, *q, *a;
+  int fd, pid, xstatus;
 
-  unlink("bd");
+  for(int i = 0; i < sizeof(data); i++)
+    data[i] = 'a' + i % 23;
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, data, sizeof(data)) != sizeof(data)){
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
 
-  fd = open("bd", O_CREATE);
-  if(fd < 0){
-    printf("%s: bigdir create failed\n", s);
+  // a private mapping sees the file, but doesn't change it.
+  p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, data, sizeof(data)) != 0 || p[2*PGSIZE] != 0){
+    printf("%s: private mapping has wrong contents\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+
+  // two shared mappings see each other's stores, and
+  // the file gets them once unmapped.
+  q = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  a = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, PGSIZE);
+  if(q == MAP_FAILED || a == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(q[0] != 'a'){
+    printf("%s: private store visible in shared mapping\n", s);
+    exit(1);
+  }
+  q[PGSIZE+1] = 'Y';
+  if(a[1] != 'Y'){
+    printf("%s: shared mappings differ\n", s);
+    exit(1);
+  }
+  if(munmap(q, 2*PGSIZE) < 0 || munmap(a, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(f, O_RDONLY);
+  if(read(fd, data, sizeof(data)) != sizeof(data) || data[0] != 'a' || data[PGSIZE+1] != 'Y'){
+    printf("%s: shared store not written back\n", s);
     exit(1);
   }
   close(fd);
+  unlink(f);
 
-  for(i = 0; i < N; i++){
-    name[0] = 'x';
-    name[1] = '0' + (i / 64);
-    name[2] = '0' + (i % 64);
-    name[3] = '\0';
-    if(link("bd", name) != 0){
-      printf("%s: bigdir i=%d link(bd, %s) failed\n", s, i, name);
-      exit(1);
-    }
+  // unmapping the middle page leaves the others mapped.
+  if(munmap(p + PGSIZE, PGSIZE) < 0 || p[0] != 'X' || p[2*PGSIZE] != 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    p[PGSIZE] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: unmapped page still accessible\n", s);
+    exit(1);
   }
 
-  unlink("bd");
-  for(i = 0; i < N; i++){
-    name[0] = 'x';
-    name[1] = '0' + (i / 64);
-    name[2] = '0' + (i % 64);
-    name[3] = '\0';
-    if(unlink(name) != 0){
-      printf("%s: bigdir unlink failed", s);
-      exit(1);
-    }
+  // shared anonymous memory is shared with children.
+  a = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
   }
+  pid = fork();
+  if(pid == 0){
+    a[3*PGSIZE] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(a[3*PGSIZE] != 'Z' || a[0] != 0){
+    printf("%s: child store not shared\n", s);
+    exit(1);
+  }
+  exit(0);
 }
 
-// concurrent writes to try to provoke deadlock in the virtio disk
-// driver.
+// spawn() starts a program in a new process with the
+// descriptors it is given, without a fork.
 void
-manywrites(char *s)
+spawntest(char *s)
 {
-  int nchildren = 4;
-  int howmany = 30; // increase to look for deadlock
-  
-  for(int ci = 0; ci < nchildren; ci++){
-    int pid = fork();
-    if(pid < 0){
-      printf("fork failed\n");
-      exit(1);
-    }
-
-    if(pid == 0){
-      char name[3];
-      name[0] = 'b';
-      name[1] = 'a' + ci;
-      name[2] = '\0';
-      unlink(name);
-      
-      for(int iters = 0; iters < howmany; iters++){
-        for(int i = 0; i < ci+1; i++){
-          int fd = open(name, O_CREATE | O_RDWR);
-          if(fd < 0){
-            printf("%s: cannot create %s\n", s, name);
-            exit(1);
-          }
-          int sz = sizeof(buf);
-          int cc = write(fd, buf, sz);
-          if(cc != sz){
-            printf("%s: write(%d) ret %d\n", s, sz, cc);
-            exit(1);
-          }
-          close(fd);
-        }
-        unlink(name);
-      }
-
-      unlink(name);
-      exit(0);
-    }
-  }
+  char *echoargv[] = { "echo", "spawned", 0 };
+  char buf[16];
+  int fds[2], fd[3];
+  int pid, n, xstatus;
 
-  for(int ci = 0; ci < nchildren; ci++){
-    int st = 0;
-    wait(&st);
-    if(st != 0)
-      exit(st);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fd[0] = 0;
+  fd[1] = fds[1];
+  fd[2] = 2;
+  pid = spawn("echo", echoargv, fd, 3);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf));
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wrong child\n", s);
+    exit(1);
+  }
+  if(n != 8 || memcmp(buf, "spawned\n", 8) != 0){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+
+  if(spawn("nonexistent", echoargv, 0, 0) >= 0){
+    printf("%s: spawn of nonexistent file succeeded\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// copies to and from user memory go through the kernel's user
+// window until they fault, and then start over page by page;
+// check copies that span pages the window can't write yet:
+// one not yet allocated, and one shared copy-on-write.
+void
+ucopyfault(char *s)
+{
+  static char cow[2*PGSIZE];
+  char *p;
+  int fds[2], pid, xstatus;
+
+  p = sbrklazy(2*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  p[0] = 'a';  // the first page is now there, the second isn't
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "0123456789", 10) != 10 ||
+     read(fds[0], p + PGSIZE - 5, 10) != 10 ||
+     memcmp(p + PGSIZE - 5, "0123456789", 10) != 0){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+
+  cow[PGSIZE] = 'x';
+  pid = fork();
+  if(pid == 0){
+    if(write(fds[1], "abcdefghij", 10) != 10 ||
+       read(fds[0], cow + PGSIZE - 5, 10) != 10 ||
+       memcmp(cow + PGSIZE - 5, "abcdefghij", 10) != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: read into copy-on-write page failed\n", s);
+    exit(1);
+  }
+  if(cow[PGSIZE] != 'x' || cow[PGSIZE-5] != 0){
+    printf("%s: child's read changed parent's memory\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  exit(0);
+}
+
+// setpriority() returns the previous setting, rejects bad
+// levels and pids, and is inherited by fork.
+void
+priority(char *s)
+{
+  int pid, xstatus;
+
+  if(setpriority(getpid(), 2) != 0 || setpriority(getpid(), 1) != 2){
+    printf("%s: setpriority didn't return previous level\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), 100) != -1 ||
+     setpriority(-1, 0) != -1){
+    printf("%s: setpriority accepted bad arguments\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0)
+    exit(setpriority(getpid(), 0));
+  wait(&xstatus);
+  if(xstatus != 1){
+    printf("%s: child didn't inherit priority\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a process pinned to one CPU, and its children, keep running.
+void
+affinity(char *s)
+{
+  int pid, xstatus;
+
+  if(setaffinity(getpid(), 0) != -1 || setaffinity(-1, 1) != -1){
+    printf("%s: setaffinity accepted bad arguments\n", s);
+    exit(1);
+  }
+  // the last CPU may not have started; then setaffinity() must
+  // refuse it, or the child would never run again.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    setaffinity(getpid(), 1L << (NCPU-1));
+    pause(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  if(setaffinity(getpid(), 1) != 0){
+    printf("%s: setaffinity failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(volatile int j = 0; j < 1000000; j++)
+        ;
+      exit(0);
+    }
+  }
+  for(int i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  exit(0);
+}
+
+// threads made by clone() share memory with the process
+// and each other, and join() collects their exit statuses.
+#define NTHREADTEST 4
+static volatile int threadcount[NTHREADTEST];
+static char *threadmem;
+
+void
+threadfn(void *arg)
+{
+  int i = (int)(uint64)arg;
+
+  for(int j = 0; j < 1000; j++)
+    threadcount[i]++;
+  // fault in pages of memory the process sbrk()ed lazily.
+  for(int j = 0; j < 4; j++)
+    threadmem[(i*4 + j) * PGSIZE] = i;
+  exit(i + 1);
+}
+
+void
+threads(char *s)
+{
+  int tid[NTHREADTEST], xstatus, t;
+  char *stack[NTHREADTEST];
+
+  threadmem = sbrklazy(NTHREADTEST*4*PGSIZE);
+  if(threadmem == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NTHREADTEST; i++){
+    if((stack[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+    tid[i] = clone(threadfn, (void*)(uint64)i, stack[i] + PGSIZE);
+    if(tid[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < NTHREADTEST; i++){
+    t = join(i == 0 ? tid[0] : 0, &xstatus);
+    if(t < 0 || (i == 0 && (t != tid[0] || xstatus != 1))){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(join(0, &xstatus) != -1){
+    printf("%s: join with no threads left succeeded\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NTHREADTEST; i++){
+    if(threadcount[i] != 1000 || threadmem[(i*4 + 3) * PGSIZE] != i){
+      printf("%s: thread %d's writes not seen\n", s, i);
+      exit(1);
+    }
+    free(stack[i]);
+  }
+  exit(0);
+}
+
+// a lock made of a futex: 0 free, 1 held, 2 held with waiters.
+static int futexlockword;
+static int futexcount;
+
+void
+futexlock(int *l)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(l, 0, 1)) == 0)
+    return;
+  do {
+    if(c == 2 || __sync_val_compare_and_swap(l, 1, 2) != 0)
+      futex_wait(l, 2);
+  } while((c = __sync_val_compare_and_swap(l, 0, 2)) != 0);
+}
+
+void
+futexunlock(int *l)
+{
+  if(__sync_fetch_and_sub(l, 1) != 1){
+    *l = 0;
+    __sync_synchronize();
+    futex_wake(l, 1);
+  }
+}
+
+void
+futexfn(void *arg)
+{
+  for(int i = 0; i < 500; i++){
+    futexlock(&futexlockword);
+    int c = futexcount;
+    if(i % 50 == 0)
+      pause(0);  // give up the CPU holding the lock
+    futexcount = c + 1;
+    futexunlock(&futexlockword);
+  }
+  exit(0);
+}
+
+// threads contending for a futex lock get it in turn.
+void
+futextest(char *s)
+{
+  int tid[NTHREADTEST];
+  char *stack[NTHREADTEST];
+  int word = 1;
+
+  if(futex_wait(&word, 0) != -1){
+    printf("%s: futex_wait slept on the wrong value\n", s);
+    exit(1);
+  }
+  if(futex_wake(&word, 1) != 0){
+    printf("%s: futex_wake woke someone\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NTHREADTEST; i++){
+    if((stack[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+    if((tid[i] = clone(futexfn, 0, stack[i] + PGSIZE)) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < NTHREADTEST; i++){
+    if(join(tid[i], 0) != tid[i]){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(futexcount != NTHREADTEST*500){
+    printf("%s: count %d, not %d\n", s, futexcount, NTHREADTEST*500);
+    exit(1);
+  }
+  exit(0);
+}
+
+// more processes than the old fixed table of 64 can be alive
+// at once.
+void
+manyprocs(char *s)
+{
+  enum { N = 200 };
+  int pid, xstatus;
+  int fds[2];
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork %d failed\n", s, i);
+      exit(1);
+    }
+    if(pid == 0){
+      // wait until all have been created.
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  for(int i = 0; i < N; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// lockstat() should report the allocator's locks, most
+// contended first.
+void
+lockstattest(char *s)
+{
+  static struct lockstat ls[NLOCKSTAT];
+  int n, i, kmem = 0;
+
+  free(malloc(8192));
+  n = lockstat(ls, NLOCKSTAT, 0);
+  if(n <= 0){
+    printf("%s: lockstat returned %d\n", s, n);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(strcmp(ls[i].name, "kmem") == 0 && ls[i].nacquire > 0)
+      kmem = 1;
+    if(i > 0 && ls[i].ncontend > ls[i-1].ncontend){
+      printf("%s: not sorted by contention\n", s);
+      exit(1);
+    }
+  }
+  if(!kmem){
+    printf("%s: no kmem acquisitions\n", s);
+    exit(1);
+  }
+}
+
+// a file bigger than the direct and indirect blocks can map
+// should go through the double-indirect block, and come back
+// intact.
+void
+dindirect(char *s)
+{
+  enum { N = NDIRECT + NINDIRECT + 40 };
+  int fd, i;
+
+  unlink("dindirect");
+  fd = open("dindirect", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write block %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("dindirect", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)i || buf[BSIZE-1] != (char)i){
+      printf("%s: block %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("dindirect");
+}
+
+// lookups that the name cache answers should see names come
+// and go: a name that wasn't there, then is, then is removed,
+// and a directory replaced by another of the same name.
+void
+dcachetest(char *s)
+{
+  int fd;
+
+  unlink("dcd/f");
+  unlink("dcd");
+  if(open("dcd/f", O_RDONLY) >= 0 || open("dcd/f", O_RDONLY) >= 0){
+    printf("%s: opened missing file\n", s);
+    exit(1);
+  }
+  if(mkdir("dcd") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/f", O_RDONLY) >= 0){
+    printf("%s: opened missing file\n", s);
+    exit(1);
+  }
+  fd = open("dcd/f", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "a", 1) != 1){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dcd/f", O_RDONLY)) < 0){
+    printf("%s: created file not found\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcd/f") < 0 || open("dcd/f", O_RDONLY) >= 0){
+    printf("%s: unlinked file still found\n", s);
+    exit(1);
+  }
+  if(unlink("dcd") < 0 || mkdir("dcd") < 0){
+    printf("%s: remaking dir failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/f", O_RDONLY) >= 0){
+    printf("%s: file found in new dir\n", s);
+    exit(1);
+  }
+  unlink("dcd");
+}
+
+// processes reading one file at once share its inode lock;
+// each should still see its own offset advance and the right
+// contents, including when a child reads through a file it
+// shares with its parent, which needs the lock exclusively.
+void
+sharedread(char *s)
+{
+  enum { NCHILD = 4, N = 20 };
+  int fd, i, j, pid, xst;
+
+  unlink("sharedread");
+  fd = open("sharedread", O_CREATE | O_RDWR);
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("sharedread", O_RDONLY);
+  for(i = 0; i < NCHILD; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      int f = fd;
+      if(i % 2 == 0){
+        close(fd);
+        f = open("sharedread", O_RDONLY);
+        for(j = 0; j < N; j++){
+          if(read(f, buf, BSIZE) != BSIZE || buf[0] != 'a' + j || buf[BSIZE-1] != 'a' + j){
+            printf("%s: block %d wrong\n", s, j);
+            exit(1);
+          }
+        }
+      } else {
+        // with the shared fd, the blocks are split between readers.
+        while((j = read(f, buf, BSIZE)) > 0){
+          if(j != BSIZE || buf[0] < 'a' || buf[0] >= 'a' + N || buf[BSIZE-1] != buf[0]){
+            printf("%s: torn block\n", s);
+            exit(1);
+          }
+        }
+      }
+      exit(0);
+    }
+  }
+  close(fd);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xst);
+    if(xst != 0)
+      exit(xst);
+  }
+  unlink("sharedread");
+}
+
+// pread() and pwrite() at offsets shouldn't move the file
+// offset, which lseek() sets and reports.
+void
+preadwrite(char *s)
+{
+  char b[8];
+  int fd;
+
+  unlink("preadwrite");
+  fd = open("preadwrite", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "abcdefgh", 8) != 8){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "XY", 2, 3) != 2 || lseek(fd, 0, SEEK_CUR) != 8){
+    printf("%s: pwrite moved the offset\n", s);
+    exit(1);
+  }
+  if(pread(fd, b, 4, 2) != 4 || memcmp(b, "cXYf", 4) != 0){
+    printf("%s: pread got the wrong data\n", s);
+    exit(1);
+  }
+  if(pread(fd, b, 4, 6) != 2 || pread(fd, b, 4, 100) != 0){
+    printf("%s: pread past the end\n", s);
+    exit(1);
+  }
+  if(lseek(fd, -3, SEEK_END) != 5 || read(fd, b, 8) != 3 || memcmp(b, "fgh", 3) != 0){
+    printf("%s: lseek SEEK_END\n", s);
+    exit(1);
+  }
+  if(lseek(fd, 1, SEEK_SET) != 1 || lseek(fd, 2, SEEK_CUR) != 3 ||
+     read(fd, b, 1) != 1 || b[0] != 'X'){
+    printf("%s: lseek SEEK_SET/SEEK_CUR\n", s);
+    exit(1);
+  }
+  if(lseek(fd, -10, SEEK_CUR) >= 0 || lseek(fd, 0, 7) >= 0){
+    printf("%s: bad lseek succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadwrite");
+}
+
+// fallocate() should reserve blocks without changing the
+// size, writes into them should read back, and truncating
+// should give them back.
+void
+fallocatetest(char *s)
+{
+  enum { N = NDIRECT + 20 };
+  struct stat st;
+  int fd, i, p[2];
+
+  unlink("fallocate");
+  fd = open("fallocate", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, 0, N*BSIZE) < 0 || fstat(fd, &st) < 0 || st.size != 0){
+    printf("%s: fallocate failed or changed the size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i % 26, BSIZE);
+    if(write(fd, buf, i == N-1 ? BSIZE/2 : BSIZE) <= 0){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if(pread(fd, buf, BSIZE, (N-1)*BSIZE) != BSIZE/2 || buf[0] != 'a' + (N-1) % 26){
+    printf("%s: wrong data in the last block\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N-1; i++){
+    if(pread(fd, buf, BSIZE, i*BSIZE) != BSIZE || buf[BSIZE-1] != 'a' + i % 26){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(fallocate(fd, -1, BSIZE) >= 0 || fallocate(fd, 0, 0) >= 0){
+    printf("%s: bad fallocate succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // more than the disk has room for.
+  fd = open("fallocate", O_RDWR | O_TRUNC);
+  if(fallocate(fd, 0, (FSSIZE+1)*BSIZE) >= 0){
+    printf("%s: fallocate bigger than the disk succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("fallocate");
+
+  if(pipe(p) < 0 || fallocate(p[1], 0, BSIZE) >= 0){
+    printf("%s: fallocate of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(p[0]);
+  close(p[1]);
+}
+
+// a shared mapping of a file maps its pages in the page cache,
+// so write() and read() see the same data as the mapping, even
+// before it's unmapped; and truncating the file drops them.
+void
+pcachetest(char *s)
+{
+  char *f = "pcache.tmp", *q, c;
+  int fd;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  memset(buf, 'a', PGSIZE);
+  if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  q = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(q == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(q[10] != 'a' || pwrite(fd, "b", 1, 10) != 1 || q[10] != 'b'){
+    printf("%s: write() not seen by the mapping\n", s);
+    exit(1);
+  }
+  q[20] = 'c';
+  if(pread(fd, &c, 1, 20) != 1 || c != 'c'){
+    printf("%s: store not seen by read()\n", s);
+    exit(1);
+  }
+  munmap(q, PGSIZE);
+  close(fd);
+
+  fd = open(f, O_RDWR|O_TRUNC);
+  if(fd < 0 || read(fd, &c, 1) != 0 || write(fd, "d", 1) != 1 ||
+     pread(fd, buf, PGSIZE, 0) != 1 || buf[0] != 'd'){
+    printf("%s: stale page after truncation\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
+// one big write() into a pipe, bigger than its ring, read in
+// odd-sized pieces, should come out whole and in order.
+void
+pipering(char *s)
+{
+  enum { N = 5*PGSIZE + 123 };
+  static char big[N];
+  int fds[2], pid, xst, i, n, tot;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    big[i] = i % 251;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if(write(fds[1], big, N) != N){
+      printf("%s: pipe write failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  memset(big, 0, N);
+  tot = 0;
+  while((n = read(fds[0], big + tot, tot + 777 <= N ? 777 : N - tot)) > 0)
+    tot += n;
+  close(fds[0]);
+  wait(&xst);
+  if(xst != 0)
+    exit(xst);
+  if(tot != N){
+    printf("%s: read %d bytes, not %d\n", s, tot, N);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(big[i] != (char)(i % 251)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+}
+
+// splice() a file into a pipe and the pipe into another file,
+// a piece at a time, and check that the copy is the same.
+void
+splicetest(char *s)
+{
+  enum { N = 3*PGSIZE + 321 };
+  static char buf[N];
+  int fd, fds[2], pid, xst, i, n, tot;
+
+  unlink("splice0");
+  unlink("splice1");
+  for(i = 0; i < N; i++)
+    buf[i] = i % 253;
+  fd = open("splice0", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: write splice0 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if((fd = open("splice0", O_RDONLY)) < 0){
+      printf("%s: open splice0 failed\n", s);
+      exit(1);
+    }
+    tot = 0;
+    while((n = splice(fd, fds[1], 1000)) > 0)
+      tot += n;
+    if(n < 0 || tot != N){
+      printf("%s: spliced %d bytes into the pipe, not %d\n", s, tot, N);
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  if((fd = open("splice1", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open splice1 failed\n", s);
+    exit(1);
+  }
+  if(splice(fds[0], fds[0], 1) != -1){
+    printf("%s: spliced a pipe into itself\n", s);
+    exit(1);
+  }
+  tot = 0;
+  while((n = splice(fds[0], fd, 777)) > 0)
+    tot += n;
+  close(fds[0]);
+  close(fd);
+  wait(&xst);
+  if(xst != 0)
+    exit(xst);
+  if(tot != N){
+    printf("%s: spliced %d bytes out of the pipe, not %d\n", s, tot, N);
+    exit(1);
+  }
+
+  memset(buf, 0, N);
+  fd = open("splice1", O_RDONLY);
+  if(fd < 0 || read(fd, buf, N) != N){
+    printf("%s: read splice1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(buf[i] != (char)(i % 253)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splice0");
+  unlink("splice1");
+}
+
+// poll() should time out with nothing ready, wake up for a
+// write to the one pipe of two that the child writes, and see
+// hang-ups and fds that aren't open.
+void
+polltest(char *s)
+{
+  struct pollfd fds[3];
+  int p0[2], p1[2], pid, xst;
+  char c;
+
+  if(pipe(p0) < 0 || pipe(p1) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fds[0].fd = p0[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = p1[0];
+  fds[1].events = POLLIN;
+  fds[2].fd = -1;
+  if(poll(fds, 2, 3) != 0 || fds[0].revents || fds[1].revents){
+    printf("%s: poll didn't time out\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    pause(2);
+    write(p1[1], "x", 1);
+    exit(0);
+  }
+  if(poll(fds, 3, -1) != 1 || fds[0].revents || fds[1].revents != POLLIN ||
+     fds[2].revents){
+    printf("%s: poll saw the wrong events\n", s);
+    exit(1);
+  }
+  if(read(p1[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  wait(&xst);
+
+  close(p0[1]);
+  fds[1].events = POLLOUT;
+  fds[1].fd = p1[1];
+  fds[2].fd = NOFILE - 1;
+  fds[2].events = POLLIN;
+  if(poll(fds, 3, 0) != 3 || fds[0].revents != (POLLIN|POLLHUP) ||
+     fds[1].revents != POLLOUT || fds[2].revents != POLLNVAL){
+    printf("%s: poll saw the wrong events after close\n", s);
+    exit(1);
+  }
+  close(p0[0]);
+  close(p1[0]);
+  close(p1[1]);
+}
+
+// writev() a header and a payload bigger than one transaction
+// to a file, and readv() them back split differently; then
+// writev() through a pipe.
+void
+iovtest(char *s)
+{
+  enum { N = 20*BSIZE + 7 };
+  static char big[N], big2[N];
+  char hdr[10], hdr2[6];
+  struct iovec iov[3];
+  int fd, fds[2], i;
+
+  for(i = 0; i < N; i++)
+    big[i] = i % 249;
+  memcpy(hdr, "header0123", sizeof(hdr));
+  unlink("iovfile");
+  if((fd = open("iovfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = 0;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = big;
+  iov[2].iov_len = N;
+  if(writev(fd, iov, 3) != sizeof(hdr) + N){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("iovfile", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = hdr2;
+  iov[0].iov_len = sizeof(hdr2);
+  iov[1].iov_base = big2;
+  iov[1].iov_len = N + sizeof(hdr) - sizeof(hdr2);
+  iov[2].iov_base = hdr2;
+  iov[2].iov_len = sizeof(hdr2);
+  if(readv(fd, iov, 3) != sizeof(hdr) + N){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iovfile");
+  if(memcmp(hdr2, "header", 6) != 0 || memcmp(big2, "0123", 4) != 0 ||
+     memcmp(big2 + 4, big, N) != 0){
+    printf("%s: readv read the wrong data\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = 6;
+  iov[1].iov_base = hdr + 6;
+  iov[1].iov_len = 4;
+  if(writev(fds[1], iov, 2) != 10){
+    printf("%s: writev to pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = hdr2;
+  iov[0].iov_len = 3;
+  iov[1].iov_base = big2;
+  iov[1].iov_len = 100;
+  if(readv(fds[0], iov, 2) != 10 || memcmp(hdr2, "hea", 3) != 0 ||
+     memcmp(big2, "der0123", 7) != 0){
+    printf("%s: readv from pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// many pipes open at once, closed and opened again, should each
+// keep their own data as the kernel's caches recycle them.
+void
+pipechurn(char *s)
+{
+  enum { N = 64 };
+  int fds[N][2], i, round;
+  char c;
+
+  for(round = 0; round < 10; round++){
+    for(i = 0; i < N; i++){
+      if(pipe(fds[i]) < 0){
+        printf("%s: pipe %d failed\n", s, i);
+        exit(1);
+      }
+      c = i + round;
+      if(write(fds[i][1], &c, 1) != 1){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    for(i = 0; i < N; i++){
+      if(read(fds[i][0], &c, 1) != 1 || c != (char)(i + round)){
+        printf("%s: pipe %d read the wrong data\n", s, i);
+        exit(1);
+      }
+      close(fds[i][0]);
+      close(fds[i][1]);
+    }
+  }
+}
+
+// a process should be able to hold many more than NOFILE
+// descriptors, up to NOFILEMAX, and fork() should pass them all on.
+void
+manyfds(char *s)
+{
+  enum { N = 4*NOFILE };
+  int fds[2], fd[N], i, pid, xst;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if((fd[i] = dup(fds[1])) < 0){
+      printf("%s: dup %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  if(fd[N-1] < N){
+    printf("%s: fd %d is too small\n", s, fd[N-1]);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(write(fd[N-1], "y", 1) != 1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0 || read(fds[0], &c, 1) != 1 || c != 'y'){
+    printf("%s: child couldn't write its high fd\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    close(fd[i]);
+  if(dup(fds[1]) != fd[0]){
+    printf("%s: dup didn't reuse the lowest fd\n", s);
+    exit(1);
+  }
+  close(fd[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// fprintf() to a file should be buffered until fflush(), and
+// then all be there, in order.
+void
+printfbuf(char *s)
+{
+  struct stat st;
+  char buf[8];
+  int fd, i;
+
+  unlink("printfbuf");
+  if((fd = open("printfbuf", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 1000; i++)
+    fprintf(fd, "%d\n", 1000 + i);
+  if(fstat(fd, &st) < 0 || st.size >= 5000){
+    printf("%s: nothing was buffered\n", s);
+    exit(1);
+  }
+  fflush(fd);
+  if(fstat(fd, &st) < 0 || st.size != 5000){
+    printf("%s: size %d after fflush, not 5000\n", s, (int)st.size);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("printfbuf", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 1000; i++){
+    if(read(fd, buf, 5) != 5 || atoi(buf) != 1000 + i || buf[4] != '\n'){
+      printf("%s: wrong line %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("printfbuf");
+}
+
+// getpid() and uptime() from the vdso page should agree with
+// the system calls, in a child too, and the page should be
+// read-only.
+void
+vdsotest(char *s)
+{
+  int pid, xst, t0, t1;
+
+  if(getpid() != sys_getpid()){
+    printf("%s: getpid %d, not %d\n", s, getpid(), sys_getpid());
+    exit(1);
+  }
+  t0 = uptime();
+  t1 = sys_uptime();
+  if(t1 < t0 || t1 > t0 + 1){
+    printf("%s: uptime %d, but sys_uptime %d\n", s, t0, t1);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(getpid() != sys_getpid())
+      exit(1);
+    pause(2);
+    if(uptime() < t1 + 2)
+      exit(2);
+    *(int *)VDSO = 0;
+    exit(3);
+  }
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: child exited with %d, not killed\n", s, xst);
+    exit(1);
+  }
+}
+
+static void
+ringput(struct uring *r, int op, int fd, void *addr, int n)
+{
+  struct sqe *e = &r->sq[r->sqtail % URING_SIZE];
+
+  e->op = op;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->n = n;
+  e->data = r->sqtail;
+  r->sqtail++;
+}
+
+// a batch of open, writes and close through ringenter(), then
+// one of open, read and close, should do what the system calls
+// would, and complete in order.
+void
+uringtest(char *s)
+{
+  static struct uring r;
+  char buf[16];
+  int fd, i;
+
+  unlink("uringfile");
+  // the open's fd isn't known when the batch is queued;
+  // it will be the lowest free one.
+  fd = dup(0);
+  close(fd);
+  ringput(&r, URING_OPEN, 0, "uringfile", O_CREATE|O_RDWR);
+  ringput(&r, URING_WRITE, fd, "abc", 3);
+  ringput(&r, URING_WRITE, fd, "defgh", 5);
+  ringput(&r, URING_CLOSE, fd, 0, 0);
+  ringput(&r, URING_CLOSE, fd, 0, 0);
+  if(ringenter(&r) != 5 || r.sqhead != 5 || r.cqtail != 5){
+    printf("%s: ringenter didn't do the whole batch\n", s);
+    exit(1);
+  }
+  int want[5] = { fd, 3, 5, 0, -1 };
+  for(i = 0; i < 5; i++){
+    struct cqe *c = &r.cq[r.cqhead % URING_SIZE];
+    if(c->data != i || c->res != want[i]){
+      printf("%s: completion %d: %d, not %d\n", s, i, c->res, want[i]);
+      exit(1);
+    }
+    r.cqhead++;
+  }
+
+  memset(buf, 0, sizeof(buf));
+  ringput(&r, URING_OPEN, 0, "uringfile", O_RDONLY);
+  ringput(&r, URING_READ, fd, buf, sizeof(buf));
+  ringput(&r, URING_CLOSE, fd, 0, 0);
+  if(ringenter(&r) != 3 || r.cq[(r.cqhead + 1) % URING_SIZE].res != 8 ||
+     strcmp(buf, "abcdefgh") != 0){
+    printf("%s: ringenter read the wrong data\n", s);
+    exit(1);
+  }
+  r.cqhead += 3;
+  if(ringenter(&r) != 0){
+    printf("%s: ringenter of an empty ring\n", s);
+    exit(1);
+  }
+  unlink("uringfile");
+}
+
+// sysstat() should count the caller's own calls from its last
+// reset, a fork child's from zero, and everyone's with a
+// histogram that adds up.
+void
+sysstattest(char *s)
+{
+  static struct sysstat st[NSYSCALL];
+  uint64 n;
+  int i, b, pid, xstatus;
+
+  if(sysstat(st, SYSSTAT_SELF, 1) != NSYSCALL){
+    printf("%s: sysstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++)
+    close(-1);
+  sysstat(st, SYSSTAT_SELF, 0);
+  if(st[SYS_close].ncall != 10 || strcmp(st[SYS_close].name, "close") != 0){
+    printf("%s: %lu calls of %s, not 10 of close\n", s,
+           st[SYS_close].ncall, st[SYS_close].name);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sysstat(st, SYSSTAT_SELF, 0);
+    exit(st[SYS_close].ncall != 0 || st[SYS_fork].ncall != 0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child inherited its parent's counts\n", s);
+    exit(1);
+  }
+
+  sysstat(st, SYSSTAT_ALL, 0);
+  if(st[SYS_close].ncall < 10 || st[SYS_close].time == 0){
+    printf("%s: close missing from the totals\n", s);
+    exit(1);
+  }
+  // other processes may make calls meanwhile, so
+  // only check a call that no one else makes.
+  n = 0;
+  for(b = 0; b < NSYSHIST; b++)
+    n += st[SYS_sysstat].hist[b];
+  if(n != st[SYS_sysstat].ncall){
+    printf("%s: sysstat histogram counts %lu of %lu calls\n", s,
+           n, st[SYS_sysstat].ncall);
+    exit(1);
+  }
+}
+
+// while profiling, a process spinning in user space for a few
+// ticks should show up in the samples, at user addresses.
+void
+proftest(char *s)
+{
+  static struct profsample ps[64];
+  int i, n, t, mine = 0;
+  volatile int x = 0;
+
+  if(profile(PROFRATEMAX + 1) != -1){
+    printf("%s: profile accepted too high a rate\n", s);
+    exit(1);
+  }
+  profile(100);
+  t = uptime();
+  while(uptime() < t + 3)
+    x++;
+  profile(0);
+  while((n = profread(ps, sizeof(ps)/sizeof(ps[0]))) > 0){
+    for(i = 0; i < n; i++)
+      if(ps[i].pid == getpid() && ps[i].user && ps[i].pc < MAXVA)
+        mine++;
+  }
+  if(n < 0 || mine == 0){
+    printf("%s: no samples of this process, %d\n", s, n);
+    exit(1);
+  }
+}
+
+// the disk's interrupt should be counted as files are written,
+// wherever it is routed, and irqroute() should refuse harts
+// that don't exist.
+uint64
+diskintrs(char *s, int *hart)
+{
+  static struct irqstat st[8];
+  uint64 total = 0;
+  int i, n;
+
+  n = irqstat(st, sizeof(st)/sizeof(st[0]));
+  for(i = 0; i < n && strcmp(st[i].name, "disk") != 0; i++)
+    ;
+  if(i >= n){
+    printf("%s: no disk in irqstat, %d\n", s, n);
+    exit(1);
+  }
+  *hart = st[i].hart;
+  for(int j = 0; j < NCPU; j++)
+    total += st[i].count[j];
+  return total;
+}
+
+void
+diskwrite(char *s)
+{
+  static char buf[BSIZE];
+  int fd;
+
+  if((fd = open("irqfile", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("irqfile");
+}
+
+void
+irqtest(char *s)
+{
+  uint64 n0, n1;
+  int hart, h;
+
+  // commits may finish in the background, so give them time.
+  n0 = diskintrs(s, &hart);
+  for(int i = 0; i < 10 && (n1 = diskintrs(s, &h)) <= n0; i++)
+    diskwrite(s);
+  if(n1 <= n0){
+    printf("%s: disk interrupts not counted\n", s);
+    exit(1);
+  }
+
+  if(irqroute(VIRTIO0_IRQ, NCPU) != -1 || irqroute(VIRTIO0_IRQ, -1) != -1 ||
+     irqroute(12345, 0) != -1){
+    printf("%s: irqroute accepted a bad irq or hart\n", s);
+    exit(1);
+  }
+  if(irqroute(VIRTIO0_IRQ, 0) < 0){
+    printf("%s: irqroute to hart 0 failed\n", s);
+    exit(1);
+  }
+  diskwrite(s);
+  diskintrs(s, &h);
+  if(h != 0){
+    printf("%s: disk routed to %d, not 0\n", s, h);
+    exit(1);
+  }
+  if(irqroute(VIRTIO0_IRQ, hart) < 0){
+    printf("%s: irqroute back to %d failed\n", s, hart);
+    exit(1);
+  }
+  diskwrite(s);
+}
+
+// a child's faults, switches and calls should show up in its
+// parent's RUSAGE_CHILDREN once it has been waited for.
+void
+rusagetest(char *s)
+{
+  struct rusage r0, r1, c0, c1;
+  int pid, n = 20;
+  char *p;
+
+  if(getrusage(2, &r0) != -1){
+    printf("%s: getrusage accepted a bad who\n", s);
+    exit(1);
+  }
+  if(getrusage(RUSAGE_SELF, &r0) < 0 || getrusage(RUSAGE_CHILDREN, &c0) < 0){
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++)
+    sys_getpid();
+  getrusage(RUSAGE_SELF, &r1);
+  if(r1.nsyscall < r0.nsyscall + n || r1.stime <= r0.stime){
+    printf("%s: calls %lu -> %lu\n", s, r0.nsyscall, r1.nsyscall);
+    exit(1);
+  }
+
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((p = sbrklazy(n*PGSIZE)) == SBRK_ERROR)
+      exit(1);
+    for(int i = 0; i < n; i++)
+      p[i*PGSIZE] = i;
+    pause(1);
+    exit(0);
+  }
+  wait(0);
+  getrusage(RUSAGE_CHILDREN, &c1);
+  if(c1.nfault < c0.nfault + n || c1.nvcsw <= c0.nvcsw ||
+     c1.nsyscall <= c0.nsyscall){
+    printf("%s: child faults %lu switches %lu calls %lu\n", s,
+           c1.nfault - c0.nfault, c1.nvcsw - c0.nvcsw, c1.nsyscall - c0.nsyscall);
+    exit(1);
+  }
+}
+
+// a large eager sbrk should get megapages where aligned; check
+// that shrinking part-way into a megapage, and fork, which both
+// split megapages into pages, keep the contents intact.
+void
+megapage(char *s)
+{
+  uint64 sz = 6*1024*1024;
+  char *p, *q;
+  int pid, xstatus;
+
+  p = sbrk(sz);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(uint64*)q = (uint64)q;
+
+  // shrink into the middle of a megapage.
+  if(sbrk(-(sz/2 + 3*PGSIZE)) == SBRK_ERROR){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  sz = sz/2 - 3*PGSIZE;
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: wrong value after shrink\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += PGSIZE){
+      if(*(uint64*)q != (uint64)q){
+        printf("%s: child saw wrong value\n", s);
+        exit(1);
+      }
+      *(uint64*)q = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: child store visible in parent\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// walking through lazily-allocated memory should take fewer
+// faults than pages, thanks to fault-around, and every page
+// fault-around maps should be accounted for when unmapped.
+void
+faultaround(char *s)
+{
+  struct vmstat vs0, vs1, vs2;
+  int n = 64;
+  char *p;
+
+  p = sbrk(0);
+  sbrk(PGSIZE - (uint64)p % PGSIZE);
+  vmstat(&vs0);
+  p = sbrklazy(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++)
+    p[i*PGSIZE] = i;
+  vmstat(&vs1);
+  if(vs1.nfault - vs0.nfault >= n || vs1.nfaround == vs0.nfaround){
+    printf("%s: %d faults for %d pages\n", s, (int)(vs1.nfault - vs0.nfault), n);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    if(p[i*PGSIZE] != i){
+      printf("%s: wrong value\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-n*PGSIZE);
+  vmstat(&vs2);
+  if((vs2.nfaused - vs1.nfaused) + (vs2.nfaunused - vs1.nfaunused) <
+     vs1.nfaround - vs0.nfaround){
+    printf("%s: fault-around pages not counted\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// exec should map a program's text from the page cache, and a
+// private file mapping reading the cache's page shouldn't see
+// later writes to the file.
+void
+sharedtext(char *s)
+{
+  static char buf[PGSIZE];
+  struct vmstat vs0, vs1;
+  char *p;
+  char *args[] = { "echo", "x", 0 };
+  int fd, pid, xstatus;
+
+  vmstat(&vs0);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    exec("echo", args);
+    exit(1);
+  }
+  wait(&xstatus);
+  vmstat(&vs1);
+  if(xstatus != 0 || vs1.nshared == vs0.nshared){
+    printf("%s: echo's text wasn't shared\n", s);
+    exit(1);
+  }
+
+  unlink("textfile");
+  fd = open("textfile", O_CREATE|O_RDWR);
+  memset(buf, 'a', sizeof(buf));
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: can't write textfile\n", s);
+    exit(1);
+  }
+  p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'a'){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "b", 1, 0) != 1 || p[0] != 'a'){
+    printf("%s: write changed a private mapping\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 1, 0) != 1 || buf[0] != 'b'){
+    printf("%s: write lost\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+  close(fd);
+  unlink("textfile");
+}
+
+// reading lazily-allocated memory should map the shared
+// zero page, not allocate, so a region larger than all of
+// free memory can be read. stores must still get private pages.
+void
+lazy_zero(char *s)
+{
+  uint64 sz = (countfree() * 2) * (uint64)PGSIZE;
+  char *p, *q;
+  int sum = 0;
+
+  p = sbrklazy(sz);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    sum += *(int*)q;
+  if(sum != 0){
+    printf("%s: lazy memory not zero\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += 1024*PGSIZE)
+    *(int*)q = 1;
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != ((q - p) % (1024*PGSIZE) == 0)){
+      printf("%s: store and zero page mixed up\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// fork a process that uses most of free memory, which
+// can only succeed if fork shares pages copy-on-write.
+// check that stores by either side stay private.
+void
+cowfork(char *s)
+{
+  uint64 sz = (countfree() * 2 / 3) * (uint64)PGSIZE;
+  char *p, *q;
+  int pid, xstatus;
+
+  p = sbrk(sz);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = 1;
+
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(q = p; q < p + sz; q += 64*PGSIZE){
+        if(*(int*)q != 1){
+          printf("%s: child saw wrong value\n", s);
+          exit(1);
+        }
+        *(int*)q = 2;
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != 1){
+      printf("%s: child store visible in parent\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+struct test {
+  void (*f)(char *);
+  char *s;
+} quicktests[] = {
+  {copyin, "copyin"},
+  {copyout, "copyout"},
+  {copyinstr1, "copyinstr1"},
+  {copyinstr2, "copyinstr2"},
+  {copyinstr3, "copyinstr3"},
+  {rwsbrk, "rwsbrk" },
+  {truncate1, "truncate1"},
+  {truncate2, "truncate2"},
+  {truncate3, "truncate3"},
+  {openiputtest, "openiput"},
+  {exitiputtest, "exitiput"},
+  {iputtest, "iput"},
+  {opentest, "opentest"},
+  {writetest, "writetest"},
+  {writebig, "writebig"},
+  {createtest, "createtest"},
+  {dirtest, "dirtest"},
+  {exectest, "exectest"},
+  {pipe1, "pipe1"},
+  {killstatus, "killstatus"},
+  {preempt, "preempt"},
+  {exitwait, "exitwait"},
+  {reparent, "reparent" },
+  {twochildren, "twochildren"},
+  {forkfork, "forkfork"},
+  {forkforkfork, "forkforkfork"},
+  {reparent2, "reparent2"},
+  {mem, "mem"},
+  {smallmalloc, "smallmalloc"},
+  {sharedfd, "sharedfd"},
+  {fourfiles, "fourfiles"},
+  {createdelete, "createdelete"},
+  {unlinkread, "unlinkread"},
+  {linktest, "linktest"},
+  {concreate, "concreate"},
+  {linkunlink, "linkunlink"},
+  {subdir, "subdir"},
+  {bigwrite, "bigwrite"},
+  {biglog, "biglog"},
+  {bigfile, "bigfile"},
+  {fourteen, "fourteen"},
+  {rmdot, "rmdot"},
+  {dirfile, "dirfile"},
+  {iref, "iref"},
+  {forktest, "forktest"},
+  {sbrkbasic, "sbrkbasic"},
+  {sbrkmuch, "sbrkmuch"},
+  {kernmem, "kernmem"},
+  {MAXVAplus, "MAXVAplus"},
+  {sbrkfail, "sbrkfail"},
+  {sbrkarg, "sbrkarg"},
+  {validatetest, "validatetest"},
+  {bsstest, "bsstest"},
+  {bigargtest, "bigargtest"},
+  {argptest, "argptest"},
+  {stacktest, "stacktest"},
+  {nowrite, "nowrite"},
+  {pgbug, "pgbug" },
+  {sbrkbugs, "sbrkbugs" },
+  {sbrklast, "sbrklast"},
+  {sbrk8000, "sbrk8000"},
+  {badarg, "badarg" },
+  {lazy_alloc, "lazy_alloc"},
+  {lazy_unmap, "lazy_unmap"},
+  {lazy_copy, "lazy_copy"},
+  {cowfork, "cowfork"},
+  {lazy_zero, "lazy_zero"},
+  {faultaround, "faultaround"},
+  {sharedtext, "sharedtext"},
+  {megapage, "megapage"},
+  {mmaptest, "mmaptest"},
+  {spawntest, "spawntest"},
+  {ucopyfault, "ucopyfault"},
+  {priority, "priority"},
+  {affinity, "affinity"},
+  {threads, "threads"},
+  {futextest, "futex"},
+  {manyprocs, "manyprocs"},
+  {lockstattest, "lockstat"},
+  {dindirect, "dindirect"},
+  {dcachetest, "dcache"},
+  {sharedread, "sharedread"},
+  {preadwrite, "preadwrite"},
+  {fallocatetest, "fallocate"},
+  {pcachetest, "pcache"},
+  {pipering, "pipering"},
+  {splicetest, "splice"},
+  {polltest, "poll"},
+  {iovtest, "iov"},
+  {manyfds, "manyfds"},
+  {pipechurn, "pipechurn"},
+  {printfbuf, "printfbuf"},
+  {vdsotest, "vdso"},
+  {uringtest, "uring"},
+  {sysstattest, "sysstat"},
+  {proftest, "prof"},
+  {irqtest, "irq"},
+  {rusagetest, "rusage"},
+  { 0, 0},
+};
+
+//
+// Section with tests that take a fair bit of time
+//
+
+// directory that uses indirect blocks
+void
+bigdir(char *s)
+{
+  enum { N = 500 };
+  int i, fd;
+  char name[10];
+
+  unlink("bd");
+
+  fd = open("bd", O_CREATE);
+  if(fd < 0){
+    printf("%s: bigdir create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[0] = 'x';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    name[3] = '\0';
+    if(link("bd", name) != 0){
+      printf("%s: bigdir i=%d link(bd, %s) failed\n", s, i, name);
+      exit(1);
+    }
+  }
+
+  unlink("bd");
+  for(i = 0; i < N; i++){
+    name[0] = 'x';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    name[3] = '\0';
+    if(unlink(name) != 0){
+      printf("%s: bigdir unlink failed", s);
+      exit(1);
+    }
+  }
+}
+
+// concurrent writes to try to provoke deadlock in the virtio disk
+// driver.
+void
+manywrites(char *s)
+{
+  int nchildren = 4;
+  int howmany = 30; // increase to look for deadlock
+  
+  for(int ci = 0; ci < nchildren; ci++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+
+    if(pid == 0){
+      char name[3];
+      name[0] = 'b';
+      name[1] = 'a' + ci;
+      name[2] = '\0';
+      unlink(name);
+      
+      for(int iters = 0; iters < howmany; iters++){
+        for(int i = 0; i < ci+1; i++){
+          int fd = open(name, O_CREATE | O_RDWR);
+          if(fd < 0){
+            printf("%s: cannot create %s\n", s, name);
+            exit(1);
+          }
+          int sz = sizeof(buf);
+          int cc = write(fd, buf, sz);
+          if(cc != sz){
+            printf("%s: write(%d) ret %d\n", s, sz, cc);
+            exit(1);
+          }
+          close(fd);
+        }
+        unlink(name);
+      }
+
+      unlink(name);
+      exit(0);
+    }
+  }
+
+  for(int ci = 0; ci < nchildren; ci++){
+    int st = 0;
+    wait(&st);
+    if(st != 0)
+      exit(st);
   }
   exit(0);
 }
@@ -3053,6 +4931,69 @@ outofinodes(char *s)
   }
 }
 
+// a process should be able to use more memory than the machine
+// has, with pages going out to the swap disk and back, and its
+// paged-out pages should be shared copy-on-write by fork.
+void
+swaptest(char *s)
+{
+  struct vmstat vs0, vs1;
+  int n = 160*1024*1024 / PGSIZE, pid, xstatus;
+  char *p;
+
+  vmstat(&vs0);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p = sbrklazy(n*PGSIZE);
+    if(p == SBRK_ERROR){
+      printf("%s: sbrklazy failed\n", s);
+      exit(1);
+    }
+    for(int i = 0; i < n; i++)
+      *(int*)(p + i*PGSIZE) = i;
+    for(int i = 0; i < n; i++){
+      if(*(int*)(p + i*PGSIZE) != i){
+        printf("%s: page %d has the wrong value\n", s, i);
+        exit(1);
+      }
+    }
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int i = 0; i < n; i += 64){
+        if(*(int*)(p + i*PGSIZE) != i)
+          exit(1);
+        *(int*)(p + i*PGSIZE) = -i;
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    for(int i = 0; i < n; i += 64){
+      if(*(int*)(p + i*PGSIZE) != i){
+        printf("%s: child's write showed up in page %d\n", s, i);
+        exit(1);
+      }
+    }
+    exit(xstatus);
+  }
+  wait(&xstatus);
+  vmstat(&vs1);
+  if(xstatus != 0 && vs1.nswapout == vs0.nswapout){
+    printf("%s: no swap space, so not run\n", s);
+    return;
+  }
+  if(xstatus != 0 || vs1.nswapin == vs0.nswapin){
+    printf("%s: failed to page memory out and back in\n", s);
+    exit(1);
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -3060,6 +5001,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swap"},
     
   { 0, 0},
 };
@@ -9,7 +9,7 @@ print "#include \"kernel/syscall.h\"\n";
 sub entry {
     my $prefix = "sys_";
     my $name = shift;
-    if ($name eq "sbrk") {
+    if ($name eq "sbrk" || $name eq "exit" || $name eq "getpid" || $name eq "uptime") {
 	print ".global $prefix$name\n";
 	print "$prefix$name:\n";
     } else {
@@ -42,3 +42,30 @@ entry("getpid");
 entry("sbrk");
 entry("pause");
 entry("uptime");
+entry("vmstat");
+entry("mmap");
+entry("munmap");
+entry("spawn");
+entry("setpriority");
+entry("setaffinity");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("lockstat");
+entry("pread");
+entry("pwrite");
+entry("lseek");
+entry("fallocate");
+entry("splice");
+entry("poll");
+entry("readv");
+entry("writev");
+entry("ringenter");
+entry("sysstat");
+entry("trace");
+entry("profile");
+entry("profread");
+entry("irqroute");
+entry("irqstat");
+entry("getrusage");
@@ -3,7 +3,10 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
+#define BUFSZ (16*4096)
+
+char buf[BUFSZ];
+char space[256];   // the bytes that separate words
 
 void
 wc(int fd, char *name)
@@ -14,13 +17,13 @@ wc(int fd, char *name)
   l = w = c = 0;
   inword = 0;
   while((n = read(fd, buf, sizeof(buf))) > 0){
+    c += n;
     for(i=0; i<n; i++){
-      c++;
-      if(buf[i] == '\n')
-        l++;
-      if(strchr(" \r\t\n\v", buf[i]))
+      if(space[(uchar)buf[i]]){
+        if(buf[i] == '\n')
+          l++;
         inword = 0;
-      else if(!inword){
+      } else if(!inword){
         w++;
         inword = 1;
       }
@@ -37,7 +40,11 @@ int
 main(int argc, char *argv[])
 {
   int fd, i;
+  char *sp;
 
+  for(sp = " \r\t\n\v"; *sp; sp++)
+    space[(uchar)*sp] = 1;
+  space[0] = 1;   // as strchr() would find it
   if(argc <= 1){
     wc(0, "");
     exit(0);